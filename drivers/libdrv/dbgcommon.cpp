@@ -249,6 +249,8 @@ const char *device_control_name(ULONG ioctl_code)
 	case vhci::ioctl::PLUGOUT_HARDWARE: return "vhci_plugout_hardware";
 	case vhci::ioctl::GET_IMPORTED_DEVICES: return "vhci_get_imported_devices";
 	case vhci::ioctl::DRIVER_REGISTRY_PATH: return "vhci_driver_registry_path";
+	case vhci::ioctl::GET_STATISTICS: return "vhci_get_statistics";
+	case vhci::ioctl::PLUGIN_HARDWARE_BATCH: return "vhci_plugin_hardware_batch";
 
 	case IOCTL_USB_DIAG_IGNORE_HUBS_ON: return "USB_DIAG_IGNORE_HUBS_ON";
 	case IOCTL_USB_DIAG_IGNORE_HUBS_OFF: return "USB_DIAG_IGNORE_HUBS_OFF";
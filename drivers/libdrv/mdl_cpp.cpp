@@ -4,74 +4,313 @@
 
 #include "mdl_cpp.h"
 
+namespace
+{
+
+using namespace usbip;
+
+const ULONG MDL_POOL_TAG = 'LDMV';
+
+enum { SIZE_CLASSES = 5 };
+const ULONG class_pages[SIZE_CLASSES] { 1, 4, 16, 64, 256 };
+const USHORT class_depth[SIZE_CLASSES] { 128, 64, 32, 16, 4 }; // of a free list
+
+/*
+ * MDL and its PFN array follow the node.
+ */
+struct mdl_node
+{
+        SLIST_ENTRY entry;
+        ULONG cls; // index in class_pages
+};
+static_assert(!(sizeof(mdl_node) % MEMORY_ALLOCATION_ALIGNMENT));
+
+struct cpu_cache // is allocated with POOL_FLAG_CACHE_ALIGNED
+{
+        SLIST_HEADER free[SIZE_CLASSES];
+        mdl_cache_stats stats;
+};
+
+cpu_cache *g_cpus;
+ULONG g_cpu_cnt;
+
+inline auto get_mdl(_In_ mdl_node *node) { return reinterpret_cast<MDL*>(node + 1); }
+inline auto get_node(_In_ MDL *mdl) { return reinterpret_cast<mdl_node*>(mdl) - 1; }
+
 /*
-* @see reactos\ntoskrnl\io\iomgr\iomdl.c
-*/
-usbip::Mdl::Mdl(_In_opt_ __drv_aliasesMem void *VirtualAddress, _In_ ULONG Length) :
-        m_mdl(IoAllocateMdl(VirtualAddress, Length, false, false, nullptr))
+ * The thread can be rescheduled to another CPU, lists are interlocked and that is not an issue.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto get_cpu_cache()
+{
+        return g_cpus ? g_cpus + KeGetCurrentProcessorNumberEx(nullptr) % g_cpu_cnt : nullptr;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto max_mdl_size(_In_opt_ const void *VirtualAddress)
+{
+        return class_pages[SIZE_CLASSES - 1]*PAGE_SIZE - BYTE_OFFSET(VirtualAddress);
+}
+
+/*
+ * Replacement of IoAllocateMdl, Length must not be greater than max_mdl_size.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+MDL *alloc_mdl(_In_opt_ void *VirtualAddress, _In_ ULONG Length)
+{
+        NT_ASSERT(Length <= max_mdl_size(VirtualAddress));
+        auto pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(VirtualAddress, Length);
+
+        ULONG cls = 0;
+        for ( ; class_pages[cls] < pages; ++cls);
+
+        mdl_node *node{};
+
+        if (auto c = get_cpu_cache()) {
+                if (auto entry = InterlockedPopEntrySList(&c->free[cls])) {
+                        node = CONTAINING_RECORD(entry, mdl_node, entry);
+                        InterlockedIncrement64(&c->stats.hits);
+                } else {
+                        InterlockedIncrement64(&c->stats.misses);
+                }
+        }
+
+        if (!node) {
+                auto sz = sizeof(*node) + sizeof(MDL) + class_pages[cls]*sizeof(PFN_NUMBER);
+                node = static_cast<mdl_node*>(ExAllocatePool2(POOL_FLAG_NON_PAGED, sz, MDL_POOL_TAG));
+                if (!node) {
+                        return nullptr;
+                }
+                node->cls = cls;
+        }
+
+        auto mdl = get_mdl(node);
+        MmInitializeMdl(mdl, VirtualAddress, Length);
+
+        return mdl;
+}
+
+/*
+ * Replacement of IoFreeMdl.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_mdl(_In_ MDL *mdl)
+{
+        MmPrepareMdlForReuse(mdl); // as IoFreeMdl does
+        auto node = get_node(mdl);
+
+        if (auto c = get_cpu_cache()) {
+                if (auto &head = c->free[node->cls]; ExQueryDepthSList(&head) < class_depth[node->cls]) {
+                        InterlockedPushEntrySList(&head, &node->entry);
+                        return;
+                }
+                InterlockedIncrement64(&c->stats.trimmed);
+        }
+
+        ExFreePoolWithTag(node, MDL_POOL_TAG);
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS usbip::init_mdl_cache()
+{
+        if (g_cpus) {
+                return STATUS_ALREADY_INITIALIZED;
+        }
+
+        auto cnt = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        auto cpus = static_cast<cpu_cache*>(ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, 
+                                                            cnt*sizeof(*g_cpus), MDL_POOL_TAG));
+        if (!cpus) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                for (auto &head: cpus[i].free) {
+                        InitializeSListHead(&head);
+                }
+        }
+
+        g_cpu_cnt = cnt;
+        g_cpus = cpus;
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+void usbip::delete_mdl_cache()
+{
+        auto cpus = g_cpus;
+        if (!cpus) {
+                return;
+        }
+
+        g_cpus = nullptr; // free_mdl will not cache
+
+        for (ULONG i = 0; i < g_cpu_cnt; ++i) {
+                for (auto &head: cpus[i].free) {
+                        while (auto entry = InterlockedPopEntrySList(&head)) {
+                                ExFreePoolWithTag(CONTAINING_RECORD(entry, mdl_node, entry), MDL_POOL_TAG);
+                        }
+                }
+        }
+
+        ExFreePoolWithTag(cpus, MDL_POOL_TAG);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_mdl_cache_stats(_Out_ mdl_cache_stats &s)
 {
+        s = {};
+
+        for (ULONG i = 0; g_cpus && i < g_cpu_cnt; ++i) {
+                auto &c = g_cpus[i].stats;
+
+                s.hits += c.hits;
+                s.misses += c.misses;
+                s.trimmed += c.trimmed;
+        }
+}
+
+usbip::Mdl::Mdl(_In_opt_ __drv_aliasesMem void *VirtualAddress, _In_ ULONG Length)
+{
+        if (!append(VirtualAddress, Length, nullptr)) {
+                reset();
+        }
 }
 
 /*
- * Impossible to build partial MDL for a chain, only for THIS SourceMdl.
+ * IoBuildPartialMdl does not treat SourceMdl as a chain, a partial MDL is built for each MDL 
+ * of the chain that the range overlaps. The result is a chain too, nothing is mapped.
+ * get() returns NULL if the chain is shorter than Offset + Length or an allocation fails.
  */
-usbip::Mdl::Mdl(_In_ MDL *SourceMdl, _In_ ULONG Offset, _In_ ULONG Length) :
-        Mdl((char*)MmGetMdlVirtualAddress(SourceMdl) + Offset, Length)
+usbip::Mdl::Mdl(_In_ MDL *SourceMdl, _In_ ULONG Offset, _In_ ULONG Length)
 {
-        NT_ASSERT(!SourceMdl->Next);
-        NT_ASSERT(Offset + Length <= MmGetMdlByteCount(SourceMdl)); // usbip::size(SourceMdl)
+        for (auto src = SourceMdl; src && Length; src = src->Next) {
+
+                auto len = MmGetMdlByteCount(src);
+                if (Offset >= len) {
+                        Offset -= len;
+                        continue;
+                }
+
+                len = min(len - Offset, Length);
+
+                if (!append((char*)MmGetMdlVirtualAddress(src) + Offset, len, src)) {
+                        break;
+                }
+
+                Offset = 0;
+                Length -= len;
+        }
 
-        if (m_mdl) {
-                NT_ASSERT(!partial());
-                IoBuildPartialMdl(SourceMdl, m_mdl, vaddr(), Length);
-                NT_ASSERT(partial());
+        if (Length) {
+                reset();
         }
 }
 
 auto usbip::Mdl::operator =(Mdl&& m) -> Mdl&
 {
         if (m_mdl != m.m_mdl) {
-                reset(m.release());
+                reset();
+
+                m_mdl = m.m_mdl;
+                m_tail = m.m_tail;
+
+                m.m_mdl = m.m_tail = nullptr;
         }
 
         return *this;
 }
 
-MDL* usbip::Mdl::release()
+/*
+ * Builds partial MDLs if SourceMdl is not NULL.
+ */
+bool usbip::Mdl::append(_In_opt_ void *VirtualAddress, _In_ ULONG Length, _In_opt_ MDL *SourceMdl)
 {
-        auto m = m_mdl;
-        m_mdl = nullptr;
-        return m;
+        do {
+                auto len = min(Length, max_mdl_size(VirtualAddress));
+
+                auto m = alloc_mdl(VirtualAddress, len);
+                if (!m) {
+                        return false;
+                }
+
+                if (SourceMdl) {
+                        IoBuildPartialMdl(SourceMdl, m, VirtualAddress, len);
+                        NT_ASSERT(partial(m));
+                }
+
+                link(m);
+
+                VirtualAddress = (char*)VirtualAddress + len;
+                Length -= len;
+        } while (Length);
+
+        return true;
 }
 
-void usbip::Mdl::reset(_In_opt_ MDL *mdl)
+void usbip::Mdl::link(_In_ MDL *m)
 {
-        if (m_mdl) {
-                NT_ASSERT(m_mdl != mdl);
-                unprepare();
-                IoFreeMdl(m_mdl); // calls MmPrepareMdlForReuse
+        if (m_tail) {
+                m_tail->Next = m;
+        } else {
+                m_mdl = m;
         }
 
-        m_mdl = mdl;
+        m_tail = m;
 }
 
+/*
+ * Tie with next() is not followed.
+ */
+void usbip::Mdl::reset()
+{
+        for (auto m = m_mdl; m; ) {
+                auto next = m == m_tail ? nullptr : m->Next;
+
+                unprepare(m);
+                free_mdl(m);
+
+                m = next;
+        }
+
+        m_mdl = m_tail = nullptr;
+}
+
+/*
+ * If fails, reset() unlocks the MDLs of the chain that were locked.
+ */
 NTSTATUS usbip::Mdl::lock(_In_ LOCK_OPERATION Operation)
 {
-        if (locked()) { // may not lock again until unlock() is called
+        if (locked(m_mdl)) { // may not lock again until unlock() is called
                 return STATUS_ALREADY_COMPLETE;
         }
 
-        __try {
-                MmProbeAndLockPages(m_mdl, KernelMode, Operation);
-        } __except (EXCEPTION_EXECUTE_HANDLER) {}
+        for (auto m = m_mdl; ; m = m->Next) {
+
+                __try {
+                        MmProbeAndLockPages(m, KernelMode, Operation);
+                } __except (EXCEPTION_EXECUTE_HANDLER) {}
 
-        return locked() ? STATUS_SUCCESS : STATUS_LOCK_NOT_GRANTED;
+                if (!locked(m)) {
+                        return STATUS_LOCK_NOT_GRANTED;
+                } else if (m == m_tail) {
+                        return STATUS_SUCCESS;
+                }
+        }
 }
 
 void usbip::Mdl::next(_In_opt_ MDL *m)
 { 
-        if (m_mdl) {
-                m_mdl->Next = m; 
+        if (m_tail) {
+                m_tail->Next = m; 
         }
 }
 
@@ -81,14 +320,18 @@ NTSTATUS usbip::Mdl::prepare_nonpaged()
                 return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        if (nonpaged()) {
+        if (nonpaged(m_mdl)) {
                 return STATUS_ALREADY_COMPLETE;
         }
 
-        MmBuildMdlForNonPagedPool(m_mdl);
-        NT_ASSERT(nonpaged());
+        for (auto m = m_mdl; ; m = m->Next) {
+                MmBuildMdlForNonPagedPool(m);
+                NT_ASSERT(nonpaged(m));
 
-        return STATUS_SUCCESS;
+                if (m == m_tail) {
+                        return STATUS_SUCCESS;
+                }
+        }
 }
 
 NTSTATUS usbip::Mdl::prepare_paged(_In_ LOCK_OPERATION Operation)
@@ -99,18 +342,18 @@ NTSTATUS usbip::Mdl::prepare_paged(_In_ LOCK_OPERATION Operation)
 /*
  * nonpaged() and partial() can be set both.
  */
-void usbip::Mdl::unprepare()
-{
-        if (locked()) {
-                NT_ASSERT(!nonpaged());
-                NT_ASSERT(!partial());
-                MmUnlockPages(m_mdl);
-                NT_ASSERT(!locked());
-        } else if (partial()) {
-                NT_ASSERT(!locked());
-                // MmPrepareMdlForReuse(m_mdl); // IoFreeMdl will call it
-        } else if (nonpaged()) { // no "undo" operation is required for MmBuildMdlForNonPagedPool
-                NT_ASSERT(!locked());
+void usbip::Mdl::unprepare(_In_ MDL *m)
+{
+        if (locked(m)) {
+                NT_ASSERT(!nonpaged(m));
+                NT_ASSERT(!partial(m));
+                MmUnlockPages(m);
+                NT_ASSERT(!locked(m));
+        } else if (partial(m)) {
+                NT_ASSERT(!locked(m));
+                // MmPrepareMdlForReuse(m); // free_mdl will call it
+        } else if (nonpaged(m)) { // no "undo" operation is required for MmBuildMdlForNonPagedPool
+                NT_ASSERT(!locked(m));
         }
 }
 
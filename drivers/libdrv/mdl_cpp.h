@@ -14,6 +14,37 @@ enum class memory { nonpaged, paged, stack = paged };
 MDL *tail(_In_opt_ MDL *mdl);
 size_t size(_In_opt_ const MDL *mdl);
 
+/*
+ * MDLs of Mdl are taken from per-CPU free lists of size classes 1, 4, 16, 64, 256 pages.
+ * If the cache is not initialized, MDLs are allocated from the pool and freed.
+ */
+struct mdl_cache_stats
+{
+        LONG64 hits; // MDL was taken from the cache
+        LONG64 misses; // free list was empty, MDL was allocated from the pool
+        LONG64 trimmed; // free list was full, MDL was freed
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+NTSTATUS init_mdl_cache();
+
+/*
+ * All Mdl-s must be destroyed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+void delete_mdl_cache();
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_mdl_cache_stats(_Out_ mdl_cache_stats &s);
+
+/*
+ * Owns an MDL or a chain of MDLs, @see Mdl(MDL*, ULONG, ULONG).
+ * A buffer that spans more pages than the largest size class is described by a chain.
+ * MDLs that are tied by next(MDL*) after the owned ones are not freed.
+ */
 class Mdl
 {
 public:
@@ -25,7 +56,7 @@ public:
         Mdl(const Mdl&) = delete;
         Mdl& operator =(const Mdl&) = delete;
 
-        Mdl(Mdl&& m) : m_mdl(m.release()) {}
+        Mdl(Mdl&& m) : m_mdl(m.m_mdl), m_tail(m.m_tail) { m.m_mdl = m.m_tail = nullptr; }
         Mdl& operator =(Mdl&& m);
 
         explicit operator bool() const { return m_mdl; }
@@ -34,31 +65,32 @@ public:
         auto get() const { return m_mdl; }
 
         auto vaddr() const { return m_mdl ? MmGetMdlVirtualAddress(m_mdl) : nullptr; }
-        auto size() const { return m_mdl ? MmGetMdlByteCount(m_mdl) : 0; }
+        auto size() const { return m_mdl ? MmGetMdlByteCount(m_mdl) : 0; } // of the first MDL, @see usbip::size
 
         void *sysaddr(_In_ ULONG Priority = NormalPagePriority | MdlMappingNoExecute);
 
         NTSTATUS prepare_nonpaged();
         NTSTATUS prepare_paged(_In_ LOCK_OPERATION Operation);
 
-        void reset() { reset(nullptr); }
+        void reset();
 
-        auto next() const { return m_mdl ? m_mdl->Next : nullptr; }
+        auto next() const { return m_tail ? m_tail->Next : nullptr; }
         void next(_In_opt_ MDL *m);
         auto& next(_Inout_ Mdl &m) { next(m.get()); return m; }
 
 private:
         MDL *m_mdl{};
+        MDL *m_tail{}; // the last owned MDL, m_mdl if it is not a chain
 
-        bool locked() const { return m_mdl->MdlFlags & MDL_PAGES_LOCKED; }
-        bool nonpaged() const { return m_mdl->MdlFlags & MDL_SOURCE_IS_NONPAGED_POOL; }
-        bool partial() const { return m_mdl->MdlFlags & MDL_PARTIAL; }
+        static bool locked(_In_ const MDL *m) { return m->MdlFlags & MDL_PAGES_LOCKED; }
+        static bool nonpaged(_In_ const MDL *m) { return m->MdlFlags & MDL_SOURCE_IS_NONPAGED_POOL; }
+        static bool partial(_In_ const MDL *m) { return m->MdlFlags & MDL_PARTIAL; }
 
         NTSTATUS lock(_In_ LOCK_OPERATION Operation);
-        void unprepare();
+        static void unprepare(_In_ MDL *m);
 
-        MDL *release();
-        void reset(_In_opt_ MDL *mdl);
+        bool append(_In_opt_ void *VirtualAddress, _In_ ULONG Length, _In_opt_ MDL *SourceMdl);
+        void link(_In_ MDL *m);
 };
 
 inline auto tail(_In_ const Mdl &mdl) { return tail(mdl.get()); }
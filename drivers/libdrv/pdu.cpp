@@ -3,7 +3,7 @@
  */
 
 #include "pdu.h"
-#include <usbip\proto.h>
+#include "pdu_simd.h"
 
 #include <intrin.h>
 #include <wdm.h>
@@ -11,51 +11,61 @@
 namespace
 {
 
-void byteswap(usbip_header_basic &r) 
-{
-        UINT32* v[]{ &r.command, &r.seqnum, &r.devid, &r.direction, &r.ep };
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+using usbip::wire::byteswap; // usbip_header_* and usbip_iso_packet_descriptor
+using namespace usbip::simd;
 
-        for (auto val: v) {
-		*val = RtlUlongByteSwap(*val); // _byteswap_ulong
-	}
-}
+#ifdef _M_X64
 
-void byteswap(usbip_header_cmd_submit &r) 
-{
-	static_assert(sizeof(r.transfer_flags) == sizeof(unsigned long));
-	r.transfer_flags = RtlUlongByteSwap(r.transfer_flags);
+/*
+ * SSE registers can be used in x64 kernel mode code without saving, but AVX registers can't. 
+ */
+enum simd_level { SIMD_UNKNOWN, SIMD_NONE, SIMD_SSSE3, SIMD_AVX2 };
+simd_level g_simd; // data race is harmless, detect() always returns the same value
 
-        INT32 *v[] {&r.transfer_buffer_length, &r.start_frame, &r.number_of_packets, &r.interval};
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
+enum { AVX2_MIN_PACKETS = 128 }; // KeSaveExtendedProcessorState is not cheap
 
-	for (auto val: v) {
-		*val = RtlUlongByteSwap(*val);
+auto detect()
+{
+	int r[4]; // EAX, EBX, ECX, EDX
+	__cpuid(r, 0);
+
+	if (auto max_leaf = r[0]; max_leaf < 1) {
+		return SIMD_NONE;
+	} else if (__cpuid(r, 1); !(r[2] & (1 << 9))) { // SSSE3
+		return SIMD_NONE;
+	} else if (max_leaf < 7 || !RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX)) {
+		return SIMD_SSSE3;
 	}
+
+	__cpuidex(r, 7, 0);
+	return r[1] & (1 << 5) ? SIMD_AVX2 : SIMD_SSSE3; // EBX
 }
 
-void byteswap(usbip_header_ret_submit &r) 
+inline auto get_simd_level()
 {
-        INT32 *v[] {&r.status, &r.actual_length, &r.start_frame, &r.number_of_packets, &r.error_count};
-        static_assert(sizeof(*v[0]) == sizeof(unsigned long));
-
-	for (auto val: v) {
-		*val = RtlUlongByteSwap(*val);
+	auto v = g_simd;
+	if (v == SIMD_UNKNOWN) {
+		g_simd = v = detect();
 	}
+	return v;
 }
 
-inline void byteswap(usbip_header_cmd_unlink &r) 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto byteswap_avx2_saved(usbip_iso_packet_descriptor *d, size_t cnt) 
 {
-	static_assert(sizeof(r.seqnum) == sizeof(unsigned long));
-	r.seqnum = RtlUlongByteSwap(r.seqnum);
-}
+	XSTATE_SAVE state;
+	if (KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &state)) {
+		return false;
+	}
 
-inline void byteswap(usbip_header_ret_unlink &r) 
-{
-	static_assert(sizeof(r.status) == sizeof(unsigned long));
-	r.status = RtlUlongByteSwap(r.status);
+	byteswap_avx2(d, cnt);
+
+	KeRestoreExtendedProcessorState(&state);
+	return true;
 }
 
+#endif // _M_X64
+
 } // namespace
 
 
@@ -85,17 +95,34 @@ void byteswap_header(usbip_header &hdr, swap_dir dir)
 	}
 }
 
+/*
+ * Runs for every isoch CMD_SUBMIT and RET_SUBMIT, up to USBIP_MAX_ISO_PACKETS.
+ */
 void byteswap(usbip_iso_packet_descriptor *d, size_t cnt) 
 {
-	for (size_t i = 0; i < cnt; ++i, ++d) {
-
-		UINT32 *v[] {&d->offset, &d->length, &d->actual_length, &d->status};
-		static_assert(sizeof(*v[0]) == sizeof(unsigned long));
-
-		for (auto val: v) {
-			*val = RtlUlongByteSwap(*val);
+#ifdef _M_X64
+	switch (get_simd_level()) {
+	case SIMD_AVX2:
+		if (cnt >= AVX2_MIN_PACKETS && byteswap_avx2_saved(d, cnt)) {
+			return;
 		}
+		[[fallthrough]];
+	case SIMD_SSSE3:
+		byteswap_ssse3(d, cnt);
+		return;
+	}
+#endif
+	byteswap_scalar(d, cnt);
+}
+
+size_t byteswap_and_validate(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+#ifdef _M_X64
+	if (get_simd_level() >= SIMD_SSSE3) {
+		return byteswap_and_validate_ssse3(d, cnt) ? cnt : find_invalid(d, cnt);
 	}
+#endif
+	return byteswap_and_validate_scalar(d, cnt);
 }
 
 void byteswap_payload(usbip_header &hdr) 
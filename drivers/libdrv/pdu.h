@@ -12,6 +12,12 @@ void byteswap_header(usbip_header &hdr, swap_dir dir);
 void byteswap_payload(usbip_header &hdr);
 void byteswap(usbip_iso_packet_descriptor *d, size_t cnt);
 
+/*
+ * Byteswap descriptors from the server and check that actual_length <= length, offsets do not decrease.
+ * @return index of the first invalid descriptor or cnt, all descriptors are swapped anyway
+ */
+size_t byteswap_and_validate(usbip_iso_packet_descriptor *d, size_t cnt);
+
 /*
  * For a server's response, set hdr.base.direction to the value from the corresponding request, 
  * otherwise the result will be incorrect.
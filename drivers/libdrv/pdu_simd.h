@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/codec.h>
+
+#include <stddef.h>
+#include <limits.h>
+
+/*
+ * Kernels of byteswap for usbip_iso_packet_descriptor[], CPU dispatch is in pdu.cpp.
+ * Does not depend on WDK headers and can be compiled in user mode, @see tests/byteswap_bench.cpp.
+ */
+namespace usbip::simd
+{
+
+inline void byteswap_scalar(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+	for (auto end = d + cnt; d != end; ++d) {
+		wire::byteswap(*d);
+	}
+}
+
+/*
+ * @return index of the first invalid descriptor or cnt
+ */
+inline auto find_invalid(const usbip_iso_packet_descriptor *d, size_t cnt)
+{
+	size_t i = 0;
+
+	for ( ; i < cnt; ++i) {
+		if (d[i].actual_length > d[i].length || (i && d[i - 1].offset > d[i].offset)) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+inline auto byteswap_and_validate_scalar(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+	size_t invalid = cnt;
+
+	for (size_t i = 0; i < cnt; ++i) {
+		auto &cur = d[i];
+		wire::byteswap(cur);
+
+		if (invalid == cnt && (cur.actual_length > cur.length || (i && d[i - 1].offset > cur.offset))) {
+			invalid = i;
+		}
+	}
+
+	return invalid;
+}
+
+} // namespace usbip::simd
+
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+#include <immintrin.h>
+
+/*
+ * The caller must check that CPU supports SSSE3 or AVX2.
+ * GCC and Clang require -mssse3 -mavx2 for these functions.
+ */
+namespace usbip::simd
+{
+
+/*
+ * Each usbip_iso_packet_descriptor occupies one XMM register, it has four UINT32.
+ */
+inline auto bswap32_mask128()
+{
+	return _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+}
+
+inline void byteswap_ssse3(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+	static_assert(sizeof(*d) == sizeof(__m128i));
+	auto mask = bswap32_mask128();
+
+	for (auto end = d + cnt; d != end; ++d) {
+		auto p = reinterpret_cast<__m128i*>(d);
+		_mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+	}
+}
+
+/*
+ * AVX registers must be saved by the caller in kernel mode.
+ */
+inline void byteswap_avx2(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+	auto mask = _mm256_broadcastsi128_si256(bswap32_mask128()); // vpshufb shuffles within 128-bit lanes
+
+	for ( ; cnt >= 2; d += 2, cnt -= 2) {
+		auto p = reinterpret_cast<__m256i*>(d);
+		_mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+	}
+
+	_mm256_zeroupper();
+
+	if (cnt) {
+		wire::byteswap(*d);
+	}
+}
+
+/*
+ * Unsigned a > b for each UINT32, SSE2 has signed comparison only.
+ */
+inline auto cmpgt_epu32(__m128i a, __m128i b)
+{
+	auto sign = _mm_set1_epi32(INT_MIN);
+	return _mm_cmpgt_epi32(_mm_xor_si128(a, sign), _mm_xor_si128(b, sign));
+}
+
+/*
+ * Lanes after byteswap: offset, length, actual_length, status.
+ * @return true if all descriptors are valid
+ */
+inline auto byteswap_and_validate_ssse3(usbip_iso_packet_descriptor *d, size_t cnt) 
+{
+	auto mask = bswap32_mask128();
+
+	auto bad_length = _mm_setzero_si128(); // lane 1
+	auto bad_offset = _mm_setzero_si128(); // lane 0
+	auto prev = _mm_setzero_si128(); // lane 0 is the offset of the previous descriptor
+
+	for (auto end = d + cnt; d != end; ++d) {
+		auto p = reinterpret_cast<__m128i*>(d);
+
+		auto v = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+		_mm_storeu_si128(p, v);
+
+		auto actual_length = _mm_srli_si128(v, sizeof(UINT32)); // to lane 1
+		bad_length = _mm_or_si128(bad_length, cmpgt_epu32(actual_length, v));
+
+		bad_offset = _mm_or_si128(bad_offset, cmpgt_epu32(prev, v));
+		prev = v;
+	}
+
+	auto bad = (_mm_movemask_ps(_mm_castsi128_ps(bad_length)) & 0b10) | 
+		   (_mm_movemask_ps(_mm_castsi128_ps(bad_offset)) & 0b01);
+
+	return !bad;
+}
+
+} // namespace usbip::simd
+
+#endif // x64
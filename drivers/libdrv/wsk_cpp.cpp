@@ -359,6 +359,98 @@ PAGED auto wait_invokers(_Inout_ SOCKET &s)
         return STATUS_SUCCESS;
 }
 
+struct connect_attempt
+{
+        SOCKET *sock;
+        const ADDRINFOEXW *ai;
+        KEVENT completed; // is set once for WskConnect, its IRP is misc_irp
+        bool pending;
+};
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS connect_complete(_In_ DEVICE_OBJECT*, _In_ IRP*, _In_ void *context)
+{
+        auto &a = *static_cast<connect_attempt*>(context);
+        KeSetEvent(&a.completed, IO_NO_INCREMENT, false);
+        return StopCompletion;
+}
+
+/*
+ * RFC 8305, 4. Sorting Addresses: interleave address families, the family of the first one goes first.
+ * @return number of addresses in v
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto interleave(_Out_writes_(CONNECT_ATTEMPTS_MAX) connect_attempt *v, _In_ const ADDRINFOEXW *head)
+{
+        PAGED_CODE();
+
+        const ADDRINFOEXW *first[CONNECT_ATTEMPTS_MAX];
+        const ADDRINFOEXW *other[CONNECT_ATTEMPTS_MAX];
+
+        int first_cnt = 0;
+        int other_cnt = 0;
+
+        for (auto ai = head; ai && first_cnt + other_cnt < CONNECT_ATTEMPTS_MAX; ai = ai->ai_next) {
+                if (ai->ai_family == head->ai_family) {
+                        first[first_cnt++] = ai;
+                } else {
+                        other[other_cnt++] = ai;
+                }
+        }
+
+        int cnt = 0;
+
+        for (int i = 0, j = 0; i < first_cnt || j < other_cnt; ) {
+                if (i < first_cnt) {
+                        v[cnt++].ai = first[i++];
+                }
+                if (j < other_cnt) {
+                        v[cnt++].ai = other[j++];
+                }
+        }
+
+        return cnt;
+}
+
+/*
+ * @return true if WskConnect is in progress
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto start(
+        _Inout_ connect_attempt &a, _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ addrinfo_f prepare, _Inout_opt_ void *ctx)
+{
+        PAGED_CODE();
+
+        auto &ai = *a.ai;
+        KeInitializeEvent(&a.completed, SynchronizationEvent, false);
+
+        if (socket(a.sock, static_cast<ADDRESS_FAMILY>(ai.ai_family), 
+                   static_cast<USHORT>(ai.ai_socktype), ai.ai_protocol, Flags, SocketContext, Dispatch)) {
+                NT_ASSERT(!a.sock);
+                return false;
+        }
+
+        if (auto err = prepare(a.sock, ai, ctx)) {
+                NT_VERIFY(!close(a.sock));
+                free(a.sock);
+                return false;
+        }
+
+        auto &irp = a.sock->misc_irp;
+        irp.reset();
+        IoSetCompletionRoutine(irp.get(), connect_complete, &a, true, true, true);
+
+        if (auto st = a.sock->invoke(&a.sock->misc_cnt, a.sock->Connection->WskConnect, a.sock->Self, ai.ai_addr, 0, irp.get());
+            st == STATUS_NOT_SUPPORTED) { // IRP is not completed
+                NT_VERIFY(!close(a.sock));
+                free(a.sock);
+                return false;
+        }
+
+        return a.pending = true;
+}
+
 } // namespace
 
 
@@ -744,6 +836,96 @@ PAGED auto wsk::for_each(
         return nullptr;
 }
 
+/*
+ * Attempts are started one by one until one of them succeeds. The next one is started if the previous
+ * did not complete during the delay or has failed. The first connected socket wins, the rest are cancelled.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto wsk::connect_any(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch,
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f prepare, _Inout_opt_ void *ctx,
+        _In_ LONGLONG delay, _Out_ const ADDRINFOEXW* &winner) -> SOCKET*
+{
+        PAGED_CODE();
+        winner = nullptr;
+
+        connect_attempt v[CONNECT_ATTEMPTS_MAX]{};
+        auto cnt = interleave(v, head);
+
+        SOCKET *sock{};
+        int started = 0;
+        int pending = 0;
+
+        while (!sock) {
+                if (started < cnt) {
+                        if (start(v[started++], Flags, SocketContext, Dispatch, prepare, ctx)) {
+                                ++pending;
+                        } else {
+                                continue; // failed at once, start the next one
+                        }
+                }
+
+                if (!pending) {
+                        break;
+                }
+
+                void *objects[CONNECT_ATTEMPTS_MAX];
+                connect_attempt *attempts[CONNECT_ATTEMPTS_MAX];
+                ULONG n = 0;
+
+                for (int i = 0; i < started; ++i) {
+                        if (v[i].pending) {
+                                objects[n] = &v[i].completed;
+                                attempts[n++] = &v[i];
+                        }
+                }
+
+                KWAIT_BLOCK blocks[CONNECT_ATTEMPTS_MAX];
+                auto timeout = make_timeout(delay, wdm::period::relative);
+
+                auto st = KeWaitForMultipleObjects(n, objects, WaitAny, Executive, KernelMode, false,
+                                                   started < cnt ? &timeout : nullptr, blocks);
+
+                if (st == STATUS_TIMEOUT) {
+                        continue;
+                }
+
+                NT_ASSERT(st >= STATUS_WAIT_0 && st < STATUS_WAIT_0 + n);
+                auto &a = *attempts[st - STATUS_WAIT_0];
+
+                a.pending = false;
+                --pending;
+
+                if (NT_SUCCESS(a.sock->misc_irp->IoStatus.Status)) {
+                        sock = a.sock;
+                        a.sock = nullptr;
+                        winner = a.ai;
+                } else {
+                        NT_VERIFY(!close(a.sock));
+                        free(a.sock);
+                }
+        }
+
+        for (int i = 0; i < started; ++i) {
+                if (auto &a = v[i]; a.pending) {
+                        IoCancelIrp(a.sock->misc_irp.get());
+                }
+        }
+
+        for (int i = 0; i < started; ++i) {
+                if (auto &a = v[i]; a.pending) {
+                        NT_VERIFY(!KeWaitForSingleObject(&a.completed, Executive, KernelMode, false, nullptr));
+                }
+
+                if (auto &s = v[i].sock) {
+                        NT_VERIFY(!close(s));
+                        free(s);
+                }
+        }
+
+        return sock;
+}
+
 /*
  * Error if optval is ULONG, one byte is written actually.
  */
@@ -123,6 +123,21 @@ PAGED SOCKET *for_each(
         _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
         _In_ const ADDRINFOEXW *head, _In_ addrinfo_f f, _Inout_opt_ void *ctx);
 
+enum { CONNECT_ATTEMPTS_MAX = 8 }; // the rest of the addresses are ignored
+
+/*
+ * Connect to the addresses concurrently with staggered starts, RFC 8305 "Happy Eyeballs".
+ * @param prepare is called for a socket before WskConnect, f.e. to set options and bind
+ * @param delay between the starts of attempts, 100-nanosecond units
+ * @param winner address of the returned socket
+ * @return connected socket or nullptr
+ */
+_IRQL_requires_max_(APC_LEVEL)
+PAGED SOCKET *connect_any(
+        _In_ ULONG Flags, _In_opt_ void *SocketContext, _In_opt_ const void *Dispatch, // for FN_WSK_SOCKET
+        _In_ const ADDRINFOEXW *head, _In_ addrinfo_f prepare, _Inout_opt_ void *ctx,
+        _In_ LONGLONG delay, _Out_ const ADDRINFOEXW* &winner);
+
 enum { RECEIVE_EVENT_FLAGS_BUFBZ = 64 };
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
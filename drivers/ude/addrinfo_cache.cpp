@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "addrinfo_cache.h"
+#include "trace.h"
+#include "addrinfo_cache.tmh"
+
+#include "context.h"
+#include "driver.h"
+
+#include <libdrv\wait_timeout.h>
+
+#include <usbip\consts.h>
+
+/*
+ * Persistent devices are attached again and again from the same few servers,
+ * the name would be resolved for each of them.
+ *
+ * WSK does not return TTL of DNS records, the entries expire after fixed time.
+ * An entry is not refreshed by hits, so a changed address is seen in TTL at most.
+ */
+struct usbip::addrinfo_cache
+{
+        struct entry
+        {
+                UNICODE_STRING node_name; // Buffer must be free-d, service_name.Buffer points into it
+                UNICODE_STRING service_name;
+
+                ULONGLONG expires; // KeQueryInterruptTime
+                ULONGLONG used; // KeQueryInterruptTime of the last hit, the least recently used is evicted
+
+                SOCKADDR_INET addr[wsk::CONNECT_ATTEMPTS_MAX];
+                int cnt;
+                int winner; // index in addr of the address that connected last time
+        };
+
+        entry entries[ADDRINFO_CACHE_ENTRIES];
+        ULONGLONG ttl; // 100-nanosecond units
+
+        LONG64 hits;
+        LONG64 misses;
+        LONG64 invalidated;
+};
+
+namespace
+{
+
+using namespace usbip;
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr ULONG get_addrlen(_In_ int family)
+{
+        switch (family) {
+        case AF_INET:
+                return sizeof(SOCKADDR_IN);
+        case AF_INET6:
+                return sizeof(SOCKADDR_IN6);
+        }
+
+        return 0;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto equal(_In_ const SOCKADDR_INET &a, _In_ const SOCKADDR &b)
+{
+        auto len = get_addrlen(b.sa_family);
+        return len && a.si_family == b.sa_family && RtlEqualMemory(&a, &b, len);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free(_Inout_ addrinfo_cache::entry &e)
+{
+        if (e.node_name.Buffer) {
+                ExFreePoolWithTag(e.node_name.Buffer, pooltag);
+        }
+
+        RtlZeroMemory(&e, sizeof(e));
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto find(
+        _Inout_ addrinfo_cache &c, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+        auto now = KeQueryInterruptTime();
+
+        for (auto &e: c.entries) {
+                if (!e.cnt) {
+                        continue;
+                } else if (e.expires <= now) {
+                        free(e);
+                } else if (RtlEqualUnicodeString(&e.node_name, &node_name, true) &&
+                           RtlEqualUnicodeString(&e.service_name, &service_name, true)) {
+                        return &e;
+                }
+        }
+
+        return static_cast<addrinfo_cache::entry*>(nullptr);
+}
+
+/*
+ * find must be called before to free expired entries.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto& victim(_Inout_ addrinfo_cache &c)
+{
+        PAGED_CODE();
+        auto v = c.entries;
+
+        for (auto &e: c.entries) {
+                if (!e.cnt) {
+                        return e;
+                } else if (e.used < v->used) {
+                        v = &e;
+                }
+        }
+
+        free(*v);
+        return *v;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto insert(
+        _Inout_ addrinfo_cache &c, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name,
+        _In_ const ADDRINFOEXW *head)
+{
+        PAGED_CODE();
+        auto &e = victim(c);
+
+        for (auto ai = head; ai && e.cnt < wsk::CONNECT_ATTEMPTS_MAX; ai = ai->ai_next) {
+                if (auto len = get_addrlen(ai->ai_family); len && ai->ai_addr && ai->ai_addrlen >= len) {
+                        RtlCopyMemory(&e.addr[e.cnt++], ai->ai_addr, len);
+                }
+        }
+
+        if (!e.cnt) {
+                return static_cast<addrinfo_cache::entry*>(nullptr);
+        }
+
+        USHORT len = node_name.Length + service_name.Length;
+
+        auto buf = (PWCH)ExAllocatePoolUninitialized(PagedPool, len, pooltag);
+        if (!buf) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", len);
+                free(e);
+                return static_cast<addrinfo_cache::entry*>(nullptr);
+        }
+
+        RtlInitEmptyUnicodeString(&e.node_name, buf, node_name.Length);
+        RtlCopyUnicodeString(&e.node_name, &node_name);
+
+        RtlInitEmptyUnicodeString(&e.service_name, buf + node_name.Length/sizeof(*buf), service_name.Length);
+        RtlCopyUnicodeString(&e.service_name, &service_name);
+
+        e.used = KeQueryInterruptTime();
+        e.expires = e.used + c.ttl;
+
+        return &e;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_addrinfo_cache(_Inout_ vhci_ctx &ctx)
+{
+        PAGED_CODE();
+        NT_ASSERT(!ctx.addrinfo);
+
+        auto ttl = get_parameter(addrinfo_ttl_value_name, ADDRINFO_CACHE_TTL);
+        if (!ttl) {
+                TraceDbg("disabled");
+                return STATUS_SUCCESS;
+        }
+
+        ctx.addrinfo = (addrinfo_cache*)ExAllocatePoolZero(PagedPool, sizeof(*ctx.addrinfo), pooltag);
+        if (!ctx.addrinfo) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*ctx.addrinfo));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        ctx.addrinfo->ttl = ttl*wdm::second;
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::free_addrinfo_cache(_Inout_ vhci_ctx &ctx)
+{
+        PAGED_CODE();
+
+        auto &c = ctx.addrinfo;
+        if (!c) {
+                return;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "hits %I64d, misses %I64d, invalidated %I64d",
+                c->hits, c->misses, c->invalidated);
+
+        for (auto &e: c->entries) {
+                free(e);
+        }
+
+        ExFreePoolWithTag(c, pooltag);
+        c = nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool usbip::get_cached_addrinfo(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name,
+        _Out_ addrinfo_list &result)
+{
+        PAGED_CODE();
+
+        auto c = ctx.addrinfo;
+        if (!c) {
+                return false;
+        }
+
+        wdf::WaitLock lck(ctx.addrinfo_lock);
+
+        auto e = find(*c, node_name, service_name);
+        if (!e) {
+                ++c->misses;
+                return false;
+        }
+
+        ++c->hits;
+        e->used = KeQueryInterruptTime();
+
+        for (int i = 0; i < e->cnt; ++i) {
+                auto j = i ? (i <= e->winner ? i - 1 : i) : e->winner; // the winner goes first
+
+                result.addr[i] = e->addr[j];
+
+                auto &ai = result.ai[i];
+                RtlZeroMemory(&ai, sizeof(ai));
+
+                ai.ai_family = result.addr[i].si_family;
+                ai.ai_socktype = SOCK_STREAM;
+                ai.ai_protocol = IPPROTO_TCP;
+                ai.ai_addrlen = get_addrlen(ai.ai_family);
+                ai.ai_addr = reinterpret_cast<SOCKADDR*>(&result.addr[i]);
+                ai.ai_next = i + 1 < e->cnt ? &result.ai[i + 1] : nullptr;
+        }
+
+        TraceDbg("%!USTR!:%!USTR!, %d address(es), expires in %I64u sec", &node_name, &service_name, e->cnt,
+                  (e->expires - e->used)/wdm::second);
+
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::update_addrinfo_cache(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name,
+        _In_ const ADDRINFOEXW *head, _In_ const ADDRINFOEXW &winner)
+{
+        PAGED_CODE();
+
+        auto c = ctx.addrinfo;
+        if (!c || !winner.ai_addr) {
+                return;
+        }
+
+        wdf::WaitLock lck(ctx.addrinfo_lock);
+
+        auto e = find(*c, node_name, service_name);
+        if (!e && !(e = insert(*c, node_name, service_name, head))) {
+                return;
+        }
+
+        for (int i = 0; i < e->cnt; ++i) {
+                if (equal(e->addr[i], *winner.ai_addr)) {
+                        e->winner = i;
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::invalidate_addrinfo_cache(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name)
+{
+        PAGED_CODE();
+
+        auto c = ctx.addrinfo;
+        if (!c) {
+                return;
+        }
+
+        wdf::WaitLock lck(ctx.addrinfo_lock);
+
+        if (auto e = find(*c, node_name, service_name)) {
+                ++c->invalidated;
+                free(*e);
+        }
+}
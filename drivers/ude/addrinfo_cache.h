@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wsk_cpp.h>
+
+namespace usbip
+{
+
+struct vhci_ctx;
+
+enum {
+        ADDRINFO_CACHE_ENTRIES = 16,
+        ADDRINFO_CACHE_TTL = 60 // seconds, default
+};
+
+/*
+ * ADDRINFOEXW-s that are built from the cached addresses, ai[0] is the head of the list.
+ */
+struct addrinfo_list
+{
+        ADDRINFOEXW ai[wsk::CONNECT_ATTEMPTS_MAX];
+        SOCKADDR_INET addr[wsk::CONNECT_ATTEMPTS_MAX];
+};
+
+/*
+ * The cache is not created if its TTL is zero, @see addrinfo_ttl_value_name.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_addrinfo_cache(_Inout_ vhci_ctx &ctx);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void free_addrinfo_cache(_Inout_ vhci_ctx &ctx);
+
+/*
+ * The address that connected last time goes first.
+ * @return true if result is filled
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED bool get_cached_addrinfo(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name,
+        _Out_ addrinfo_list &result);
+
+/*
+ * Is called if connect succeeded.
+ * @param head addresses that were tried, they are stored if the cache does not have them
+ * @param winner the address that connected
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void update_addrinfo_cache(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name,
+        _In_ const ADDRINFOEXW *head, _In_ const ADDRINFOEXW &winner);
+
+/*
+ * Is called if connect failed, the next one will resolve the name again.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void invalidate_addrinfo_cache(
+        _Inout_ vhci_ctx &ctx, _In_ const UNICODE_STRING &node_name, _In_ const UNICODE_STRING &service_name);
+
+} // namespace usbip
@@ -75,6 +75,7 @@ PAGED void usbip::free(_In_ device_ctx_ext *ext)
 
         NT_ASSERT(ext);
         free(ext->sock);
+        free(ext->old_sock);
 
         libdrv::FreeUnicodeString(ext->node_name, pooltag); // @see RtlFreeUnicodeString
         libdrv::FreeUnicodeString(ext->service_name, pooltag);
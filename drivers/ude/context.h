@@ -9,6 +9,7 @@
 #include <libdrv\wdf_cpp.h>
 
 #include <usbip\proto.h>
+#include <usbip\ret_parser.h>
 
 #include <wdfusb.h>
 #include <UdeCx.h>
@@ -16,6 +17,11 @@
 #include <initguid.h>
 #include <usbip\vhci.h>
 
+#include "request_table.h"
+#include "mpsc_queue.h"
+#include "send_sched.h"
+#include "wsk_context.h"
+
 
 /*
  * Macro WDF_TYPE_NAME_TO_TYPE_INFO (see WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE)
@@ -41,6 +47,8 @@ constexpr auto is_valid_port(int port)
         return port > 0 && port <= TOTAL_PORTS;
 }
 
+struct addrinfo_cache;
+
 /*
  * Context space for WDFDEVICE, Virtual Host Controller Interface.
  * Parent is WDFDRIVER.
@@ -52,11 +60,23 @@ struct vhci_ctx
 
         LIST_ENTRY fileobjects; // @see fileobject_ctx::entry
         WDFQUEUE reads; // IRP_MJ_READ
+        WDFQUEUE batches; // parallel, PLUGIN_HARDWARE_BATCH is forwarded here from the default queue
         int events_subscribers; // SUM(fileobject_ctx::process_events)
         WDFWAITLOCK events_lock;
 
         _KTHREAD *attach_thread;
         KEVENT attach_thread_stop;
+
+        struct // of persistent devices, @see plugin_persistent_devices
+        {
+                ULONG devices;
+                ULONG attached;
+                ULONG attempts;
+                ULONGLONG time; // 100-nanosecond units, zero until all devices are attached or given up
+        } restore;
+
+        addrinfo_cache *addrinfo; // resolved node_name:service_name, must be free-d, @see addrinfo_cache.cpp
+        WDFWAITLOCK addrinfo_lock;
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(vhci_ctx, get_vhci_ctx)
 
@@ -68,6 +88,14 @@ inline auto get_handle(_In_ vhci_ctx *ctx)
 
 struct wsk_context;
 struct device_ctx;
+struct request_ctx;
+struct descriptor_cache;
+
+enum { // @see device_ctx::sendq
+        SEND_SLOTS = 2*16 + 1, // endpoint number and direction, the last one is for CMD_UNLINK without an endpoint
+        SEND_CLASSES = 4, // isochronous, interrupt, control, bulk
+        SEND_DELAY_BUCKETS = 12 // [0] < 16us, [i] < 2^(i + 4)us, the last one is >= 16ms
+};
 
 /*
  * Context extention for device_ctx. 
@@ -85,6 +113,7 @@ struct device_ctx_ext
 {
         device_ctx *ctx;
         wsk::SOCKET *sock;
+        wsk::SOCKET *old_sock; // closed, was replaced by resume, device_ctx::sock() could have read it, must be free-d
 
         // from ioctl::plugin_hardware
         // .Buffer-s are allocated in PagedPool, see create_device_ctx_ext
@@ -94,6 +123,13 @@ struct device_ctx_ext
         //
         
         vhci::imported_device_properties dev; // for ioctl::get_imported_devices
+        bool receive_events; // use WskReceiveEvent instead of recv_hdr workitem, @see receive_events_value_name
+        bool inline_receive; // issue WskReceive from its completion routine if the stack allows, @see inline_receive_value_name
+        bool send_coalescing; // gather PDUs into one WskSend while another is in flight, @see send_coalescing_value_name
+        ULONG inline_out_max; // copy OUT payload up to this size to wsk_context::hdr_payload, @see inline_out_max_value_name
+        bool prefetch_descriptors; // pipeline GET_DESCRIPTOR-s before plugin, @see prefetch_descriptors_value_name
+        UCHAR num_configurations; // from OP_REP_IMPORT
+        ULONG resume_timeout; // seconds to reconnect after connection loss, zero to unplug, @see resume_timeout_value_name
 };
 
 /*
@@ -112,10 +148,38 @@ struct device_ctx
         UDECXUSBENDPOINT ep0; // default control pipe
         WDFSPINLOCK endpoint_list_lock; // for endpoint_ctx::entry
 
-        WDFSPINLOCK send_lock; // for WskSend on sock()
-
-        LIST_ENTRY egress_requests; // that are waiting for WskSend completion handler, head for request_ctx::entry
-        WDFSPINLOCK egress_requests_lock;
+        struct // PDUs that wait for WskSend on sock(), @see device_ioctl.cpp, send_queued
+        {
+                mpsc_queue<wsk_context, &wsk_context::next> queue; // its owner calls WskSend
+                send_scheduler<wsk_context, SEND_SLOTS, SEND_CLASSES> sched; // of the owner, PDUs taken from the queue
+                volatile LONG backlog; // sched.size()
+
+                volatile LONG64 bytes; // in the queue and sched
+                volatile LONG64 in_flight_bytes;
+                volatile LONG in_flight; // WskSend-s
+        } sendq;
+
+        struct // wsk_context-s for forward progress if the pool is exhausted, @see wsk_context.cpp
+        {
+                SLIST_HEADER list[2]; // [1] can hold USBIP_MAX_ISO_PACKETS
+                volatile LONG target[2]; // max outstanding URBs of the endpoints, @see reserve_wsk_contexts
+
+                WDFQUEUE throttled; // manual, URBs that got no wsk_context, @see device_ioctl.cpp, throttle
+                volatile LONG throttled_cnt; // since last retry
+                volatile LONG64 order; // the last assigned request_ctx::order
+                WDFWORKITEM retry; // forwards throttled URBs back to endpoint queues
+        } reserve;
+
+        /*
+         * Requests that are waiting for WskSend completion handler or USBIP_RET_SUBMIT, must be free-d.
+         * 64 KiB of NonPagedPoolNx, up to 3072 requests. Endpoints keep a few URBs outstanding each,
+         * @see max_outstanding_urbs, if the table is nearly full URBs are throttled, @see device::requests_exhausted.
+         */
+        request_table<seqnum_t, request_ctx, 4096> *requests;
+        WDFSPINLOCK requests_lock;
+
+        descriptor_cache *descriptors; // GET_DESCRIPTOR responses, must be free-d, @see descriptor_cache.cpp
+        WDFSPINLOCK descriptors_lock;
 
         int port; // vhci_ctx.devices[port - 1]
         seqnum_t seqnum; // @see next_seqnum
@@ -123,14 +187,63 @@ struct device_ctx
         volatile bool unplugged; // initiated detach that may still be ongoing
         KEVENT detach_completed;
 
+        volatile bool resuming; // connection was lost, URBs are held in reserve.throttled, @see device::async_resume
+        WDFWORKITEM resume;
+        ULONGLONG outage_started; // KeQueryInterruptTime
+
         WDFWAITLOCK delete_lock; // serialize UdecxUsbDevicePlugOutAndDelete and UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS
-        WDFQUEUE queue; // requests that are waiting for USBIP_RET_SUBMIT from a server
 
         // for WSK receive
         WDFWORKITEM recv_hdr;
         using received_fn = NTSTATUS (wsk_context&);
         received_fn *received;
-        size_t receive_size;
+        size_t receive_size; // zero if WSK_FLAG_WAITALL is not used
+
+        struct // for recv_hdr workitem, @see wsk_receive.cpp
+        {
+                UCHAR *data; // RECV_BUF_SIZE bytes from NonPagedPoolNx, must be free-d
+                MDL *mdl; // describes data, must be free-d
+        } recv_buf;
+
+        struct // received PDU that is being parsed, @see wsk_receive.cpp
+        {
+                ret_parser parser;
+                MDL *data; // wsk_context::mdl_buf that describes transfer buffer or NULL to skip the data
+                bool failed; // WskReceiveEvent: discard indicated data
+        } recv_pdu;
+
+        struct // are logged on detach
+        {
+                ULONG64 recv_irps; // completed WskReceive
+                ULONG64 recv_pdus; // received USBIP_RET_*
+                ULONG64 drained_bytes; // payload of cancelled or unknown requests
+                ULONG64 recv_inline; // WskReceive-s issued from the completion routine
+                ULONG64 recv_hops; // WskReceive-s issued by recv_hdr workitem
+
+                ULONG64 send_irps; // WskSend-s, updated by the owner of sendq
+                ULONG64 send_pdus; // USBIP_CMD_*, updated by the owner of sendq
+                volatile LONG64 send_inline; // OUT payloads copied to wsk_context::hdr_payload
+                volatile LONG64 reserve_used; // wsk_context-s taken from the reserve
+                volatile LONG64 throttled; // URBs that waited for wsk_context or for a slot in device_ctx::requests
+                ULONG requests_max; // peak size of device_ctx::requests, protected by device_ctx::requests_lock
+                ULONG requests_displaced; // peak number of requests that were not in their home slot, the same
+                volatile LONG64 purges; // EvtUsbEndpointPurge, @see endpoint_purge
+                volatile LONG64 purged_urbs; // cancelled on purge, by CMD_UNLINK if CMD_SUBMIT was sent
+                volatile LONG64 purge_time; // total, 100-nanosecond units
+                volatile LONG64 purge_max; // 100-nanosecond units
+                volatile LONG64 dsc_hits; // GET_DESCRIPTOR-s completed from descriptor cache
+                volatile LONG64 dsc_misses; // GET_DESCRIPTOR-s that were sent and can be cached
+                volatile LONG64 dsc_rtt; // total round trip time of the misses, 100-nanosecond units
+                volatile LONG64 dsc_rtt_cnt;
+                ULONG64 resumes; // sessions that were resumed after connection loss
+                ULONG64 outage_time; // total, 100-nanosecond units
+                ULONG64 outage_max; // 100-nanosecond units
+                ULONG64 resubmitted; // URBs that were sent again after resume
+                ULONG64 resume_failed; // URBs that were failed on connection loss
+                ULONGLONG started; // KeQueryInterruptTime
+
+                ULONG64 send_delay[SEND_SLOTS][SEND_DELAY_BUCKETS]; // queueing delay per endpoint, updated by the owner of sendq
+        } stats;
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(device_ctx, get_device_ctx)
 
@@ -140,12 +253,6 @@ inline auto get_handle(_In_ device_ctx *ctx)
         return static_cast<UDECXUSBDEVICE>(WdfObjectContextGetObject(ctx));
 }
 
-WDF_DECLARE_CONTEXT_TYPE(UDECXUSBDEVICE); // WdfObjectGet_UDECXUSBDEVICE
-inline auto& get_device(_In_ WDFQUEUE queue) // for device_ctx.queue
-{
-        return *WdfObjectGet_UDECXUSBDEVICE(queue);
-}
-
 
 /*
  * Context space for UDECXUSBENDPOINT.
@@ -164,11 +271,27 @@ struct endpoint_ctx
 
         USBD_PIPE_HANDLE PipeHandle;
         LIST_ENTRY entry; // list head if default control pipe, protected by device_ctx::endpoint_list_lock
+
+        LONG reserved; // wsk_context-s in device_ctx::reserve, @see reserve_wsk_contexts
+        ULONGLONG purge_started; // KeQueryInterruptTime, @see endpoint_purge
+
+        struct // URBs that are in device_ctx::reserve.throttled or are forwarded back and not sent yet
+        {
+                volatile LONG cnt; // if not zero, later URBs are throttled too to keep the order
+                volatile LONG64 blocked; // min request_ctx::order of retried URBs that were throttled again
+        } throttled;
+
+        struct // isochronous IN transfers, @see fill_isoc_data
+        {
+                ULONG64 packets; // completed
+                ULONG64 moved; // were not in place, the rest are hits
+                ULONG64 moved_bytes;
+        } isoch_in;
 };        
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(endpoint_ctx, get_endpoint_ctx)
 
 WDF_DECLARE_CONTEXT_TYPE(UDECXUSBENDPOINT); // WdfObjectGet_UDECXUSBENDPOINT
-inline auto& get_endpoint(_In_ WDFQUEUE queue) // use get_device() for device_ctx.queue
+inline auto& get_endpoint(_In_ WDFQUEUE queue)
 {
         return *WdfObjectGet_UDECXUSBENDPOINT(queue);
 }
@@ -179,9 +302,17 @@ inline auto& get_endpoint(_In_ WDFQUEUE queue) // use get_device() for device_ct
  */
 struct request_ctx
 {
-        LIST_ENTRY entry; // head is device_ctx::egress_requests
         UDECXUSBENDPOINT endpoint;
-        seqnum_t seqnum;
+        seqnum_t seqnum; // key in device_ctx::requests
+        bool cancelable; // is waiting for USBIP_RET_SUBMIT, protected by device_ctx::requests_lock
+        bool cancelled; // while in egress state, is completed after WskSend, protected by device_ctx::requests_lock
+        bool throttled; // is counted in endpoint_ctx::throttled, @see device_ioctl.cpp, track
+        request_ctx *next; // @see device::remove_requests, device::retry_throttled
+
+        LONG64 order; // of arrival, throttled URBs are retried in this order
+
+        ULONGLONG dsc_sent; // KeQueryInterruptTime if GET_DESCRIPTOR is a miss, @see get_cached_descriptor
+        ULONG dsc_epoch; // of descriptor_cache when it was sent
 };
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(request_ctx, get_request_ctx)
 
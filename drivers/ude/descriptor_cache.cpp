@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "descriptor_cache.h"
+#include "trace.h"
+#include "descriptor_cache.tmh"
+
+#include "context.h"
+#include "driver.h"
+#include "proto.h"
+#include "network.h"
+
+#include <libdrv\ch9.h>
+#include <libdrv\usbd_helper.h>
+#include <libdrv\pdu.h>
+
+/*
+ * Descriptors do not change while the device is configured, but Windows reads them again
+ * during enumeration, power transitions and reloads of function drivers.
+ *
+ * A response is the whole descriptor or its first wLength bytes. A request is served if
+ * the cached data are enough for its wLength, or if they are the whole descriptor.
+ */
+struct usbip::descriptor_cache
+{
+        struct entry
+        {
+                USB_DEFAULT_PIPE_SETUP_PACKET key; // wLength is zero
+                UCHAR *data; // must be free-d
+                ULONG len;
+                bool complete; // the whole descriptor, a longer wLength gets the same data
+        };
+
+        entry entries[DESCRIPTOR_CACHE_ENTRIES];
+        unsigned int victim; // next to evict if all entries are in use
+
+        ULONG epoch; // is incremented by invalidate, @see request_ctx::dsc_epoch
+        UCHAR ms_vendor_code[2]; // of MS OS 1.0 and 2.0 descriptors, zero if unknown
+};
+
+namespace
+{
+
+using namespace usbip;
+
+enum {
+        MS_OS_STRING_INDEX = 0xEE,
+        MS_OS_STRING_LENGTH = 18,
+        MS_OS_10_EXTENDED_COMPAT_ID = 4, // wIndex
+        MS_OS_10_EXTENDED_PROPERTIES = 5,
+        MS_OS_20_DESCRIPTOR_INDEX = 7,
+        MS_OS_20_PLATFORM_CAPABILITY_LENGTH = 28,
+};
+
+/*
+ * {D8DD60DF-4589-4CC7-9CD2-659D9E648A9F} as it is stored in BOS descriptor.
+ */
+const UCHAR ms_os_20_platform_uuid[] {
+        0xDF, 0x60, 0xDD, 0xD8, 0x89, 0x45, 0xC7, 0x4C, 0x9C, 0xD2, 0x65, 0x9D, 0x9E, 0x64, 0x8A, 0x9F
+};
+
+constexpr auto get_type(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        return pkt.bmRequestType.B & USB_TYPE_MASK;
+}
+
+constexpr ULONG get_u16(_In_ const UCHAR *p) { return p[0] | p[1] << 8; }
+constexpr ULONG get_u32(_In_ const UCHAR *p) { return get_u16(p) | get_u16(p + 2) << 16; }
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto make_key(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        auto key = pkt;
+        key.wLength = 0;
+        return key;
+}
+
+/*
+ * Standard GET_DESCRIPTOR for the device or an interface (f.e. HID report descriptor),
+ * MS OS 1.0 and 2.0 descriptors if their vendor codes are known.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto is_cacheable(_In_ const descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        if (!(pkt.wLength && is_transfer_dir_in(pkt))) {
+                return false;
+        }
+
+        if (get_type(pkt) == USB_TYPE_STANDARD) {
+                auto recip = pkt.bmRequestType.B & USB_RECIP_MASK;
+                return pkt.bRequest == USB_REQUEST_GET_DESCRIPTOR &&
+                       (recip == USB_RECIP_DEVICE || recip == USB_RECIP_INTERFACE);
+        } else if (get_type(pkt) != USB_TYPE_VENDOR) {
+                return false;
+        }
+
+        switch (pkt.wIndex.W) {
+        case MS_OS_10_EXTENDED_COMPAT_ID:
+        case MS_OS_10_EXTENDED_PROPERTIES:
+                return c.ms_vendor_code[0] && pkt.bRequest == c.ms_vendor_code[0];
+        case MS_OS_20_DESCRIPTOR_INDEX:
+                return c.ms_vendor_code[1] && pkt.bRequest == c.ms_vendor_code[1];
+        }
+
+        return false;
+}
+
+/*
+ * @return the length of the whole descriptor, zero if unknown
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG total_length(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ const UCHAR *d, _In_ ULONG len)
+{
+        if (get_type(pkt) == USB_TYPE_VENDOR) {
+                switch (pkt.wIndex.W) {
+                case MS_OS_10_EXTENDED_COMPAT_ID:
+                case MS_OS_10_EXTENDED_PROPERTIES:
+                        return len >= 4 ? get_u32(d) : 0; // dwLength
+                case MS_OS_20_DESCRIPTOR_INDEX:
+                        return len >= 10 ? get_u16(d + 8) : 0; // wTotalLength of descriptor set header
+                }
+                return 0;
+        }
+
+        switch (pkt.wValue.HiByte) { // descriptor type
+        case USB_DEVICE_DESCRIPTOR_TYPE:
+        case USB_STRING_DESCRIPTOR_TYPE:
+                return d[0]; // bLength
+        case USB_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_OTHER_SPEED_CONFIGURATION_DESCRIPTOR_TYPE:
+        case USB_BOS_DESCRIPTOR_TYPE:
+                return len >= 4 ? get_u16(d + 2) : 0; // wTotalLength
+        }
+
+        return 0;
+}
+
+/*
+ * Vendor codes of MS OS descriptors are taken from MS OS string descriptor and BOS descriptor.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void learn_vendor_codes(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_ const UCHAR *d, _In_ ULONG len)
+{
+        if (get_type(pkt) != USB_TYPE_STANDARD) {
+                return;
+        }
+
+        switch (pkt.wValue.HiByte) {
+        case USB_STRING_DESCRIPTOR_TYPE:
+                if (pkt.wValue.LowByte == MS_OS_STRING_INDEX && len >= MS_OS_STRING_LENGTH &&
+                    RtlEqualMemory(d + 2, L"MSFT100", 14)) { // qwSignature
+                        c.ms_vendor_code[0] = d[16]; // bMS_VendorCode
+                }
+                break;
+        case USB_BOS_DESCRIPTOR_TYPE:
+                for (ULONG off = d[0]; off + 3 <= len && d[off]; off += d[off]) {
+                        auto cap = d + off;
+                        if (cap[0] >= MS_OS_20_PLATFORM_CAPABILITY_LENGTH &&
+                            off + MS_OS_20_PLATFORM_CAPABILITY_LENGTH <= len &&
+                            cap[1] == USB_DEVICE_CAPABILITY_DESCRIPTOR_TYPE &&
+                            cap[2] == USB_DEVICE_CAPABILITY_PLATFORM &&
+                            RtlEqualMemory(cap + 4, ms_os_20_platform_uuid, sizeof(ms_os_20_platform_uuid))) {
+                                c.ms_vendor_code[1] = cap[26]; // bMS_VendorCode of the first descriptor set
+                                break;
+                        }
+                }
+                break;
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto find(_In_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &key)
+{
+        for (auto &e: c.entries) {
+                if (e.data && e.key == key) {
+                        return &e;
+                }
+        }
+
+        return static_cast<descriptor_cache::entry*>(nullptr);
+}
+
+/*
+ * @return entry with the same key, a free one or a victim
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto& get_entry(_In_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &key)
+{
+        if (auto e = find(c, key)) {
+                return *e;
+        }
+
+        for (auto &e: c.entries) {
+                if (!e.data) {
+                        return e;
+                }
+        }
+
+        auto &e = c.entries[c.victim];
+        c.victim = (c.victim + 1) % DESCRIPTOR_CACHE_ENTRIES;
+        return e;
+}
+
+/*
+ * @param data must be allocated from NonPagedPoolNx
+ * @return data that must be free-d, the passed or the replaced
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto insert(
+        _Inout_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_ UCHAR *data, _In_ ULONG len)
+{
+        auto complete = len < pkt.wLength || len == total_length(pkt, data, len);
+        learn_vendor_codes(c, pkt, data, len);
+
+        auto key = make_key(pkt);
+        auto &e = get_entry(c, key);
+
+        if (e.data && e.key == key && len <= e.len && (e.complete || !complete)) {
+                return data; // has more or the same
+        }
+
+        auto old = e.data;
+        e = { .key = key, .data = data, .len = len, .complete = complete };
+        return old;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+UCHAR* insert(_Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ UCHAR *data, _In_ ULONG len)
+{
+        wdf::Lock lck(dev.descriptors_lock);
+        return insert(*dev.descriptors, pkt, data, len);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+constexpr auto make_get_descriptor(_In_ UCHAR type, _In_ UCHAR index, _In_ USHORT LanguageId, _In_ USHORT len)
+{
+        return USB_DEFAULT_PIPE_SETUP_PACKET {
+                .bmRequestType{.B = USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE},
+                .bRequest = USB_REQUEST_GET_DESCRIPTOR,
+                .wValue{.W = USHORT(type << 8 | index)},
+                .wIndex{.W = LanguageId},
+                .wLength = len,
+        };
+}
+
+enum { PREFETCH_MAX = 16 }; // GET_DESCRIPTOR-s in a round
+
+struct prefetch_round
+{
+        usbip_header hdr[PREFETCH_MAX]; // are sent by one call
+        USB_DEFAULT_PIPE_SETUP_PACKET pkt[PREFETCH_MAX];
+        int cnt;
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto add(_Inout_ prefetch_round &r, _Inout_ device_ctx &dev, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        PAGED_CODE();
+
+        if (r.cnt == PREFETCH_MAX) {
+                return STATUS_BUFFER_OVERFLOW;
+        }
+
+        auto &hdr = r.hdr[r.cnt];
+        const ULONG TransferFlags = USBD_DEFAULT_PIPE_TRANSFER | USBD_TRANSFER_DIRECTION_IN;
+
+        if (auto err = set_cmd_submit_usbip_header(hdr, dev, EP0, TransferFlags, pkt.wLength, setup_dir::in())) {
+                return err;
+        }
+
+        static_assert(sizeof(hdr.u.cmd_submit.setup) == sizeof(pkt));
+        RtlCopyMemory(hdr.u.cmd_submit.setup, &pkt, sizeof(pkt));
+
+        r.pkt[r.cnt++] = pkt;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * CMD_SUBMIT-s are sent back to back, then RET_SUBMIT-s are received in any order.
+ * Descriptors that the device does not have are skipped.
+ * @return error if the connection is broken
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS run(_Inout_ prefetch_round &r, _Inout_ device_ctx &dev, _Inout_ int &cached)
+{
+        PAGED_CODE();
+
+        seqnum_t seqnum[PREFETCH_MAX];
+
+        for (int i = 0; i < r.cnt; ++i) {
+                seqnum[i] = r.hdr[i].base.seqnum;
+                byteswap_header(r.hdr[i], swap_dir::host2net);
+        }
+
+        if (auto err = send(dev.sock(), memory::stack, r.hdr, r.cnt*sizeof(*r.hdr))) {
+                Trace(TRACE_LEVEL_ERROR, "send %!STATUS!", err);
+                return err;
+        }
+
+        for (int k = 0; k < r.cnt; ++k) {
+
+                usbip_header hdr;
+                if (auto err = recv(dev.sock(), memory::stack, &hdr, sizeof(hdr))) {
+                        Trace(TRACE_LEVEL_ERROR, "recv usbip_header %!STATUS!", err);
+                        return err;
+                }
+                byteswap_header(hdr, swap_dir::net2host);
+
+                int i = 0;
+                for ( ; i < r.cnt && seqnum[i] != hdr.base.seqnum; ++i);
+
+                auto &ret = hdr.u.ret_submit;
+                auto len = ULONG(ret.actual_length);
+
+                if (hdr.base.command != USBIP_RET_SUBMIT || i == r.cnt || len > r.pkt[i].wLength) {
+                        Trace(TRACE_LEVEL_ERROR, "Unexpected command %u, seqnum %u, actual_length %d",
+                                hdr.base.command, hdr.base.seqnum, ret.actual_length);
+                        return STATUS_INVALID_NETWORK_RESPONSE;
+                }
+
+                if (!len) {
+                        continue;
+                }
+
+                auto data = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx, len, pooltag);
+                if (!data) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", len);
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                if (auto err = recv(dev.sock(), memory::nonpaged, data, len)) {
+                        Trace(TRACE_LEVEL_ERROR, "recv %lu bytes %!STATUS!", len, err);
+                        ExFreePoolWithTag(data, pooltag);
+                        return err;
+                }
+
+                TraceDbg("seqnum %u, status %d, %lu bytes%!BIN!", hdr.base.seqnum, ret.status, len,
+                          WppBinary(data, USHORT(len)));
+
+                if (!ret.status) {
+                        auto old = insert(dev, r.pkt[i], data, len);
+                        cached += old != data;
+                        data = old;
+                }
+
+                if (data) {
+                        ExFreePoolWithTag(data, pooltag);
+                }
+        }
+
+        r.cnt = 0;
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @return descriptor that the device returned or nullptr
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_descriptor(_In_ descriptor_cache &c, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt, _In_ ULONG min_len)
+{
+        PAGED_CODE();
+        auto e = find(c, make_key(pkt));
+        return e && e->len >= min_len ? e->data : nullptr;
+}
+
+} // namespace
+
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        NT_ASSERT(!dev.descriptors);
+
+        dev.descriptors = (descriptor_cache*)ExAllocatePoolZero(NonPagedPoolNx, sizeof(*dev.descriptors), pooltag);
+        if (!dev.descriptors) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*dev.descriptors));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        auto &c = dev.descriptors;
+        if (!c) {
+                return;
+        }
+
+        for (auto &e: c->entries) {
+                if (e.data) {
+                        ExFreePoolWithTag(e.data, pooltag);
+                }
+        }
+
+        ExFreePoolWithTag(c, pooltag);
+        c = nullptr;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::get_cached_descriptor(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const _URB_CONTROL_TRANSFER_EX &r)
+{
+        auto &pkt = get_setup_packet(r);
+        auto &req = *get_request_ctx(request);
+
+        UCHAR *buf{};
+        ULONG buf_len{};
+
+        if (NT_ERROR(UdecxUrbRetrieveBuffer(request, &buf, &buf_len)) || buf_len < pkt.wLength) {
+                req.dsc_sent = 0;
+                return false;
+        }
+
+        ULONG len = 0;
+        {
+                auto &c = *dev.descriptors;
+                wdf::Lock lck(dev.descriptors_lock);
+
+                if (!is_cacheable(c, pkt)) {
+                        req.dsc_sent = 0;
+                        return false;
+                }
+
+                if (auto e = find(c, make_key(pkt)); e && (pkt.wLength <= e->len || e->complete)) {
+                        len = min(ULONG(pkt.wLength), e->len);
+                        RtlCopyMemory(buf, e->data, len);
+                } else {
+                        if (!req.dsc_sent) { // can be throttled and come here again
+                                req.dsc_sent = KeQueryInterruptTime();
+                                InterlockedIncrement64(&dev.stats.dsc_misses);
+                        }
+                        req.dsc_epoch = c.epoch;
+                        return false;
+                }
+        }
+
+        UdecxUrbSetBytesCompleted(request, len);
+        InterlockedIncrement64(&dev.stats.dsc_hits);
+
+        TraceUrb("req %04x, %lu bytes from descriptor cache", ptr04x(request), len);
+        return true;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::update_descriptor_cache(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(len) const void *data, _In_ ULONG len)
+{
+        auto &req = *get_request_ctx(request);
+        if (!req.dsc_sent) { // is not a miss, @see get_cached_descriptor
+                return;
+        }
+
+        InterlockedAdd64(&dev.stats.dsc_rtt, KeQueryInterruptTime() - req.dsc_sent);
+        InterlockedIncrement64(&dev.stats.dsc_rtt_cnt);
+        req.dsc_sent = 0;
+
+        if (!len || len > DESCRIPTOR_CACHE_MAX_LEN) {
+                return;
+        }
+
+        auto copy = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx, len, pooltag);
+        if (!copy) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %lu bytes", len);
+                return;
+        }
+
+        RtlCopyMemory(copy, data, len);
+
+        {
+                auto &c = *dev.descriptors;
+                wdf::Lock lck(dev.descriptors_lock);
+
+                if (req.dsc_epoch == c.epoch) { // was not invalidated while in flight
+                        copy = insert(c, pkt, copy, len);
+                }
+        }
+
+        if (copy) {
+                ExFreePoolWithTag(copy, pooltag);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::invalidate_descriptor_cache(_Inout_ device_ctx &dev)
+{
+        UCHAR *victims[DESCRIPTOR_CACHE_ENTRIES];
+        int cnt = 0;
+        {
+                auto &c = *dev.descriptors;
+                wdf::Lock lck(dev.descriptors_lock);
+
+                ++c.epoch;
+                RtlZeroMemory(c.ms_vendor_code, sizeof(c.ms_vendor_code));
+
+                for (auto &e: c.entries) {
+                        if (e.data) {
+                                victims[cnt++] = e.data;
+                                e = {};
+                        }
+                }
+        }
+
+        for (int i = 0; i < cnt; ++i) {
+                ExFreePoolWithTag(victims[i], pooltag);
+        }
+
+        TraceDbg("dev %04x, %d descriptor(s) dropped", ptr04x(&dev), cnt);
+}
+
+/*
+ * The first round: device descriptor, configuration descriptors, LANGID-s.
+ * The second round: manufacturer, product, serial number strings, BOS descriptor.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::prefetch_descriptors(_Inout_ device_ctx &dev, _In_ UCHAR NumConfigurations)
+{
+        PAGED_CODE();
+
+        auto started = KeQueryInterruptTime();
+        auto &c = *dev.descriptors;
+
+        prefetch_round r{};
+        int cached = 0;
+
+        auto dd = make_get_descriptor(USB_DEVICE_DESCRIPTOR_TYPE, 0, 0, sizeof(USB_DEVICE_DESCRIPTOR));
+        auto langids = make_get_descriptor(USB_STRING_DESCRIPTOR_TYPE, 0, 0, MAXUCHAR);
+
+        NT_VERIFY(!add(r, dev, dd));
+        NT_VERIFY(!add(r, dev, langids));
+
+        for (int i = 0; i < NumConfigurations && i < PREFETCH_MAX - 2; ++i) { // wTotalLength is unknown
+                auto cd = make_get_descriptor(USB_CONFIGURATION_DESCRIPTOR_TYPE, UCHAR(i), 0, DESCRIPTOR_CACHE_MAX_LEN);
+                NT_VERIFY(!add(r, dev, cd));
+        }
+
+        if (auto err = run(r, dev, cached)) {
+                return err;
+        }
+
+        auto d = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(get_descriptor(c, dd, sizeof(USB_DEVICE_DESCRIPTOR)));
+        if (!d) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, device descriptor was not received", ptr04x(&dev));
+                return STATUS_SUCCESS;
+        }
+
+        if (auto s = get_descriptor(c, langids, sizeof(USB_COMMON_DESCRIPTOR) + sizeof(USHORT))) {
+                auto LanguageId = USHORT(get_u16(s + sizeof(USB_COMMON_DESCRIPTOR))); // the first one
+
+                for (auto idx: {d->iManufacturer, d->iProduct, d->iSerialNumber}) {
+                        if (idx) {
+                                auto str = make_get_descriptor(USB_STRING_DESCRIPTOR_TYPE, idx, LanguageId, MAXUCHAR);
+                                NT_VERIFY(!add(r, dev, str));
+                        }
+                }
+        }
+
+        if (d->bcdUSB >= 0x0201) {
+                auto bos = make_get_descriptor(USB_BOS_DESCRIPTOR_TYPE, 0, 0, DESCRIPTOR_CACHE_MAX_LEN);
+                NT_VERIFY(!add(r, dev, bos));
+        }
+
+        if (r.cnt) {
+                if (auto err = run(r, dev, cached)) {
+                        return err;
+                }
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %d descriptor(s) prefetched in %I64u ms",
+                ptr04x(&dev), cached, (KeQueryInterruptTime() - started)/10'000);
+
+        return STATUS_SUCCESS;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <libdrv\codeseg.h>
+#include <libdrv\wdf_cpp.h>
+
+#include <usb.h>
+#include <wdfusb.h>
+#include <UdeCx.h>
+
+namespace usbip
+{
+
+struct device_ctx;
+
+enum {
+        DESCRIPTOR_CACHE_ENTRIES = 32,
+        DESCRIPTOR_CACHE_MAX_LEN = 16*1024 // longer descriptors are not cached
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_descriptor_cache(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_descriptor_cache(_Inout_ device_ctx &dev);
+
+/*
+ * Fill the cache with descriptors that are read during enumeration,
+ * GET_DESCRIPTOR-s are pipelined and take two round trips instead of one for each.
+ * Must be called before start_receive.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS prefetch_descriptors(_Inout_ device_ctx &dev, _In_ UCHAR NumConfigurations);
+
+/*
+ * If the request is GET_DESCRIPTOR that is cached, its TransferBuffer is filled and BytesCompleted is set.
+ * Otherwise the request is marked as a miss if the response can be cached, @see update_descriptor_cache.
+ * @return true if the request must be completed with STATUS_SUCCESS
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool get_cached_descriptor(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const _URB_CONTROL_TRANSFER_EX &r);
+
+/*
+ * Is called for successful USBIP_RET_SUBMIT of a control transfer.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_descriptor_cache(
+        _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt,
+        _In_reads_bytes_(len) const void *data, _In_ ULONG len);
+
+/*
+ * The responses that are in flight will not be cached.
+ * @see SET_CONFIGURATION, port reset
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void invalidate_descriptor_cache(_Inout_ device_ctx &dev);
+
+} // namespace usbip
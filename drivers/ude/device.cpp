@@ -12,12 +12,17 @@
 #include "network.h"
 #include "device_ioctl.h"
 #include "wsk_receive.h"
+#include "wsk_context.h"
+#include "descriptor_cache.h"
 #include "ioctl.h"
 #include "vhci.h"
+#include "vhci_ioctl.h"
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\wait_timeout.h>
 
+#include <ntstrsafe.h>
+
 namespace
 {
 
@@ -60,6 +65,10 @@ PAGED void NTAPI device_destroy(_In_ WDFOBJECT object)
 
         free(ext);
         ext = nullptr;
+
+        device::free_request_table(*get_device_ctx(device));
+        free_wsk_context_reserve(*get_device_ctx(device));
+        free_descriptor_cache(*get_device_ctx(device));
 }
 
 _Function_class_(EVT_WDF_DEVICE_CONTEXT_CLEANUP)
@@ -73,7 +82,7 @@ PAGED void device_cleanup(_In_ WDFOBJECT Object)
         Trace(TRACE_LEVEL_INFORMATION, "dev %04x", ptr04x(device));
 
         if (auto dev = get_device_ctx(device)) { // all resources must be freed except for device_ctx_ext*
-                NT_ASSERT(IsListEmpty(&dev->egress_requests));
+                NT_ASSERT(!dev->requests || dev->requests->empty());
                 NT_ASSERT(dev->unplugged);
                 NT_ASSERT(!dev->port);
         }
@@ -120,6 +129,16 @@ PAGED void NTAPI endpoint_cleanup(_In_ WDFOBJECT object)
                   ptr04x(endpoint), d.bEndpointAddress, usbd_pipe_type_str(usb_endpoint_type(d)),
                   usb_endpoint_dir_out(d) ? "Out" : "In", usb_endpoint_num(d), ptr04x(endp.PipeHandle));
 
+        if (auto &s = endp.isoch_in; s.packets) {
+                Trace(TRACE_LEVEL_INFORMATION, "endp %04x, isoch IN packets %I64u, in place %I64u%%, moved %I64u bytes", 
+                        ptr04x(endpoint), s.packets, 100*(s.packets - s.moved)/s.packets, s.moved_bytes);
+        }
+
+        if (endp.reserved) {
+                auto isoch = usb_endpoint_type(d) == UsbdPipeTypeIsochronous;
+                release_wsk_contexts(*get_device_ctx(endp.device), endp.reserved, isoch);
+        }
+
         remove_endpoint_list(endp);
 }
 
@@ -140,6 +159,31 @@ void endpoint_reset(_In_ UDECXUSBENDPOINT endp, _In_ WDFREQUEST request)
         }
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void update_purge_stats(_Inout_ device_ctx &dev, _In_ LONG64 duration)
+{
+        auto &s = dev.stats;
+
+        InterlockedIncrement64(&s.purges);
+        InterlockedAdd64(&s.purge_time, duration);
+
+        for (auto max = s.purge_max; duration > max; ) {
+                auto prev = InterlockedCompareExchange64(&s.purge_max, duration, max);
+                if (prev == max) {
+                        break;
+                }
+                max = prev;
+        }
+}
+
+/*
+ * Also is called for URB_FUNCTION_ABORT_PIPE.
+ * CMD_SUBMIT-s of the endpoint that still wait in device_ctx::sendq are taken back first,
+ * their requests are cancelled without CMD_UNLINK. The rest of the requests are removed at once,
+ * their CMD_UNLINK-s are sent by one WskSend. Requests whose WskSend is in flight are cancelled
+ * by its completion handler, @see remove_requests.
+ */
 _Function_class_(EVT_UDECX_USB_ENDPOINT_PURGE)
 _IRQL_requires_same_
 void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
@@ -147,21 +191,36 @@ void endpoint_purge(_In_ UDECXUSBENDPOINT endpoint)
         auto &endp = *get_endpoint_ctx(endpoint);
         auto &dev = *get_device_ctx(endp.device);
 
+        endp.purge_started = KeQueryInterruptTime();
         TraceDbg("dev %04x, endp %04x, queue %04x", ptr04x(endp.device), ptr04x(endpoint), ptr04x(endp.queue));
 
-        while (auto request = device::dequeue_request(dev, endpoint)) { // older
-                device::send_cmd_unlink_and_cancel(endp.device, request);
+        LONG64 cnt = 0;
+
+        for (auto req = device::remove_unsent(dev, endpoint); req; ++cnt) {
+                auto next = req->next; // request_ctx is freed on completion
+                complete(get_handle(req), STATUS_CANCELLED);
+                req = next;
         }
 
-        while (auto request = device::remove_egress_request(dev, endpoint)) { // newer
-                device::send_cmd_unlink_and_cancel(endp.device, request);
+        if (auto head = device::remove_requests(dev, endpoint)) {
+                cnt += device::send_cmd_unlinks_and_cancel(endp.device, head);
         }
 
+        InterlockedAdd64(&dev.stats.purged_urbs, cnt);
+
+        device::cancel_throttled(endp.device, endpoint);
+
         auto purge_complete = [] ([[maybe_unused]] auto queue, auto ctx) // EVT_WDF_IO_QUEUE_STATE
         { 
                 auto endpoint = static_cast<UDECXUSBENDPOINT>(ctx);
                 NT_ASSERT(get_endpoint(queue) == endpoint);
 
+                auto &endp = *get_endpoint_ctx(endpoint);
+                auto duration = LONG64(KeQueryInterruptTime() - endp.purge_started);
+
+                update_purge_stats(*get_device_ctx(endp.device), duration);
+                TraceDbg("endp %04x, purged in %I64d us", ptr04x(endpoint), duration/10);
+
                 UdecxUsbEndpointPurgeComplete(endpoint);
         };
 
@@ -256,7 +315,7 @@ NTSTATUS function_suspend_and_wake(
  * it can be called concurrently from UDECX_USB_ENDPOINT_CALLBACKS.EvtUsbEndpointPurge.
  * If set SynchronizationScopeDevice for UDECXUSBENDPOINT, UdecxUsbEndpointCreate 
  * will return STATUS_WDF_SYNCHRONIZATION_SCOPE_INVALID. For these reasons,
- * explicit WDFSPINLOCK device_ctx.send_lock is used to serialize WskSend calls.
+ * WskSend calls are serialized by the owner flag of lock-free device_ctx.sendq.
  * 
  * Using power-managed queues for I/O requests that require the device to be in its working state, 
  * and using queues that are not power-managed for all other requests.
@@ -273,6 +332,7 @@ PAGED auto create_endpoint_queue(_Inout_ WDFQUEUE &queue, _In_ UDECXUSBENDPOINT
         WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchParallel); // FIXME: Sequential for EP0?
         cfg.PowerManaged = WdfFalse;
         cfg.EvtIoInternalDeviceControl = device::internal_control;
+        cfg.EvtIoCanceledOnQueue = device::canceled_on_queue; // @see endpoint_ctx::throttled
 
         WDF_OBJECT_ATTRIBUTES attr;
         WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, UDECXUSBENDPOINT);
@@ -293,6 +353,23 @@ PAGED auto create_endpoint_queue(_Inout_ WDFQUEUE &queue, _In_ UDECXUSBENDPOINT
         return STATUS_SUCCESS;
 }
 
+/*
+ * UDE does not tell how many URBs a function driver keeps outstanding for an endpoint,
+ * these are typical numbers for client drivers of each type.
+ */
+constexpr LONG max_outstanding_urbs(_In_ const USB_ENDPOINT_DESCRIPTOR &d)
+{
+        switch (usb_endpoint_type(d)) {
+        case UsbdPipeTypeIsochronous:
+        case UsbdPipeTypeBulk:
+                return 4;
+        case UsbdPipeTypeInterrupt:
+        case UsbdPipeTypeControl:
+        default:
+                return 2;
+        }
+}
+
 /*
  * UDE can call UDECX_USB_DEVICE_STATE_CHANGE_CALLBACKS despite UdecxUsbDevicePlugOutAndDelete was called.
  * This can cause BSOD:
@@ -359,6 +436,14 @@ PAGED NTSTATUS endpoint_add(_In_ UDECXUSBDEVICE device, _In_ UDECX_USB_ENDPOINT_
                 return err;
         }
 
+        endp.reserved = max_outstanding_urbs(endp.descriptor); // the reserve is refilled by free() if it is short
+        bool isoch = usb_endpoint_type(endp.descriptor) == UsbdPipeTypeIsochronous;
+
+        if (auto err = reserve_wsk_contexts(dev, endp.reserved, isoch)) {
+                Trace(TRACE_LEVEL_WARNING, "dev %04x, endp %04x, reserve_wsk_contexts(%ld, isoch %d) %!STATUS!", 
+                        ptr04x(device), ptr04x(endpoint), endp.reserved, isoch, err);
+        }
+
         {
                 auto &d = endp.descriptor;
                 TraceDbg("dev %04x, endp %04x{Length %d, Address %#04x{%s %s[%d]}, Attributes %#x, MaxPacketSize %#x, "
@@ -530,6 +615,182 @@ PAGED auto create_spin_lock(_Out_ WDFSPINLOCK *handle, _In_ UDECXUSBDEVICE devic
         return STATUS_SUCCESS;
 }
 
+/*
+ * Requests that were sent over the lost connection.
+ * IN transfers of bulk and interrupt endpoints are sent again, the device did not return data for them.
+ * OUT transfers could have been executed, control transfers could change the state of the device,
+ * isochronous transfers are stale, they are cancelled.
+ *
+ * URBs that arrived after connection loss are already held. The resubmitted ones arrived earlier,
+ * they are retried ahead of the held ones and later URBs of their endpoints wait for them, @see device::hold.
+ *
+ * PDUs that are still waiting for WskSend are taken first, they must not be sent over the new connection.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void fail_or_resubmit(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        ULONG resubmitted = 0;
+        ULONG failed = 0;
+
+        request_ctx* lists[] { // in this order
+                device::remove_unsent(dev),
+                remove_requests(dev, device::request_search())
+        };
+
+        for (auto head: lists) {
+                for (auto req = head; req; ) {
+                        auto next = req->next; // request_ctx is freed on completion
+                        auto request = get_handle(req);
+
+                        auto &d = get_endpoint_ctx(req->endpoint)->descriptor;
+                        auto type = usb_endpoint_type(d);
+
+                        if (usb_endpoint_dir_in(d) && (type == UsbdPipeTypeBulk || type == UsbdPipeTypeInterrupt) &&
+                            device::hold(dev, req->endpoint, request) == STATUS_PENDING) { // URB is intact
+                                ++resubmitted;
+                        } else {
+                                complete(request, STATUS_CANCELLED);
+                                ++failed;
+                        }
+
+                        req = next;
+                }
+        }
+
+        dev.stats.resubmitted += resubmitted;
+        dev.stats.resume_failed += failed;
+
+        TraceDbg("dev %04x, %lu request(s) will be resubmitted, %lu cancelled", ptr04x(device), resubmitted, failed);
+}
+
+/*
+ * The device stays plugged in while reconnecting, URBs are held in reserve.throttled.
+ * The configuration is not restored, usbip-host resets the device on connection loss
+ * and usb_reset_device restores the configuration and alternate settings.
+ * @see device::async_resume
+ */
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+PAGED void NTAPI resume(_In_ WDFWORKITEM WorkItem)
+{
+        PAGED_CODE();
+
+        auto device = static_cast<UDECXUSBDEVICE>(WdfWorkItemGetParentObject(WorkItem));
+        auto &dev = *get_device_ctx(device);
+        NT_ASSERT(dev.resuming);
+
+        stop_receive_events(dev);
+
+        if (close_socket(dev.sock())) { // WskSend-s and WskReceive are completed
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection lost, resuming", ptr04x(device));
+                device_state_changed(dev, vhci::state::disconnected);
+        }
+
+        WdfWorkItemFlush(dev.recv_hdr); // must not issue WskReceive on the new socket
+        fail_or_resubmit(device, dev);
+
+        auto deadline = dev.outage_started + dev.ext->resume_timeout*ULONGLONG(wdm::second);
+        auto delay = make_timeout(wdm::second, wdm::period::relative); // between attempts
+
+        auto st = STATUS_IO_TIMEOUT;
+        device_state_changed(dev, vhci::state::connecting);
+
+        while (!dev.unplugged && KeQueryInterruptTime() < deadline) {
+                if (st = vhci::reconnect(*dev.ext); NT_SUCCESS(st)) {
+                        break;
+                }
+
+                KeDelayExecutionThread(KernelMode, false, &delay);
+        }
+
+        if (NT_ERROR(st) || dev.unplugged) {
+                Trace(TRACE_LEVEL_ERROR, "dev %04x, can't resume %!STATUS!", ptr04x(device), st);
+                InterlockedExchange8(PCHAR(&dev.resuming), false);
+                device::async_plugout_and_delete(device); // held URBs are cancelled by detach
+                return;
+        }
+
+        device_state_changed(dev, vhci::state::connected);
+        start_receive(dev);
+
+        auto &s = dev.stats;
+        auto outage = KeQueryInterruptTime() - dev.outage_started;
+
+        ++s.resumes;
+        s.outage_time += outage;
+        s.outage_max = max(s.outage_max, outage);
+
+        InterlockedExchange8(PCHAR(&dev.resuming), false);
+        WdfWorkItemEnqueue(dev.reserve.retry); // held URBs
+
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x, resumed after %I64u ms outage", ptr04x(device), outage/10'000);
+        device_state_changed(dev, vhci::state::plugged);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_resume_workitem(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+
+        WDF_WORKITEM_CONFIG cfg;
+        WDF_WORKITEM_CONFIG_INIT(&cfg, resume);
+        cfg.AutomaticSerialization = false;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        if (auto err = WdfWorkItemCreate(&cfg, &attr, &dev.resume)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWorkItemCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
+/*
+ * @see device_ioctl.cpp, throttle
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto init_reserve(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
+{
+        PAGED_CODE();
+        auto &r = dev.reserve;
+
+        for (auto &head: r.list) {
+                InitializeSListHead(&head);
+        }
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
+        cfg.PowerManaged = WdfFalse;
+        cfg.EvtIoCanceledOnQueue = device::canceled_on_queue;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ParentObject = device;
+
+        if (auto err = WdfIoQueueCreate(dev.vhci, &cfg, &attr, &r.throttled)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        WDF_WORKITEM_CONFIG wi_cfg;
+        WDF_WORKITEM_CONFIG_INIT(&wi_cfg, device::retry_throttled);
+        wi_cfg.AutomaticSerialization = false;
+
+        if (auto err = WdfWorkItemCreate(&wi_cfg, &attr, &r.retry)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWorkItemCreate %!STATUS!", err);
+                return err;
+        }
+
+        return STATUS_SUCCESS;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
@@ -537,9 +798,9 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
         PAGED_CODE();
 
         WDFSPINLOCK *v[] = {
-                &dev.send_lock,
                 &dev.endpoint_list_lock,
-                &dev.egress_requests_lock,
+                &dev.requests_lock,
+                &dev.descriptors_lock,
         };
 
         for (auto i: v) {
@@ -556,11 +817,22 @@ PAGED auto init_device(_In_ UDECXUSBDEVICE device, _Inout_ device_ctx &dev)
                 return err;
         }
 
-        if (auto err = device::create_queue(device)) {
+        if (auto err = device::create_request_table(dev)) {
+                return err;
+        }
+
+        if (auto err = create_descriptor_cache(dev)) {
+                return err;
+        }
+
+        if (auto err = init_reserve(device, dev)) {
+                return err;
+        }
+
+        if (auto err = create_resume_workitem(device, dev)) {
                 return err;
         }
 
-        InitializeListHead(&dev.egress_requests);
         KeInitializeEvent(&dev.detach_completed, NotificationEvent, false);
 
         return STATUS_SUCCESS;
@@ -586,6 +858,42 @@ PAGED auto plugout_and_delete(_In_ UDECXUSBDEVICE dev, _In_ WDFWAITLOCK delete_l
         return true;
 }
 
+/*
+ * Buckets: < 16us, < 32us, ... , < 16ms, >= 16ms.
+ * @see device_ioctl.cpp, get_delay_bucket
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void log_send_delay(_In_ UDECXUSBDEVICE device, _In_ const device_ctx &dev)
+{
+        PAGED_CODE();
+        static_assert(SEND_DELAY_BUCKETS == 12);
+
+        for (int i = 0; i < SEND_SLOTS; ++i) {
+
+                auto &h = dev.stats.send_delay[i];
+                ULONG64 total = 0;
+
+                for (auto n: h) {
+                        total += n;
+                }
+
+                if (!total) {
+                        continue;
+                }
+
+                char ep[16] = "CMD_UNLINK";
+                if (i != SEND_SLOTS - 1) {
+                        NT_VERIFY(!RtlStringCbPrintfA(ep, sizeof(ep), "ep %d %s", i & 0xF, i & 0x10 ? "In" : "Out"));
+                }
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %s, %I64u PDUs, send delay histogram "
+                        "%I64u %I64u %I64u %I64u %I64u %I64u %I64u %I64u %I64u %I64u %I64u %I64u", 
+                        ptr04x(device), ep, total, 
+                        h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7], h[8], h[9], h[10], h[11]);
+        }
+}
+
 /*
  * Call UdecxUsbDevicePlugOutAndDelete if UdecxUsbDevicePlugIn was successful.
  * After UdecxUsbDevicePlugOutAndDelete the client driver can no longer use UDECXUSBDEVICE.
@@ -611,15 +919,64 @@ PAGED void detach(_In_ UDECXUSBDEVICE device)
         auto &dev = *get_device_ctx(device);
 	NT_ASSERT(dev.unplugged);
 
-        WdfIoQueuePurgeSynchronously(dev.queue);
+        WdfWorkItemFlush(dev.resume); // it checks dev.unplugged between attempts
+        stop_receive_events(dev);
 
         if (close_socket(dev.sock())) {
                 Trace(TRACE_LEVEL_INFORMATION, "dev %04x, connection closed", ptr04x(device));
                 device_state_changed(dev, vhci::state::disconnected);
         }
 
-        while (auto request = remove_egress_request(dev, device::request_search())) {
-                complete(request, STATUS_CANCELLED);
+        {
+                auto &s = dev.stats;
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %I64u PDUs received by %I64u WskReceive, %I64u bytes drained, "
+                        "next WskReceive: inline %I64u, workitem %I64u", ptr04x(device), 
+                        s.recv_pdus, s.recv_irps, s.drained_bytes, s.recv_inline, s.recv_hops);
+
+                auto ms = (KeQueryInterruptTime() - s.started)/10'000; // 100-nanosecond units
+                auto irps = s.send_irps ? s.send_irps : 1;
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %I64u PDUs sent by %I64u WskSend, %I64u WskSend/s, "
+                        "average batch %I64u.%02I64u, OUT payload inlined %I64d", ptr04x(device), s.send_pdus, s.send_irps, 
+                        ms ? s.send_irps*1000/ms : 0, s.send_pdus/irps, s.send_pdus*100/irps % 100, s.send_inline);
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, wsk_context reserve used %I64d, URBs throttled %I64d", 
+                        ptr04x(device), s.reserve_used, s.throttled);
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, requests in flight: max %lu of %u, displaced max %lu", 
+                        ptr04x(device), s.requests_max, dev.requests->max_size(), s.requests_displaced);
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %I64d endpoint purges, %I64d URBs cancelled, "
+                        "purge latency: average %I64d us, max %I64d us", ptr04x(device), s.purges, s.purged_urbs, 
+                        s.purges ? s.purge_time/s.purges/10 : 0, s.purge_max/10);
+
+                auto dsc_total = s.dsc_hits + s.dsc_misses;
+                auto dsc_rtt = s.dsc_rtt_cnt ? s.dsc_rtt/s.dsc_rtt_cnt : 0; // average round trip of GET_DESCRIPTOR
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, descriptor cache: hits %I64d, misses %I64d, hit ratio %I64d%%, "
+                        "average round trip %I64d us, time saved %I64d ms", ptr04x(device), s.dsc_hits, s.dsc_misses, 
+                        dsc_total ? 100*s.dsc_hits/dsc_total : 0, dsc_rtt/10, s.dsc_hits*dsc_rtt/10'000);
+
+                Trace(TRACE_LEVEL_INFORMATION, "dev %04x, %I64u session(s) resumed, outage: average %I64u ms, max %I64u ms, "
+                        "URBs resubmitted %I64u, cancelled %I64u", ptr04x(device), s.resumes, 
+                        s.resumes ? s.outage_time/s.resumes/10'000 : 0, s.outage_max/10'000, s.resubmitted, s.resume_failed);
+        }
+
+        log_send_delay(device, dev);
+
+        WdfIoQueuePurgeSynchronously(dev.reserve.throttled); // URBs that did not get wsk_context
+
+        request_ctx* lists[] { // PDUs that were not sent are taken first
+                device::remove_unsent(dev),
+                remove_requests(dev, device::request_search())
+        };
+
+        for (auto head: lists) {
+                for (auto req = head; req; ) {
+                        auto next = req->next; // request_ctx is freed on completion
+                        complete(get_handle(req), STATUS_CANCELLED);
+                        req = next;
+                }
         }
 
         auto port = vhci::reclaim_roothub_port(device);
@@ -778,6 +1135,35 @@ NTSTATUS usbip::device::async_plugout_and_delete(_In_ UDECXUSBDEVICE device)
         return STATUS_SUCCESS;
 }
 
+/*
+ * Is called on connection loss. Reconnect in the background if device_ctx_ext::resume_timeout is set,
+ * otherwise unplug the device.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::async_resume(_In_ UDECXUSBDEVICE device)
+{
+        auto &dev = *get_device_ctx(device);
+
+        if (!dev.ext->resume_timeout) {
+                return async_plugout_and_delete(device);
+        } else if (dev.unplugged) {
+                TraceDbg("dev %04x, already unplugged", ptr04x(device));
+                return STATUS_PENDING;
+        }
+
+        static_assert(sizeof(dev.resuming) == sizeof(CHAR));
+        if (InterlockedExchange8(PCHAR(&dev.resuming), true)) {
+                TraceDbg("dev %04x, already resuming", ptr04x(device));
+                return STATUS_PENDING;
+        }
+
+        dev.outage_started = KeQueryInterruptTime();
+        WdfWorkItemEnqueue(dev.resume);
+
+        return STATUS_SUCCESS;
+}
+
 /*
  * Do not call WdfIoQueuePurgeSynchronously from the following queue object event callback functions,
  * regardless of the queue with which the event callback function is associated:
@@ -28,6 +28,10 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS async_plugout_and_delete(_In_ UDECXUSBDEVICE device);
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS async_resume(_In_ UDECXUSBDEVICE device);
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS plugout_and_delete(_In_ UDECXUSBDEVICE device);
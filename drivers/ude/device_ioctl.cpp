@@ -14,6 +14,7 @@
 #include "network.h"
 #include "ioctl.h"
 #include "wsk_receive.h"
+#include "descriptor_cache.h"
 
 #include "filter_request.h"
 #include <ude_filter\request.h>
@@ -35,64 +36,49 @@ using namespace usbip;
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void move_request_to_queue(_Inout_ device_ctx &dev, _In_ WDFREQUEST request)
+void set_request_waiting(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ seqnum_t seqnum)
 {
-        auto st = device::move_egress_request_to_queue(dev, request);
-
-        switch (st) {
+        switch (auto st = device::set_request_waiting(dev, request, seqnum)) {
         case STATUS_NOT_FOUND: // WskReceive completion handler has already removed it
         case STATUS_SUCCESS:
-                return;
-        case STATUS_WDF_BUSY: // destination queue is not accepting new requests
-                TraceDbg("req %04x, queue is purged", ptr04x(request));
-                st = STATUS_CANCELLED;
+                break;
+        case STATUS_CANCELLED:
+                TraceDbg("req %04x was cancelled", ptr04x(request));
+                device::send_cmd_unlink_and_cancel(get_handle(&dev), request);
                 break;
         default:
-                Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), st);
+                Trace(TRACE_LEVEL_ERROR, "req %04x, set_request_waiting %!STATUS!", ptr04x(request), st);
         }
-
-        complete(request, st);
 }
 
-/*
- * wsk_irp->Tail.Overlay.DriverContext[] are zeroed.
- *
- * The completion handler for WskReceive is executed by a high priority thread
- * and is usually called before this handler.
- * @see wsk_receive.cpp, find_request
- */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS send_complete(
-        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+void on_send_complete(_Inout_ device_ctx &dev, _In_ const wsk_context &ctx, _In_ NTSTATUS status)
 {
-        wsk_context_ptr ctx(static_cast<wsk_context*>(Context), true);
-
-        auto request = ctx->request; // can be WDF_NO_HANDLE or already completed
-        auto &dev = *ctx->dev;
-
-        auto &wsk = wsk_irp->IoStatus;
-        TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
-                  ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
+        auto request = ctx.request; // can be already completed, its context must not be accessed
+        auto seqnum = seqnum_t(RtlUlongByteSwap(ctx.hdr.base.seqnum)); // the header was sent in network byte order
 
         if (!request) {
                 // nothing to do
-        } else if (NT_SUCCESS(wsk.Status)) { // request has sent
-                move_request_to_queue(dev, request);
-        } else if (auto victim = device::remove_egress_request(dev, request)) {
+        } else if (NT_SUCCESS(status)) { // request has sent
+                set_request_waiting(dev, request, seqnum);
+        } else if (auto victim = device::remove_request(dev, device::request_search(request, seqnum))) {
                 NT_ASSERT(victim == request);
-                complete(victim, wsk.Status);
+                complete(victim, status);
         } else {
                 Trace(TRACE_LEVEL_ERROR, "req %04x not found among egress", ptr04x(request));
         }
+}
 
-        if (wsk.Status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void resume_if_closed(_Inout_ device_ctx &dev, _In_ NTSTATUS status)
+{
+        if (status == STATUS_FILE_FORCED_CLOSED && !dev.unplugged) {
                 auto hdev = get_handle(&dev);
-                TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), wsk.Status);
-                device::async_plugout_and_delete(hdev);
+                TraceDbg("dev %04x, connection lost %!STATUS!", ptr04x(hdev), status);
+                device::async_resume(hdev);
         }
-
-        return StopCompletion;
 }
 
 _IRQL_requires_same_
@@ -100,14 +86,22 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_ const URB *transfer_buffer)
 {
         NT_ASSERT(!ctx.mdl_buf);
+        ULONG inlined = 0; // bytes of hdr_payload
 
         if (transfer_buffer && is_transfer_dir_out(ctx.hdr)) { // TransferFlags can have wrong direction
-                if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, URB_BUF_LEN, IoReadAccess, *transfer_buffer)) {
+                auto len = ULONG(ctx.hdr.u.cmd_submit.transfer_buffer_length); // can be less than TransferBufferLength
+
+                if (len && len <= ctx.dev->ext->inline_out_max && 
+                    copy_transfer_buffer(ctx.hdr_payload, len, ctx.mdl_buf, *transfer_buffer)) {
+                        inlined = len;
+                        InterlockedIncrement64(&ctx.dev->stats.send_inline);
+                } else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, len, IoReadAccess, *transfer_buffer)) {
                         Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
                         return err;
                 }
         }
 
+        ctx.mdl_hdr.get()->ByteCount = sizeof(ctx.hdr) + inlined; // like NdisAdjustMdlLength, pages are already built
         ctx.mdl_hdr.next(ctx.mdl_buf); // always replace tie from previous call
 
         if (ctx.is_isoc) {
@@ -121,21 +115,22 @@ auto prepare_wsk_buf(_Inout_ WSK_BUF &buf, _Inout_ wsk_context &ctx, _Inout_opt_
         buf.Offset = 0;
         buf.Length = get_total_size(ctx.hdr);
 
-        NT_ASSERT(verify(buf, ctx.is_isoc));
+        NT_ASSERT(verify(buf, true)); // PDUs can be chained, @see send_batch
         return STATUS_SUCCESS;
 }
 
 /*
- * WskSend reads data directly from URB transfer buffer. A request must not be added to Cancel-Safe IRP Queue
+ * WskSend reads data directly from URB transfer buffer. A request must not be marked cancelable
  * until the completion handler is called, otherwise it could be cancelled while the buffer is being copied.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void add_egress_request(
+auto add_egress_request(
         _Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ UDECXUSBENDPOINT endpoint, _In_ seqnum_t seqnum)
 {
         auto &req = *get_request_ctx(request);
-        InitializeListHead(&req.entry);
+        req.cancelable = false;
+        req.cancelled = false;
 
         NT_ASSERT(endpoint);
         req.endpoint = endpoint;
@@ -143,23 +138,337 @@ void add_egress_request(
         req.seqnum = seqnum;
         NT_ASSERT(is_valid_seqnum(req.seqnum));
 
-        device::add_egress_request(dev, req);
+        return device::add_egress_request(dev, req);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void log_send_status(
+        _In_opt_ WDFREQUEST request, _In_ IRP *wsk_irp, _In_ SIZE_T length, _In_ NTSTATUS st, _In_ const device_ctx &dev)
+{
+        switch (st) {
+        case STATUS_PENDING:
+        case STATUS_SUCCESS:
+                TraceWSK("req %04x -> wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(request), ptr04x(wsk_irp), length, st);
+                break;
+        default:
+                Trace(TRACE_LEVEL_ERROR, "req %04x -> wsk irp %04x, %!STATUS!", ptr04x(request), ptr04x(wsk_irp), st);
+                if (st == STATUS_NOT_SUPPORTED) { // WskSend does not complete IRP for this status only
+                        libdrv::CompleteRequest(wsk_irp, dev.unplugged ? STATUS_CANCELLED : st);
+                }
+        }
 }
 
+enum { 
+        SEND_BATCH_MAX = 64*1024, // flush even if WskSend is in flight
+        SEND_INFLIGHT_MAX = 1024*1024, // the rest waits in the scheduler, at least one PDU is sent anyway
+        SEND_QUANTUM = 16*1024, // bytes per round of deficit round-robin
+        SEND_SLOT_UNLINK = SEND_SLOTS - 1
+};
+
 /*
- * switch (wdf::Lock lck(...); auto st = send(...))
- * is not used due to unspecified evaluation order of init-statement and condition.
- * switch (init-statement; condition) {} can be treated as:
- * {
- *      auto c = condition;
- *      init-statement;
- *      switch (c) {}
- * }
+ * Isochronous and interrupt transfers jump ahead of control and bulk.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
-        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
+constexpr UCHAR get_send_class(_In_ USBD_PIPE_TYPE type)
+{
+        switch (type) {
+        case UsbdPipeTypeIsochronous:
+                return 0;
+        case UsbdPipeTypeInterrupt:
+                return 1;
+        case UsbdPipeTypeControl:
+                return 2;
+        }
+
+        return 3;
+}
+static_assert(get_send_class(UsbdPipeTypeBulk) == SEND_CLASSES - 1);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_send_slot(_In_ const USB_ENDPOINT_DESCRIPTOR &d)
+{
+        return UCHAR(usb_endpoint_num(d) | (usb_endpoint_dir_in(d) ? 16 : 0));
+}
+
+/*
+ * CMD_UNLINK shares the FIFO of the endpoint of the request to be unlinked,
+ * it must not overtake its CMD_SUBMIT.
+ *
+ * The quantum of deficit round-robin is weighted by the class hints of the interface,
+ * @see filter_request.cpp, get_priority_boost.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void set_send_params(_Inout_ wsk_context &ctx, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        if (!endpoint) {
+                ctx.send_slot = SEND_SLOT_UNLINK;
+                ctx.send_class = 0;
+                ctx.send_quantum = SEND_QUANTUM;
+                return;
+        }
+
+        auto &endp = *get_endpoint_ctx(endpoint);
+        auto &d = endp.descriptor;
+
+        ctx.send_slot = get_send_slot(d);
+        ctx.send_class = get_send_class(usb_endpoint_type(d));
+        ctx.send_quantum = SEND_QUANTUM*(1 + endp.priority_boost);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_delay_bucket(_In_ ULONGLONG queued, _In_ ULONGLONG now)
+{
+        auto us = (now - queued)/10; // 100-nanosecond units
+
+        ULONG msb;
+        if (!_BitScanReverse64(&msb, us >> 4)) { // < 16us
+                return 0UL;
+        }
+
+        return min(msb + 1, ULONG(SEND_DELAY_BUCKETS - 1));
+}
+
+/*
+ * Restore MDL chain of a PDU that was linked with the chain of the next PDU.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void unchain(_Inout_ wsk_context &ctx, _In_opt_ const wsk_context *next)
+{
+        if (!next) {
+                return;
+        }
+
+        for (auto m = ctx.mdl_hdr.get(); m; m = m->Next) {
+                if (m->Next == next->mdl_hdr.get()) {
+                        m->Next = nullptr;
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_queued(_Inout_ device_ctx &dev);
+
+/*
+ * Send budget is returned, PDUs that wait in the scheduler can be sent.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void on_wsk_send_complete(_Inout_ device_ctx &dev, _In_ LONG64 len)
+{
+        InterlockedAdd64(&dev.sendq.in_flight_bytes, -len);
+        NT_VERIFY(InterlockedDecrement(&dev.sendq.in_flight) >= 0);
+
+        send_queued(dev);
+}
+
+/*
+ * wsk_irp->Tail.Overlay.DriverContext[] are zeroed.
+ *
+ * The completion handler for WskReceive is executed by a high priority thread
+ * and is usually called before this handler.
+ * @see wsk_receive.cpp, ret_submit
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_complete(
+        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+        wsk_context_ptr ctx(static_cast<wsk_context*>(Context), true);
+
+        auto request = ctx->request; // can be WDF_NO_HANDLE or already completed
+        auto &dev = *ctx->dev;
+        auto len = ctx->send_len;
+
+        auto &wsk = wsk_irp->IoStatus;
+        TraceWSK("req %04x -> wsk irp %04x, %!STATUS!, Information %Iu", 
+                  ptr04x(request), ptr04x(wsk_irp), wsk.Status, wsk.Information);
+
+        on_send_complete(dev, *ctx, wsk.Status);
+        resume_if_closed(dev, wsk.Status);
+
+        ctx.reset(nullptr, false);
+        on_wsk_send_complete(dev, len);
+
+        return StopCompletion;
+}
+
+/*
+ * Context is the head of the batch, its wsk_irp was used for WskSend.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS send_batch_complete(
+        _In_ DEVICE_OBJECT*, _In_ IRP *wsk_irp, _In_reads_opt_(_Inexpressible_("varies")) void *Context)
+{
+        auto head = static_cast<wsk_context*>(Context);
+        auto &dev = *head->dev;
+
+        auto st = wsk_irp->IoStatus.Status; // IoReuseIrp will reset it
+        TraceWSK("wsk irp %04x, %!STATUS!, Information %Iu", ptr04x(wsk_irp), st, wsk_irp->IoStatus.Information);
+
+        LONG64 len = 0;
+
+        for (auto ctx = head; ctx; ) {
+                auto next = ctx->next;
+                unchain(*ctx, next);
+
+                len += ctx->send_len;
+                on_send_complete(dev, *ctx, st);
+                free(ctx, ctx == head);
+
+                ctx = next;
+        }
+
+        resume_if_closed(dev, st);
+        on_wsk_send_complete(dev, len); // and PDUs that were gathered while WskSend was in flight
+
+        return StopCompletion;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_pdu(_Inout_ device_ctx &dev, _In_ wsk_context *ctx, _In_ SIZE_T len, _In_ PIO_COMPLETION_ROUTINE complete)
+{
+        InterlockedAdd64(&dev.sendq.bytes, -LONG64(len));
+        InterlockedAdd64(&dev.sendq.in_flight_bytes, len);
+        InterlockedIncrement(&dev.sendq.in_flight);
+
+        WSK_BUF buf{ .Mdl = ctx->mdl_hdr.get(), .Length = len };
+        NT_ASSERT(verify(buf, true));
+
+        auto request = ctx->request; // do not access ctx or wsk_irp after send
+        auto wsk_irp = ctx->wsk_irp;
+        IoSetCompletionRoutine(wsk_irp, complete, ctx, true, true, true);
+
+        auto st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
+        ++dev.stats.send_irps;
+
+        log_send_status(request, wsk_irp, len, st, dev);
+}
+
+/*
+ * Chain PDUs into one WskSend, the IRP of the head is used.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_batch(_Inout_ device_ctx &dev, _In_ wsk_context *head)
+{
+        SIZE_T len = head->send_len;
+
+        for (auto prev = head, ctx = head->next; ctx; prev = ctx, ctx = ctx->next) {
+                auto t = tail(prev->mdl_hdr); // the chain of prev is not linked with ctx yet
+                t->Next = ctx->mdl_hdr.get();
+                len += ctx->send_len;
+        }
+
+        send_pdu(dev, head, len, send_batch_complete);
+}
+
+/*
+ * PDUs taken from the queue are passed to the scheduler in the order of push.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void schedule(_Inout_ device_ctx &dev, _In_opt_ wsk_context *head)
+{
+        for (auto ctx = head; ctx; ) {
+                auto next = ctx->next;
+                dev.sendq.sched.push(ctx);
+                ctx = next;
+        }
+}
+
+/*
+ * Takes PDUs from the scheduler until the budget is exhausted.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void dispatch(_Inout_ device_ctx &dev, _In_opt_ wsk_context *head)
+{
+        auto &q = dev.sendq;
+        schedule(dev, head);
+
+        auto coalescing = dev.ext->send_coalescing;
+        auto now = KeQueryInterruptTime();
+
+        wsk_context *batch{};
+        wsk_context *batch_tail{};
+
+        for (LONG64 budget = SEND_INFLIGHT_MAX - q.in_flight_bytes; budget > 0; ) {
+
+                auto ctx = q.sched.pop();
+                if (!ctx) {
+                        break;
+                }
+
+                ++dev.stats.send_delay[ctx->send_slot][get_delay_bucket(ctx->send_queued, now)];
+                ++dev.stats.send_pdus;
+                budget -= ctx->send_len;
+
+                if (!(coalescing || ctx->send_gather)) {
+                        send_pdu(dev, ctx, ctx->send_len, send_complete);
+                } else if (batch_tail) {
+                        batch_tail->next = ctx;
+                        batch_tail = ctx;
+                } else {
+                        batch = batch_tail = ctx;
+                }
+        }
+
+        q.backlog = q.sched.size();
+
+        if (batch) {
+                send_batch(dev, batch);
+        }
+}
+
+/*
+ * Whoever wins the owner flag of the queue calls WskSend, one thread at a time,
+ * so PDUs of an endpoint are not reordered on the wire. The order between endpoints is set by send_scheduler.
+ * WskSend's completion routine can be called before it returns, it can't be the owner then.
+ *
+ * PDUs wait in the scheduler if SEND_INFLIGHT_MAX is reached, so urgent ones can jump ahead.
+ * If coalescing, PDUs are also gathered while WskSend is in flight until SEND_BATCH_MAX is reached.
+ *
+ * The owner runs at DISPATCH_LEVEL, device::remove_unsent spins for the flag.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void send_queued(_Inout_ device_ctx &dev)
+{
+        auto &q = dev.sendq;
+        auto coalescing = dev.ext->send_coalescing;
+
+        libdrv::RaiseIrql irql(DISPATCH_LEVEL);
+
+        auto can = [&q, coalescing] 
+        {
+                if (q.queue.empty() && !q.backlog) {
+                        return false;
+                } else if (q.in_flight_bytes >= SEND_INFLIGHT_MAX) {
+                        return false;
+                }
+                return !coalescing || !q.in_flight || q.bytes >= SEND_BATCH_MAX;
+        };
+
+        q.queue.consume(can, [&dev] (auto head) { dispatch(dev, head); });
+}
+
+/*
+ * The caller must call send_queued.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto enqueue(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
+        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr, _In_ bool gather = false)
 {
         auto request = ctx->request; // can be WDF_NO_HANDLE, do not access after send
 
@@ -172,36 +481,156 @@ auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_
                         ptr04x(request), buf.Length, dbg_usbip_hdr(str, sizeof(str), &ctx->hdr, log_setup));
         }
 
-        if (request) {
-                add_egress_request(dev, request, endpoint, ctx->hdr.base.seqnum);
+        if (!request) {
+                //
+        } else if (auto err = add_egress_request(dev, request, endpoint, ctx->hdr.base.seqnum)) {
+                Trace(TRACE_LEVEL_ERROR, "req %04x, too many requests in flight", ptr04x(request));
+                return err;
         }
 
         byteswap_header(ctx->hdr, swap_dir::host2net);
 
-        auto wsk_irp = ctx->wsk_irp; // do not access ctx or wsk_irp after send
-        IoSetCompletionRoutine(wsk_irp, send_complete, ctx.release(), true, true, true);
+        ctx->send_len = ULONG(buf.Length);
+        set_send_params(*ctx, endpoint);
+        ctx->send_gather = gather;
+        ctx->send_queued = KeQueryInterruptTime();
 
-        NTSTATUS st;
-        {
-                wdf::Lock lck(dev.send_lock); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
-                st = send(dev.sock(), &buf, WSK_FLAG_NODELAY, wsk_irp);
+        InterlockedAdd64(&dev.sendq.bytes, buf.Length);
+        dev.sendq.queue.push(ctx.release()); // EvtUsbEndpointPurge, EvtIoInternalDeviceControl on other queues
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto send(_In_opt_ UDECXUSBENDPOINT endpoint, _In_ wsk_context_ptr &ctx, _Inout_ device_ctx &dev,
+        _In_ bool log_setup, _Inout_opt_ const URB* transfer_buffer = nullptr)
+{
+        if (auto err = enqueue(endpoint, ctx, dev, log_setup, transfer_buffer)) {
+                return err;
         }
 
-        switch (st) {
-        case STATUS_PENDING:
-        case STATUS_SUCCESS:
-                TraceWSK("req %04x -> wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(request), ptr04x(wsk_irp), buf.Length, st);
-                break;
-        default:
-                Trace(TRACE_LEVEL_ERROR, "req %04x -> wsk irp %04x, %!STATUS!", ptr04x(request), ptr04x(wsk_irp), st);
-                if (st == STATUS_NOT_SUPPORTED) { // WskSend does not complete IRP for this status only
-                        libdrv::CompleteRequest(wsk_irp, dev.unplugged ? STATUS_CANCELLED : st);
+        send_queued(dev);
+        return STATUS_PENDING;
+}
+
+/*
+ * URBs of an endpoint are sent in order of arrival. While some of them are throttled, 
+ * the later ones are throttled too, @see must_wait.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void track(_In_ UDECXUSBENDPOINT endpoint, _Inout_ request_ctx &req)
+{
+        req.endpoint = endpoint;
+        auto &t = get_endpoint_ctx(endpoint)->throttled;
+
+        if (!req.throttled) {
+                req.throttled = true;
+                InterlockedIncrement(&t.cnt);
+                return;
+        }
+
+        for (auto cur = t.blocked; !cur || req.order < cur; cur = t.blocked) { // retried URB is throttled again
+                if (InterlockedCompareExchange64(&t.blocked, req.order, cur) == cur) {
+                        break;
                 }
         }
+}
+
+/*
+ * Is called when the URB is sent or completed.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void untrack(_Inout_ request_ctx &req)
+{
+        if (req.throttled) {
+                req.throttled = false;
+                InterlockedDecrement(&get_endpoint_ctx(req.endpoint)->throttled.cnt);
+        }
+}
+
+/*
+ * A retried URB waits if an earlier one was throttled again, a new one waits for all throttled.
+ * The counter of a retried URB is decremented after it gets wsk_context, so it is never zero meanwhile.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto must_wait(_In_ const endpoint_ctx &endp, _In_ const request_ctx &req)
+{
+        if (req.throttled) {
+                auto blocked = endp.throttled.blocked;
+                return blocked && blocked < req.order;
+        }
+
+        return bool(endp.throttled.cnt);
+}
+
+/*
+ * @return true if the URB must be appended to device_ctx::reserve.throttled
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto must_throttle(
+        _In_ const device_ctx &dev, _In_ const endpoint_ctx &endp, _In_ WDFREQUEST request, _Out_ bool &exhausted)
+{
+        exhausted = device::requests_exhausted(dev);
+        return exhausted || must_wait(endp, *get_request_ctx(request));
+}
+
+/*
+ * Throttled URBs are mostly in order of arrival, so insertion into the list 
+ * that is sorted in descending order is cheap if it starts from the head.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void insert_descending(_Inout_ request_ctx* &head, _Inout_ request_ctx *req)
+{
+        auto pos = &head;
+        while (*pos && (*pos)->order > req->order) {
+                pos = &(*pos)->next;
+        }
+
+        req->next = *pos;
+        *pos = req;
+}
+
+/*
+ * URB that got no wsk_context waits in device_ctx::reserve.throttled until a context is returned 
+ * to the reserve, @see device::retry_throttled. The URB must not be modified before.
+ * @param exhausted the table of requests, the URB waits until the size drops, @see device::requests_exhausted
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto throttle(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request, _In_ bool exhausted = false)
+{
+        auto &r = dev.reserve;
+        track(endpoint, *get_request_ctx(request)); // is untracked by the caller if forwarding fails
+
+        if (auto err = WdfRequestForwardToIoQueue(request, r.throttled)) {
+                Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
 
+        InterlockedIncrement64(&dev.stats.throttled);
+        InterlockedIncrement(&r.throttled_cnt);
+
+        if (exhausted ? !device::requests_exhausted(dev) : // was completed meanwhile
+            ExQueryDepthSList(&r.list[0]) || ExQueryDepthSList(&r.list[1])) { // was returned meanwhile
+                WdfWorkItemEnqueue(r.retry);
+        }
+
+        TraceDbg("req %04x throttled%s", ptr04x(request), exhausted ? ", too many requests in flight" : "");
         return STATUS_PENDING;
 }
 
+constexpr auto is_set_configuration(_In_ const USB_DEFAULT_PIPE_SETUP_PACKET &pkt)
+{
+        return pkt.bRequest == USB_REQUEST_SET_CONFIGURATION && 
+               pkt.bmRequestType.B == (USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE);
+}
+
 using urb_function_t = NTSTATUS (device_ctx&, UDECXUSBENDPOINT, endpoint_ctx&, WDFREQUEST, URB&);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -219,6 +648,20 @@ auto control_transfer(
                 endp.PipeHandle = r.PipeHandle;
         }
 
+        if (!filter::is_request(r) && get_cached_descriptor(dev, request, r)) {
+                return STATUS_SUCCESS;
+        }
+
+        if (bool exhausted; must_throttle(dev, endp, request, exhausted)) {
+                return throttle(dev, endpoint, request, exhausted); // before unpack_request
+        }
+
+        wsk_context_ptr ctx(&dev, request);
+        if (!ctx) {
+                return throttle(dev, endpoint, request); // before unpack_request
+        }
+        untrack(*get_request_ctx(request));
+
         if (!filter::is_request(r)) {
                 //
         } else if (auto func = filter::get_function(r, true); auto err = filter::unpack_request(dev, r, func)) {
@@ -247,11 +690,10 @@ auto control_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
-        wsk_context_ptr ctx(&dev, request);
-        if (!ctx) {
-                return STATUS_INSUFFICIENT_RESOURCES;
+        if (is_set_configuration(pkt)) { // also URB_FUNCTION_SELECT_CONFIGURATION, @see filter::unpack_request
+                invalidate_descriptor_cache(dev);
         }
-        
+
         setup_dir dir_out = is_transfer_dir_out(urb.UrbControlTransfer); // default control pipe is bidirectional
 
         if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, r.TransferFlags, buf_len, dir_out)) {
@@ -288,10 +730,15 @@ auto bulk_or_interrupt_transfer(
                         r.TransferBufferLength, func);
         }
 
+        if (bool exhausted; must_throttle(dev, endp, request, exhausted)) {
+                return throttle(dev, endpoint, request, exhausted);
+        }
+
         wsk_context_ptr ctx(&dev, request);
         if (!ctx) {
-                return STATUS_INSUFFICIENT_RESOURCES;
+                return throttle(dev, endpoint, request);
         }
+        untrack(*get_request_ctx(request));
 
         if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, r.TransferFlags, r.TransferBufferLength)) {
                 return err;
@@ -365,10 +812,15 @@ auto isoch_transfer(
                 return STATUS_INVALID_PARAMETER;
         }
 
+        if (bool exhausted; must_throttle(dev, endp, request, exhausted)) {
+                return throttle(dev, endpoint, request, exhausted);
+        }
+
         wsk_context_ptr ctx(&dev, request, r.NumberOfPackets);
         if (!ctx) {
-                return STATUS_INSUFFICIENT_RESOURCES;
+                return throttle(dev, endpoint, request);
         }
+        untrack(*get_request_ctx(request));
 
         if (auto err = set_cmd_submit_usbip_header(ctx->hdr, dev, endp.descriptor, 
                                r.TransferFlags | USBD_START_ISO_TRANSFER_ASAP, r.TransferBufferLength)) {
@@ -475,6 +927,7 @@ void usbip::device::send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_
 {
         auto &dev = *get_device_ctx(device);
         auto &req = *get_request_ctx(request);
+        NT_ASSERT(!req.cancelable); // was unmarked, WskSend of its CMD_SUBMIT has completed
 
         TraceDbg("dev %04x, seqnum %u", ptr04x(device), req.seqnum);
 
@@ -482,7 +935,7 @@ void usbip::device::send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_
                 TraceDbg("Unplugged, do not send unlink");
         } else if (auto ctx = wsk_context_ptr(&dev, WDFREQUEST(WDF_NO_HANDLE))) {
                 set_cmd_unlink_usbip_header(ctx->hdr, dev, req.seqnum);
-                ::send(WDF_NO_HANDLE, ctx, dev, false); // ignore error
+                ::send(req.endpoint, ctx, dev, false); // ignore error, endpoint is for send_scheduler only
         } else {
                 Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req.seqnum);
         }
@@ -490,6 +943,46 @@ void usbip::device::send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_
         complete(request, STATUS_CANCELLED);
 }
 
+/*
+ * CMD_UNLINK-s are queued together and gathered into one WskSend, @see dispatch.
+ * The requests are completed after that, their CMD_SUBMIT-s are already sent, @see remove_requests.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG usbip::device::send_cmd_unlinks_and_cancel(_In_ UDECXUSBDEVICE device, _In_opt_ request_ctx *head)
+{
+        auto &dev = *get_device_ctx(device);
+        ULONG cnt = 0;
+
+        for (auto req = dev.unplugged ? nullptr : head; req; req = req->next) {
+                wsk_context_ptr ctx(&dev, WDFREQUEST(WDF_NO_HANDLE));
+                if (!ctx) {
+                        Trace(TRACE_LEVEL_ERROR, "dev %04x, seqnum %u, wsk_context_ptr error", ptr04x(device), req->seqnum);
+                        break;
+                }
+
+                set_cmd_unlink_usbip_header(ctx->hdr, dev, req->seqnum);
+                if (NT_SUCCESS(enqueue(req->endpoint, ctx, dev, false, nullptr, true))) {
+                        ++cnt;
+                }
+        }
+
+        if (cnt) {
+                send_queued(dev);
+        }
+
+        ULONG completed = 0;
+
+        for (auto req = head; req; ++completed) {
+                auto next = req->next; // request_ctx is freed on completion
+                complete(get_handle(req), STATUS_CANCELLED);
+                req = next;
+        }
+
+        TraceDbg("dev %04x, %lu CMD_UNLINK(s), %lu request(s) cancelled", ptr04x(device), cnt, completed);
+        return completed;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET usbip::device::make_set_configuration(_In_ UCHAR ConfigurationValue)
@@ -546,6 +1039,7 @@ NTSTATUS usbip::device::set_configuration(
         _In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUEST request, _In_ UCHAR ConfigurationValue)
 {
         TraceDbg("dev %04x, ConfigurationValue %d", ptr04x(device), ConfigurationValue);
+        invalidate_descriptor_cache(*get_device_ctx(device));
 
         auto r = make_set_configuration(ConfigurationValue);
         return send_ep0_out(device, request, r);
@@ -594,11 +1088,194 @@ NTSTATUS usbip::device::reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUE
         auto port = static_cast<USHORT>(dev.port); // meaningless for a server which ignores it
 
         TraceDbg("dev %04x, port %d", ptr04x(device), port);
+        invalidate_descriptor_cache(dev);
 
         auto r = make_reset_port(port);
         return send_ep0_out(device, request, r);
 }
 
+/*
+ * Throttled URBs are forwarded back to the queues of their endpoints in order of arrival, 
+ * the number of them is bounded because they can be throttled again.
+ * They stay counted in endpoint_ctx::throttled until sent, so new URBs are throttled behind them.
+ */
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void NTAPI usbip::device::retry_throttled(_In_ WDFWORKITEM WorkItem)
+{
+        auto device = static_cast<UDECXUSBDEVICE>(WdfWorkItemGetParentObject(WorkItem));
+        auto &dev = *get_device_ctx(device);
+        auto &r = dev.reserve;
+
+        if (dev.resuming) { // will be enqueued after resume
+                return;
+        }
+
+        InterlockedExchange(&r.throttled_cnt, 0);
+
+        ULONG cnt{};
+        WdfIoQueueGetState(r.throttled, &cnt, nullptr);
+
+        TraceDbg("dev %04x, %lu request(s)", ptr04x(device), cnt);
+
+        request_ctx *head{}; // in descending order
+        for (WDFREQUEST request; cnt && NT_SUCCESS(WdfIoQueueRetrieveNextRequest(r.throttled, &request)); --cnt) {
+                auto req = get_request_ctx(request);
+                InterlockedExchange64(&get_endpoint_ctx(req->endpoint)->throttled.blocked, 0); // new round
+                insert_descending(head, req);
+        }
+
+        request_ctx *prev{};
+        for (auto req = head; req; ) { // reverse
+                auto next = req->next;
+                req->next = prev;
+                prev = req;
+                req = next;
+        }
+
+        for (auto req = prev; req; ) {
+                auto next = req->next; // request_ctx is freed on completion
+                auto request = get_handle(req);
+
+                if (auto err = WdfRequestForwardToIoQueue(request, get_endpoint_ctx(req->endpoint)->queue)) {
+                        Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                        untrack(*req);
+                        UdecxUrbCompleteWithNtStatus(request, err);
+                }
+
+                req = next;
+        }
+}
+
+/*
+ * Held URBs and URBs that are resubmitted after connection loss are retried in order of arrival,
+ * so the resubmitted ones go first regardless of when they were appended, @see device.cpp, fail_or_resubmit.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::hold(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        track(endpoint, req);
+
+        if (auto err = WdfRequestForwardToIoQueue(request, dev.reserve.throttled)) {
+                Trace(TRACE_LEVEL_ERROR, "req %04x, WdfRequestForwardToIoQueue %!STATUS!", ptr04x(request), err);
+                untrack(req);
+                return err;
+        }
+
+        if (!dev.resuming) { // was resumed meanwhile
+                WdfWorkItemEnqueue(dev.reserve.retry);
+        }
+
+        return STATUS_PENDING;
+}
+
+/*
+ * Is set for the endpoint queues and device_ctx::reserve.throttled.
+ */
+_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI usbip::device::canceled_on_queue(_In_ WDFQUEUE, _In_ WDFREQUEST request)
+{
+        untrack(*get_request_ctx(request)); // endpoint was set if it is counted
+        complete(request, STATUS_CANCELLED);
+}
+
+/*
+ * @see EVT_UDECX_USB_ENDPOINT_PURGE
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::device::cancel_throttled(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint)
+{
+        auto queue = get_device_ctx(device)->reserve.throttled;
+
+        for (WDFREQUEST prev{}, found; ; ) {
+                auto st = WdfIoQueueFindRequest(queue, prev, WDF_NO_HANDLE, nullptr, &found);
+                if (prev) {
+                        WdfObjectDereference(prev);
+                        prev = WDF_NO_HANDLE;
+                }
+
+                if (st == STATUS_NOT_FOUND) { // prev was removed, start over
+                        continue;
+                } else if (st) { // STATUS_NO_MORE_ENTRIES
+                        break;
+                }
+
+                if (WDFREQUEST request; get_request_ctx(found)->endpoint == endpoint &&
+                    NT_SUCCESS(WdfIoQueueRetrieveFoundRequest(queue, found, &request))) {
+                        WdfObjectDereference(found);
+                        untrack(*get_request_ctx(request));
+                        complete(request, STATUS_CANCELLED);
+                } else {
+                        prev = found;
+                }
+        }
+}
+
+/*
+ * The queue and the scheduler are drained under the owner flag, so the taken PDUs can't be passed to WskSend.
+ * Their contexts are freed before the requests are returned, partial MDLs of transfer buffers do not outlive URBs.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+request_ctx* usbip::device::remove_unsent(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint)
+{
+        auto &q = dev.sendq;
+        auto slot = endpoint ? get_send_slot(get_endpoint_ctx(endpoint)->descriptor) : UCHAR(0);
+
+        auto pred = [endpoint, slot] (auto ctx) // CMD_UNLINK-s of the endpoint are kept, their requests were sent
+        {
+                return !endpoint || (ctx->request && ctx->send_slot == slot);
+        };
+
+        wsk_context *unsent{};
+        {
+                libdrv::RaiseIrql irql(DISPATCH_LEVEL); // see send_queued
+
+                q.queue.drain([&dev, &q, &unsent, &pred] (auto head)
+                {
+                        schedule(dev, head);
+                        unsent = q.sched.remove_if(pred);
+                        q.backlog = q.sched.size();
+                });
+        }
+
+        request_ctx *head{};
+        request_ctx *tail{};
+        ULONG cnt = 0;
+
+        for (auto ctx = unsent; ctx; ++cnt) {
+                auto next = ctx->next;
+
+                auto request = ctx->request;
+                auto seqnum = seqnum_t(RtlUlongByteSwap(ctx->hdr.base.seqnum)); // is in network byte order
+
+                InterlockedAdd64(&q.bytes, -LONG64(ctx->send_len));
+                free(ctx, false);
+
+                if (!request) {
+                        //
+                } else if (auto victim = remove_request(dev, request_search(request, seqnum))) {
+                        auto req = get_request_ctx(victim);
+                        req->next = nullptr;
+                        (tail ? tail->next : head) = req;
+                        tail = req;
+                }
+
+                ctx = next;
+        }
+
+        TraceDbg("dev %04x, endp %04x, %lu PDU(s) will not be sent", ptr04x(get_handle(&dev)), ptr04x(endpoint), cnt);
+
+        send_queued(dev); // PDUs that were pushed while the flag was held
+        return head;
+}
+
 /*
  * IRP_MJ_INTERNAL_DEVICE_CONTROL 
  */
@@ -622,13 +1299,22 @@ void NTAPI usbip::device::internal_control(
 
         auto endpoint = get_endpoint(queue);
         auto &endp = *get_endpoint_ctx(endpoint);
+        auto dev = get_device_ctx(endp.device);
+
+        auto &req = *get_request_ctx(request);
+        if (!req.order) { // URB that is forwarded back keeps it
+                req.order = InterlockedIncrement64(&dev->reserve.order);
+        }
         
-        if (auto dev = get_device_ctx(endp.device); dev->unplugged) {
+        if (dev->unplugged) {
+                untrack(req);
                 UdecxUrbComplete(request, USBD_STATUS_DEVICE_GONE);
-        } else if (auto st = usb_submit_urb(*dev, endpoint, endp, request); st != STATUS_PENDING) {
+        } else if (auto st = dev->resuming ? hold(*dev, endpoint, request) : usb_submit_urb(*dev, endpoint, endp, request);
+                   st != STATUS_PENDING) {
                 if (st) {
                         TraceDbg("%!STATUS!", st);
                 }
+                untrack(req);
                 UdecxUrbCompleteWithNtStatus(request, st);
         }
 }
@@ -10,13 +10,30 @@
 #include <wdfusb.h>
 #include <UdeCx.h>
 
+namespace usbip
+{
+        struct device_ctx;
+        struct request_ctx;
+}
+
 namespace usbip::device
 {
 
+/*
+ * The request must not be in egress state, its partial MDL can be used by WskSend until then.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void send_cmd_unlink_and_cancel(_In_ UDECXUSBDEVICE device, _In_ WDFREQUEST request);
 
+/*
+ * @param head list of requests, @see remove_requests
+ * @return number of cancelled requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG send_cmd_unlinks_and_cancel(_In_ UDECXUSBDEVICE device, _In_opt_ request_ctx *head);
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 USB_DEFAULT_PIPE_SETUP_PACKET make_set_configuration(_In_ UCHAR ConfigurationValue);
@@ -52,6 +69,37 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS reset_port(_In_ UDECXUSBDEVICE device, _In_opt_ WDFREQUEST request);
 
+_Function_class_(EVT_WDF_WORKITEM)
+_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
+void NTAPI retry_throttled(_In_ WDFWORKITEM WorkItem);
+
+/*
+ * URB waits in device_ctx::reserve.throttled until the session is resumed, @see device::async_resume.
+ * @return STATUS_PENDING if the URB is held
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS hold(_Inout_ device_ctx &dev, _In_ UDECXUSBENDPOINT endpoint, _In_ WDFREQUEST request);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void cancel_throttled(_In_ UDECXUSBDEVICE device, _In_ UDECXUSBENDPOINT endpoint);
+
+_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI canceled_on_queue(_In_ WDFQUEUE queue, _In_ WDFREQUEST request);
+
+/*
+ * Takes PDUs that are waiting for WskSend, they will not be sent.
+ * @param endpoint CMD_SUBMIT-s of this endpoint only, all PDUs if NULL
+ * @return list of the requests of the taken CMD_SUBMIT-s, @see remove_requests
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+request_ctx *remove_unsent(_Inout_ device_ctx &dev, _In_opt_ UDECXUSBENDPOINT endpoint = WDF_NO_HANDLE);
+
 _Function_class_(EVT_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -7,6 +7,7 @@
 #include "device_queue.tmh"
 
 #include "context.h"
+#include "driver.h"
 #include "device_ioctl.h"
 
 namespace
@@ -33,150 +34,219 @@ auto matches(_In_ request_ctx *req, _In_ const device::request_search &crit)
         return false;
 }
 
-_Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
+/*
+ * @see device::requests_exhausted
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void NTAPI canceled_on_queue(_In_ WDFQUEUE queue, _In_ WDFREQUEST request)
+inline auto throttle_size(_In_ const device_ctx &dev)
 {
-        auto dev = get_device(queue);
-        TraceDbg("dev %04x, request %04x", ptr04x(dev), ptr04x(request));
-
-        device::send_cmd_unlink_and_cancel(dev, request);
+        auto &t = *dev.requests;
+        return t.max_size() - t.capacity()/32;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto remove_egress_request_nolock(_Inout_ device_ctx &dev, _In_ const device::request_search &crit)
+auto remove_request_nolock(_Inout_ device_ctx &dev, _In_ const device::request_search &crit)
 {
-        WDFREQUEST handle{};
-        auto head = &dev.egress_requests;
-
-        for (auto entry = head->Flink; entry != head; entry = entry->Flink) {
-                if (auto req = CONTAINING_RECORD(entry, request_ctx, entry); matches(req, crit)) {
-                        RemoveEntryList(entry);
-                        InitializeListHead(entry);
-                        handle = get_handle(req);
-                        break;
+        auto &t = *dev.requests;
+        request_ctx *req{};
+
+        switch (crit.what) {
+        case crit.SEQNUM:
+                req = t.remove(crit.seqnum);
+                break;
+        case crit.REQUEST:
+                if (auto r = t.find(crit.request_seqnum); r && get_handle(r) == crit.request) {
+                        req = t.remove(crit.request_seqnum);
                 }
+                break;
+        case crit.ENDPOINT:
+        case crit.ANY:
+                req = t.remove_if([&crit] (auto r) { return matches(r, crit); });
         }
 
-        return handle;
+        if (req && t.size() + 1 == throttle_size(dev) && dev.reserve.throttled_cnt && !dev.unplugged) {
+                WdfWorkItemEnqueue(dev.reserve.retry); // throttled URBs can be sent now
+        }
+
+        return req;
+}
+
+/*
+ * If the request is not found, it was removed by remove_request and WdfRequestUnmarkCancelable 
+ * returned STATUS_CANCELLED. In such case the request must be completed here.
+ */
+_Function_class_(EVT_WDF_REQUEST_CANCEL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void NTAPI cancel_request(_In_ WDFREQUEST request)
+{
+        auto &req = *get_request_ctx(request);
+        auto device = get_endpoint_ctx(req.endpoint)->device;
+        auto &dev = *get_device_ctx(device);
+
+        request_ctx *victim;
+        {
+                wdf::Lock lck(dev.requests_lock);
+                victim = remove_request_nolock(dev, device::request_search(request, req.seqnum));
+        }
+
+        TraceDbg("dev %04x, req %04x, seqnum %u, found %d", ptr04x(device), ptr04x(request), req.seqnum, bool(victim));
+
+        if (victim) {
+                NT_ASSERT(victim == &req);
+                device::send_cmd_unlink_and_cancel(device, request);
+        } else {
+                complete(request, STATUS_CANCELLED);
+        }
 }
 
 } // namespace
 
 
-/*
- * @see device.cpp, create_endpoint_queue
- */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS usbip::device::create_queue(_In_ UDECXUSBDEVICE dev)
+PAGED NTSTATUS usbip::device::create_request_table(_Inout_ device_ctx &dev)
 {
         PAGED_CODE();
-        auto &ctx = *get_device_ctx(dev);
-
-        WDF_IO_QUEUE_CONFIG cfg;
-        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchManual);
-        cfg.PowerManaged = WdfFalse;
-        cfg.EvtIoCanceledOnQueue = canceled_on_queue;
-
-        WDF_OBJECT_ATTRIBUTES attr;
-        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, UDECXUSBDEVICE);
-//      attr.SynchronizationScope = WdfSynchronizationScopeQueue; // EvtIoCanceledOnQueue is used only
-        attr.ParentObject = dev;
-
-        attr.EvtCleanupCallback = [] (auto obj) 
-        { 
-                auto queue = static_cast<WDFQUEUE>(obj);
-                TraceDbg("dev %04x, queue %04x cleanup", ptr04x(get_device(queue)), ptr04x(queue)); 
-        };
+        NT_ASSERT(!dev.requests);
 
-        if (auto err = WdfIoQueueCreate(ctx.vhci, &cfg, &attr, &ctx.queue)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
-                return err;
+        dev.requests = (decltype(dev.requests))ExAllocatePoolZero(NonPagedPoolNx, sizeof(*dev.requests), pooltag);
+        if (!dev.requests) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(*dev.requests));
+                return STATUS_INSUFFICIENT_RESOURCES;
         }
 
-        get_device(ctx.queue) = dev;
-
-        TraceDbg("dev %04x, queue %04x", ptr04x(dev), ptr04x(ctx.queue));
         return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-WDFREQUEST usbip::device::dequeue_request(_In_ device_ctx &dev, _In_ const request_search &crit)
+void usbip::device::free_request_table(_Inout_ device_ctx &dev)
 {
-        NT_ASSERT(crit);
-
-        if (!dev.queue) {
-                return WDF_NO_HANDLE;
+        if (auto &t = dev.requests) {
+                NT_ASSERT(t->empty());
+                ExFreePoolWithTag(t, pooltag);
+                t = nullptr;
         }
+}
 
-        for (WDFREQUEST prev{}, cur; ; prev = cur) {
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::device::add_egress_request(_Inout_ device_ctx &dev, _Inout_ request_ctx &req)
+{
+        NT_ASSERT(!req.cancelable);
 
-                auto st = WdfIoQueueFindRequest(dev.queue, prev, WDF_NO_HANDLE, nullptr, &cur);
-                if (prev) {
-                        WdfObjectDereference(prev);
-                }
+        wdf::Lock lck(dev.requests_lock);
 
-                switch (st) {
-                case STATUS_SUCCESS:
-                        if (auto req = get_request_ctx(cur); matches(req, crit)) {
-                                st = WdfIoQueueRetrieveFoundRequest(dev.queue, cur, &prev);
-                                WdfObjectDereference(cur);
-
-                                switch (st) {
-                                case STATUS_SUCCESS:
-                                        return prev;
-                                case STATUS_NOT_FOUND: // cur was canceled and removed from queue
-                                        cur = WDF_NO_HANDLE; // restart the loop
-                                        break;
-                                default:
-                                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueRetrieveFoundRequest %!STATUS!", st);
-                                        return WDF_NO_HANDLE;
-                                }
-                        }
-                        break;
-                case STATUS_NOT_FOUND: // prev was canceled and removed from queue
-                        NT_ASSERT(!cur); // restart the loop
-                        break;
-                case STATUS_NO_MORE_ENTRIES: // not found
-                        return WDF_NO_HANDLE;
-                default:
-                        Trace(TRACE_LEVEL_ERROR, "WdfIoQueueFindRequest %!STATUS!", st);
-                        return WDF_NO_HANDLE;
-                }
+        auto &t = *dev.requests;
+        if (!t.insert(req.seqnum, &req)) {
+                return STATUS_INSUFFICIENT_RESOURCES;
         }
+
+        auto &s = dev.stats;
+        s.requests_max = max(s.requests_max, t.size());
+        s.requests_displaced = max(s.requests_displaced, t.displaced());
+
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void usbip::device::add_egress_request(_Inout_ device_ctx &dev, _Inout_ request_ctx &req)
+bool usbip::device::requests_exhausted(_In_ const device_ctx &dev)
 {
-        NT_ASSERT(IsListEmpty(&req.entry));
-
-        wdf::Lock lck(dev.egress_requests_lock);
-        AppendTailList(&dev.egress_requests, &req.entry);
+        return dev.requests->size() >= throttle_size(dev);
 }
 
+/*
+ * WdfRequestMarkCancelableEx does not call EvtRequestCancel if the request is already cancelled.
+ * Otherwise cancel_request will wait for the lock, so the request can't be completed twice.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-WDFREQUEST usbip::device::remove_egress_request(_Inout_ device_ctx &dev, _In_ const request_search &crit)
+NTSTATUS usbip::device::set_request_waiting(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ seqnum_t seqnum)
 {
-        wdf::Lock lck(dev.egress_requests_lock);
-        return remove_egress_request_nolock(dev, crit);
+        wdf::Lock lck(dev.requests_lock);
+
+        auto req = dev.requests->find(seqnum);
+        if (!(req && get_handle(req) == request)) {
+                return STATUS_NOT_FOUND;
+        }
+
+        if (req->cancelled) { // by remove_requests
+                dev.requests->remove(seqnum);
+                return STATUS_CANCELLED;
+        }
+
+        if (auto err = WdfRequestMarkCancelableEx(request, cancel_request)) {
+                NT_ASSERT(err == STATUS_CANCELLED);
+                dev.requests->remove(seqnum);
+                return err;
+        }
+
+        req->cancelable = true;
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS usbip::device::move_egress_request_to_queue(_Inout_ device_ctx &dev, _In_ const request_search &crit)
+WDFREQUEST usbip::device::remove_request(_Inout_ device_ctx &dev, _In_ const request_search &crit)
 {
-        wdf::Lock lck(dev.egress_requests_lock);
+        wdf::Lock lck(dev.requests_lock);
 
-        if (auto request = remove_egress_request_nolock(dev, crit)) {
-                return WdfRequestForwardToIoQueue(request, dev.queue);
+        while (auto req = remove_request_nolock(dev, crit)) {
+                auto request = get_handle(req);
+
+                if (!req->cancelable) {
+                        return request;
+                } else if (auto err = WdfRequestUnmarkCancelable(request); err != STATUS_CANCELLED) {
+                        NT_ASSERT(!err);
+                        req->cancelable = false;
+                        return request;
+                }
+                // cancel_request will complete it
         }
 
-        return STATUS_NOT_FOUND;
+        return WDF_NO_HANDLE;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+request_ctx *usbip::device::remove_requests(_Inout_ device_ctx &dev, _In_ const request_search &crit)
+{
+        request_ctx *head{};
+        request_ctx *tail{};
+
+        auto f = [&head, &tail] (auto req)
+        {
+                NT_ASSERT(req->cancelable);
+
+                if (auto err = WdfRequestUnmarkCancelable(get_handle(req)); err == STATUS_CANCELLED) {
+                        return; // cancel_request will complete it
+                } else {
+                        NT_ASSERT(!err);
+                        req->cancelable = false;
+                }
+
+                req->next = nullptr;
+                (tail ? tail->next : head) = req;
+                tail = req;
+        };
+
+        auto pred = [&crit] (auto req)
+        {
+                if (!matches(req, crit)) {
+                        return false;
+                } else if (!req->cancelable) { // egress
+                        req->cancelled = true;
+                        return false;
+                }
+                return true;
+        };
+
+        wdf::Lock lck(dev.requests_lock);
+        dev.requests->remove_all_if(pred, f);
+
+        return head;
 }
@@ -24,12 +24,16 @@ namespace usbip::device
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED NTSTATUS create_queue(_In_ UDECXUSBDEVICE dev);
+PAGED NTSTATUS create_request_table(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_request_table(_Inout_ device_ctx &dev);
 
 struct request_search
 {
         request_search() = default;
-        request_search(_In_ WDFREQUEST req) : request(req), what(REQUEST) {}
+        request_search(_In_ WDFREQUEST req, _In_ seqnum_t n) : request(req), what(REQUEST), request_seqnum(n) {}
         request_search(_In_ UDECXUSBENDPOINT endp) : endpoint(endp), what(ENDPOINT) {}
 
         request_search(_In_ seqnum_t n) : 
@@ -47,25 +51,56 @@ struct request_search
 
         enum what_t { ANY, REQUEST, ENDPOINT, SEQNUM };
         what_t what = ANY; // union's member selector
+
+        seqnum_t request_seqnum{}; // of REQUEST, its context is not accessed until the request is found
 };
 
 /*
- * @param queue device_ctx.queue 
+ * A request is in egress state until WskSend completion handler is called, it can't be cancelled.
+ * @return STATUS_INSUFFICIENT_RESOURCES if the table is full, URBs are throttled before, @see requests_exhausted
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-WDFREQUEST dequeue_request(_In_ device_ctx &dev, _In_ const request_search &crit);
+NTSTATUS add_egress_request(_Inout_ device_ctx &dev, _Inout_ request_ctx &req);
 
+/*
+ * URB is throttled instead of being sent if the table is nearly full, it is retried when the size drops.
+ * The size is read without the lock, the margin covers URBs that are being sent concurrently.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void add_egress_request(_Inout_ device_ctx &dev, _Inout_ request_ctx &req);
+bool requests_exhausted(_In_ const device_ctx &dev);
 
+/*
+ * Egress request becomes cancelable and is waiting for USBIP_RET_SUBMIT.
+ * The request can be already completed, its context is accessed only if it is found by seqnum.
+ * @return STATUS_NOT_FOUND if the request has already been removed,
+ *         STATUS_CANCELLED if the request has been cancelled or was skipped by remove_requests, 
+ *         it is removed and must be completed by the caller
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-WDFREQUEST remove_egress_request(_Inout_ device_ctx &dev, _In_ const request_search &crit);
+NTSTATUS set_request_waiting(_Inout_ device_ctx &dev, _In_ WDFREQUEST request, _In_ seqnum_t seqnum);
 
+/*
+ * Constant time for seqnum and request, linear for endpoint and any.
+ * @return request that must be completed by the caller, cancelled requests are skipped
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+WDFREQUEST remove_request(_Inout_ device_ctx &dev, _In_ const request_search &crit);
+
+/*
+ * Removes all matching requests in one pass over the table under one acquisition of the lock.
+ * Requests in egress state are left in the table, their CMD_SUBMIT-s can wait in device_ctx::sendq
+ * or WskSend can read their transfer buffers. They are marked as cancelled and completed by
+ * WskSend completion handler, @see set_request_waiting. Take unsent ones before, @see remove_unsent.
+ *
+ * @return list linked by request_ctx::next in the order of the table, the requests must be completed 
+ *         by the caller, cancelled requests are skipped
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS move_egress_request_to_queue(_Inout_ device_ctx &dev, _In_ const request_search &crit);
+request_ctx *remove_requests(_Inout_ device_ctx &dev, _In_ const request_search &crit);
 
 } // namespace usbip::device
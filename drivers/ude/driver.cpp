@@ -11,6 +11,8 @@
 #include "wsk_context.h"
 
 #include <libdrv\wsk_cpp.h>
+#include <libdrv\wdf_cpp.h>
+#include <libdrv\mdl_cpp.h>
 
 namespace
 {
@@ -30,6 +32,12 @@ PAGED void driver_cleanup(_In_ WDFOBJECT Object)
 	wsk::shutdown();
 	delete_wsk_context_list();
 
+	mdl_cache_stats s;
+	get_mdl_cache_stats(s);
+
+	Trace(TRACE_LEVEL_INFORMATION, "MDL cache: hits %I64d, misses %I64d, trimmed %I64d", s.hits, s.misses, s.trimmed);
+	delete_mdl_cache();
+
 	auto drvobj = WdfDriverWdmGetDriverObject(drv);
 	WPP_CLEANUP(drvobj);
 }
@@ -57,6 +65,11 @@ CS_INIT auto init()
 {
 	PAGED_CODE();
 
+	if (auto err = init_mdl_cache()) {
+		Trace(TRACE_LEVEL_CRITICAL, "init_mdl_cache %!STATUS!", err);
+		return err;
+	}
+
 	if (auto err = init_wsk_context_list(pooltag)) {
 		Trace(TRACE_LEVEL_CRITICAL, "ExInitializeLookasideListEx %!STATUS!", err);
 		return err;
@@ -73,6 +86,60 @@ CS_INIT auto init()
 } // namespace
 
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG usbip::get_parameter(_In_ const wchar_t *name, _In_ ULONG default_value)
+{
+	PAGED_CODE();
+
+	wdf::Registry key;
+
+	if (WDFKEY h;
+	    auto err = WdfDriverOpenParametersRegistryKey(WdfGetDriver(), KEY_QUERY_VALUE, WDF_NO_OBJECT_ATTRIBUTES, &h)) {
+		Trace(TRACE_LEVEL_ERROR, "WdfDriverOpenParametersRegistryKey %!STATUS!", err);
+		return default_value;
+	} else {
+		key.reset(h);
+	}
+
+	UNICODE_STRING value_name;
+	RtlUnicodeStringInit(&value_name, name);
+
+	ULONG value;
+	if (auto err = WdfRegistryQueryULong(key.get(), &value_name, &value)) {
+		TraceDbg("'%!USTR!' %!STATUS!, default %lu", &value_name, err, default_value);
+		return default_value;
+	}
+
+	TraceDbg("'%!USTR!' %lu", &value_name, value);
+	return value;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::create_system_thread(
+	_Out_ _KTHREAD* &thread, _In_ WDFDEVICE vhci, _In_ PKSTART_ROUTINE func, _In_opt_ void *ctx)
+{
+	PAGED_CODE();
+
+	thread = nullptr;
+	const auto access = THREAD_ALL_ACCESS;
+
+	HANDLE handle;
+	if (auto err = IoCreateSystemThread(WdfDeviceWdmGetDeviceObject(vhci), &handle, access, nullptr, nullptr, 
+					    nullptr, func, ctx)) {
+		Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
+		return err;
+	}
+
+	PVOID obj;
+	NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode, &obj, nullptr)));
+	NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+
+	thread = static_cast<_KTHREAD*>(obj);
+	return STATUS_SUCCESS;
+}
+
 _Function_class_(DRIVER_INITIALIZE)
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
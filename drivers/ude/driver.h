@@ -5,6 +5,8 @@
 #pragma once
 
 #include <libdrv/unique_ptr.h>
+#include <libdrv/codeseg.h>
+#include <libdrv/wdf_cpp.h>
 
 namespace usbip
 {
@@ -12,4 +14,20 @@ namespace usbip
 const ULONG pooltag = 'ICHV';
 using unique_ptr = libdrv::unique_ptr<pooltag>;
 
+/*
+ * @return REG_DWORD from driver's Parameters key or default_value if it is absent
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED ULONG get_parameter(_In_ const wchar_t *name, _In_ ULONG default_value);
+
+/*
+ * IoCreateSystemThread references the device object, the driver will not be unloaded while the thread runs.
+ * @param thread referenced object, call ObDereferenceObject
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS create_system_thread(
+	_Out_ _KTHREAD* &thread, _In_ WDFDEVICE vhci, _In_ PKSTART_ROUTINE func, _In_opt_ void *ctx);
+
 } // namespace usbip
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <intrin.h>
+
+/*
+ * Does not depend on WDK headers and can be compiled in user mode.
+ */
+namespace usbip
+{
+
+/*
+ * Lock-free queue of intrusive nodes for multiple producers and a single consumer.
+ *
+ * Producers push to LIFO stack with CAS. The consumer takes the whole stack with one exchange
+ * and reverses it, nodes are never popped one by one and ABA problem is impossible.
+ * The consumer is a producer that wins the owner flag, @see consume.
+ *
+ * The object must be zero-initialized.
+ */
+template<typename T, T* T::*Next>
+class mpsc_queue
+{
+public:
+        auto empty() const { return !m_head; }
+
+        void push(T *node)
+        {
+                for (auto head = m_head; ; ) {
+                        node->*Next = head;
+
+                        auto cur = static_cast<T*>(_InterlockedCompareExchangePointer(
+                                                        reinterpret_cast<void* volatile*>(&m_head), node, head));
+                        if (cur == head) {
+                                break;
+                        }
+                        head = cur;
+                }
+        }
+
+        /*
+         * If can() returns true, the caller becomes the owner and calls f(first) for nodes
+         * in the order of push, they are linked by Next; first is nullptr if the queue is empty.
+         * If another thread is the owner, returns immediately, the owner will process the nodes.
+         * can() must return false if there is nothing to do, f.e. the queue is empty.
+         *
+         * The owner checks can() again after releasing the flag, so a node pushed while
+         * the flag was held is not left behind. f can be called several times.
+         * can() must become true for the work that remains, f.e. from a completion routine.
+         */
+        template<typename Pred, typename F>
+        void consume(const Pred &can, const F &f)
+        {
+                while (can() && try_acquire()) {
+                        if (can()) {
+                                f(pop_all());
+                        }
+                        release();
+                }
+        }
+
+        /*
+         * Waits for the owner flag and calls f(first) regardless of can(), f.e. to take the nodes back.
+         * The owner must not be preempted by the caller on the same CPU, both run at DISPATCH_LEVEL.
+         * Nodes that are pushed while the flag is held are left in the queue, the caller must call consume.
+         */
+        template<typename F>
+        void drain(const F &f)
+        {
+                while (!try_acquire()) {
+                        _mm_pause();
+                }
+
+                f(pop_all());
+                release();
+        }
+
+private:
+        T *volatile m_head; // LIFO
+        volatile char m_owner;
+
+        auto try_acquire() { return !_InterlockedExchange8(&m_owner, 1); }
+        void release() { _InterlockedExchange8(&m_owner, 0); }
+
+        T* pop_all()
+        {
+                auto lifo = static_cast<T*>(_InterlockedExchangePointer(reinterpret_cast<void* volatile*>(&m_head), nullptr));
+                T *fifo{};
+
+                while (lifo) {
+                        auto next = lifo->*Next;
+                        lifo->*Next = fifo;
+                        fifo = lifo;
+                        lifo = next;
+                }
+
+                return fifo;
+        }
+};
+
+} // namespace usbip
@@ -8,8 +8,7 @@
 
 #include "urbtransfer.h"
 
-#include <usbip\proto.h>
-#include <usbip\proto_op.h>
+#include <usbip\codec.h>
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\usbd_helper.h>
@@ -24,6 +23,60 @@ constexpr auto make_priority( _In_ LOCK_OPERATION operation)
                 (operation == IoReadAccess ? MdlMappingNoWrite : 0UL);
 }
 
+/*
+ * Copy between buf and the part of the locked-down MDL that starts at offset.
+ * If the MDL is not mapped, the pages that are copied are mapped through a partial MDL on the stack
+ * and unmapped right after that, a window spans WINDOW_PAGES at most.
+ * 
+ * @param operation IoWriteAccess to write into the MDL, IoReadAccess to read from it
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS copy_mdl(_In_ MDL &m, _In_ ULONG offset, _Inout_updates_bytes_(len) char *buf, _In_ ULONG len, 
+        _In_ LOCK_OPERATION operation)
+{
+        NT_ASSERT(offset + len <= MmGetMdlByteCount(&m));
+
+        auto copy = [operation] (void *mapped, char *data, ULONG cnt)
+        {
+                if (operation == IoWriteAccess) {
+                        RtlCopyMemory(mapped, data, cnt);
+                } else {
+                        RtlCopyMemory(data, mapped, cnt);
+                }
+        };
+
+        if (m.MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL)) {
+                copy(static_cast<char*>(m.MappedSystemVa) + offset, buf, len);
+                return STATUS_SUCCESS;
+        }
+
+        enum { WINDOW_PAGES = 16 };
+        alignas(MDL) UCHAR storage[sizeof(MDL) + WINDOW_PAGES*sizeof(PFN_NUMBER)];
+        auto window = reinterpret_cast<MDL*>(storage);
+
+        for (auto va = static_cast<char*>(MmGetMdlVirtualAddress(&m)) + offset; len; ) {
+                auto cnt = min(len, ULONG(WINDOW_PAGES*PAGE_SIZE - BYTE_OFFSET(va)));
+
+                MmInitializeMdl(window, va, cnt);
+                IoBuildPartialMdl(&m, window, va, cnt);
+
+                auto mapped = MmGetSystemAddressForMdlSafe(window, make_priority(operation));
+                if (!mapped) {
+                        Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe error");
+                        return STATUS_INSUFFICIENT_RESOURCES;
+                }
+
+                copy(mapped, buf, cnt);
+                MmPrepareMdlForReuse(window); // unmap
+
+                va += cnt;
+                buf += cnt;
+                len -= cnt;
+        }
+
+        return STATUS_SUCCESS;
+}
+
 } // namespace
 
 
@@ -67,7 +120,7 @@ PAGED USBIP_STATUS usbip::recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expec
                 Trace(TRACE_LEVEL_ERROR, "Receive %!STATUS!", err);
                 return USBIP_ERROR_NETWORK;
         }
-	PACK_OP_COMMON(false, &r);
+        wire::byteswap(r);
 
 	if (r.version != USBIP_VERSION) {
 		Trace(TRACE_LEVEL_ERROR, "version(%#x) != expected(%#x)", r.version, USBIP_VERSION);
@@ -90,7 +143,7 @@ PAGED USBIP_STATUS usbip::recv_op_common(_Inout_ SOCKET *sock, _In_ UINT16 expec
  * URB must have TransferBuffer* members.
  * TransferBuffer && TransferBufferMDL can be both not NULL for bulk/int at least.
  * 
- * TransferBufferMDL can be a chain and have size greater than mdl_size. 
+ * TransferBufferMDL can be a chain and have size greater than mdl_size, it is not mapped. 
  * TransferBufferMDL is not used directly because of BSODs in random third-party drivers during "usbip detach".
  * It happens rarely, but ~1500 attach/detach loops is used to enough to get it.
  * Symptoms: read memory address 0x0000'0000'0000'0008.
@@ -119,39 +172,110 @@ NTSTATUS usbip::make_transfer_buffer_mdl(
                 return STATUS_SUCCESS;
         }
 
-        void *buf{};
-        bool probe_and_lock;
-
         if (auto head = r.TransferBufferMDL) { // preferable case because it is locked-down, can be a chain
 
                 if (auto len = size(head); len < r.TransferBufferLength) { // must describe full buffer
                         return STATUS_BUFFER_TOO_SMALL;
-                } else if (!head->Next) { // source MDL is not a chain
-                        mdl = Mdl(head, 0, mdl_size);
-                        return mdl ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
-                } else if (buf = MmGetSystemAddressForMdlSafe(head, make_priority(operation)); !buf) {
-                        return STATUS_INSUFFICIENT_RESOURCES;        
-                } else { // IoBuildPartialMdl doesn't treat SourceMdl as a chain and can't be used
-                        probe_and_lock = false;
                 }
 
-        } else if (buf = r.TransferBuffer; buf) { // could be allocated from paged pool
-                probe_and_lock = true; // false -> DRIVER_VERIFIER_DETECTED_VIOLATION
-        } else {
+                mdl = Mdl(head, 0, mdl_size); // a chain of partial MDLs if the source is a chain
+                return mdl ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        auto buf = r.TransferBuffer; // could be allocated from paged pool
+        if (!buf) {
                 Trace(TRACE_LEVEL_ERROR, "TransferBuffer and TransferBufferMDL are NULL");
                 return STATUS_INVALID_PARAMETER;
         }
 
-        NT_ASSERT(buf);
         mdl = Mdl(buf, mdl_size);
 
-        auto st = probe_and_lock ? mdl.prepare_paged(operation) : mdl.prepare_nonpaged();
+        auto st = mdl.prepare_paged(operation); // prepare_nonpaged -> DRIVER_VERIFIER_DETECTED_VIOLATION
         if (st) {
                 mdl.reset();
         }
         return st;
 }
 
+/*
+ * Copy OUT data of URB, it is used for small payloads instead of make_transfer_buffer_mdl.
+ * TransferBufferMDL is not used directly, @see make_transfer_buffer_mdl, the data is copied through 
+ * its partial MDL that is built into mdl and freed after that. Only the pages that are read are mapped.
+ * TransferBuffer could be allocated from paged pool, it is not touched at DISPATCH_LEVEL.
+ * 
+ * @param mdl must be empty, is empty on return
+ * @return false if the data can't be copied at current IRQL, make_transfer_buffer_mdl must be used
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool usbip::copy_transfer_buffer(
+        _Out_writes_bytes_(len) void *dest, _In_ ULONG len, _Inout_ Mdl &mdl, _In_ const URB &urb)
+{
+        NT_ASSERT(!mdl);
+
+        auto &r = AsUrbTransfer(urb);
+        if (len > r.TransferBufferLength) {
+                return false;
+        }
+
+        if (r.TransferBufferMDL) {
+                if (make_transfer_buffer_mdl(mdl, len, IoReadAccess, urb)) {
+                        return false;
+                }
+
+                auto d = static_cast<char*>(dest);
+                NTSTATUS st{};
+
+                for (auto m = mdl.get(); m && !st; m = m->Next) { // the chain describes len bytes exactly
+                        auto cnt = MmGetMdlByteCount(m);
+                        st = copy_mdl(*m, 0, d, cnt, IoReadAccess);
+                        d += cnt;
+                }
+
+                mdl.reset();
+                return !st;
+        } else if (auto src = r.TransferBuffer; src && KeGetCurrentIrql() <= APC_LEVEL) {
+                RtlCopyMemory(dest, src, len);
+                return true;
+        }
+
+        return false;
+}
+
+/*
+ * Copy IN data of URB into the chain that is made by make_transfer_buffer_mdl.
+ * The pages are locked-down, but the chain is not mapped, so a large transfer buffer
+ * that is received directly does not take system PTEs, @see wsk_receive.cpp, recv_payload.
+ * Only the pages that are written are mapped, @see copy_mdl.
+ * 
+ * @param offset in the data that is described by the chain
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::copy_to_mdl_chain(
+        _In_ MDL *head, _In_ size_t offset, _In_reads_bytes_(len) const void *src, _In_ size_t len)
+{
+        auto s = static_cast<const char*>(src);
+
+        for (auto m = head; m && len; m = m->Next) {
+                auto sz = MmGetMdlByteCount(m);
+                if (offset >= sz) {
+                        offset -= sz;
+                        continue;
+                }
+
+                auto cnt = min(sz - offset, len);
+                if (auto err = copy_mdl(*m, ULONG(offset), const_cast<char*>(s), ULONG(cnt), IoWriteAccess)) {
+                        return err;
+                }
+
+                s += cnt;
+                len -= cnt;
+                offset = 0;
+        }
+
+        NT_ASSERT(!len);
+        return STATUS_SUCCESS;
+}
+
 /*
  * wsk::close() does not free SOCKET and wsk:free() is not called here.
  * Retaining SOCKET alive solves the issue with possible send/receive calls after closing.
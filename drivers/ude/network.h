@@ -40,15 +40,23 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS make_transfer_buffer_mdl(
 	_Inout_ Mdl &mdl, _In_ ULONG mdl_size, _In_ LOCK_OPERATION operation, _In_ const _URB &urb);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+bool copy_transfer_buffer(_Out_writes_bytes_(len) void *dest, _In_ ULONG len, _Inout_ Mdl &mdl, _In_ const _URB &urb);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS copy_to_mdl_chain(_In_ MDL *head, _In_ size_t offset, _In_reads_bytes_(len) const void *src, _In_ size_t len);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 inline auto verify(_In_ const WSK_BUF &buf, _In_ bool exact)
 {
-	if (buf.Offset || !buf.Length) {
+	if (!(buf.Length && buf.Mdl && buf.Offset < MmGetMdlByteCount(buf.Mdl))) { // Offset is in the first MDL
 		return false;
 	}
 
 	auto sz = size(buf.Mdl);
-	return exact ? buf.Length == sz : buf.Length <= sz;
+	auto len = buf.Offset + buf.Length;
+
+	return exact ? len == sz : len <= sz;
 }
 
 } // namespace usbip
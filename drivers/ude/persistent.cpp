@@ -7,6 +7,8 @@
 #include "persistent.tmh"
 
 #include "context.h"
+#include "driver.h"
+#include "vhci_ioctl.h"
 
 #include <libdrv\strconv.h>
 #include <libdrv\wait_timeout.h>
@@ -81,61 +83,34 @@ PAGED auto parse_string(_Out_ vhci::ioctl::plugin_hardware &r, _In_ const UNICOD
                     r.busid, sizeof(r.busid), busid);
 }
 
+enum {
+        WORKERS_MAX = 16,
+        WORKERS_DEFAULT = 8, // @see persistent_workers_value_name
+        HOST_WORKERS_DEFAULT = 4 // @see persistent_host_workers_value_name
+};
+
 /*
- * Target is self. 
+ * Each device has its own retry timer and is attached by its own system thread,
+ * so a slow or unreachable server does not delay devices from other servers.
  */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto make_target(_In_ WDFDEVICE vhci)
+struct persistent_device
 {
-        PAGED_CODE();
-        wdf::ObjectDelete target;
+        vhci::ioctl::plugin_hardware req;
+        UNICODE_STRING line; // points to WDFSTRING of the collection
+        WDFDEVICE vhci;
 
-        if (WDFIOTARGET t; auto err = WdfIoTargetCreate(vhci, WDF_NO_OBJECT_ATTRIBUTES, &t)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetCreate %!STATUS!", err);
-                return target;
-        } else {
-                target.reset(t);
-        }
-
-        auto fdo = WdfDeviceWdmGetDeviceObject(vhci);
+        _KTHREAD *thread; // is attaching the device
+        NTSTATUS status; // of the last attempt
 
-        WDF_IO_TARGET_OPEN_PARAMS params;
-        WDF_IO_TARGET_OPEN_PARAMS_INIT_EXISTING_DEVICE(&params, fdo);
-
-        if (auto err = WdfIoTargetOpen(target.get<WDFIOTARGET>(), &params)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetOpen %!STATUS!", err);
-                target.reset();
-        }
+        ULONGLONG due; // KeQueryInterruptTime of the next attempt
+        ULONG attempt; // failed ones
+        bool done;
+};
 
-        return target;
-}
-
-constexpr auto get_delay(_In_ ULONG attempt, _In_ ULONG cnt)
+constexpr auto get_delay(_In_ ULONG attempt)
 {
-        NT_ASSERT(cnt);
         enum { UNIT = 10, MAX_DELAY = 30*60 }; // seconds
-        return attempt > 1 ? min(UNIT*attempt/cnt, MAX_DELAY) : 0; // first two attempts without a delay
-}
-
-_IRQL_requires_same_
-_IRQL_requires_max_(APC_LEVEL)
-PAGED auto sleep(_Inout_ vhci_ctx &ctx, _In_ ULONG seconds)
-{
-        PAGED_CODE();
-        auto timeout = make_timeout(seconds*wdm::second, wdm::period::relative);
-
-        switch (auto st = KeWaitForSingleObject(&ctx.attach_thread_stop, Executive, KernelMode, false, &timeout)) {
-        case STATUS_SUCCESS:
-                TraceDbg("thread stop requested");
-                return false;
-        case STATUS_TIMEOUT:
-                break;
-        default:
-                Trace(TRACE_LEVEL_ERROR, "KeWaitForSingleObject %!STATUS!", st);
-        }
-
-        return true;
+        return attempt > 1 ? min(UNIT*attempt, MAX_DELAY) : 0; // first two attempts without a delay
 }
 
 /*
@@ -154,40 +129,6 @@ constexpr auto can_retry(_In_ NTSTATUS status)
         return false;
 }
 
-/*
- * @return true - do not try to connect to this device again
- */
-_IRQL_requires_same_
-_IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto plugin_hardware(
-        _In_ const UNICODE_STRING &line, 
-        _In_ WDFIOTARGET target,
-        _Inout_ vhci::ioctl::plugin_hardware &req,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &input,
-        _Inout_ WDF_MEMORY_DESCRIPTOR &output,
-        [[maybe_unused]] _In_ const ULONG outlen)
-{
-        PAGED_CODE();
-
-        if (auto err = parse_string(req, line)) {
-                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &line, err);
-                return true; // remove malformed string
-        }
-
-        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", req.host, req.service, req.busid);
-        req.port = 0;
-
-        if (ULONG_PTR BytesReturned; // send IOCTL to itself
-            auto err = WdfIoTargetSendIoctlSynchronously(target, WDF_NO_HANDLE, vhci::ioctl::PLUGIN_HARDWARE, 
-                                                         &input, &output, nullptr, &BytesReturned)) {
-                Trace(TRACE_LEVEL_ERROR, "WdfIoTargetSendIoctlSynchronously %!STATUS!", err);
-                return !can_retry(err);
-        } else {
-                NT_ASSERT(BytesReturned == outlen);
-                return true;
-        }
-}
-
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto open_parameters_key()
@@ -227,48 +168,193 @@ PAGED auto contains(_In_ WDFCOLLECTION col, _In_ const UNICODE_STRING &str)
 }
 
 /*
- * Remove from collection A items absent in collection B.
+ * Rereading allows to remove devices that constantly fail to attach.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED void intersection(_In_ WDFCOLLECTION a, _In_ WDFCOLLECTION b)
+PAGED auto removed(_In_ WDFKEY key, _In_ const UNICODE_STRING &line)
 {
         PAGED_CODE();
 
-        for (ULONG i = 0, cnt = WdfCollectionGetCount(a); i < cnt; ) {
-                auto item = (WDFSTRING)WdfCollectionGetItem(a, i);
+        auto col = get_persistent_devices(key);
+        return !(col && contains(col.get<WDFCOLLECTION>(), line));
+}
 
-                UNICODE_STRING s{};
-                WdfStringGetUnicodeString(item, &s);
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void attach_device_thread(_In_ void *ctx)
+{
+        PAGED_CODE();
+        KeSetPriorityThread(KeGetCurrentThread(), LOW_PRIORITY + 1);
+
+        auto &d = *static_cast<persistent_device*>(ctx);
+
+        d.req.port = 0;
+        d.status = vhci::attach(d.vhci, d.req);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void retry_later(_Inout_ persistent_device &d)
+{
+        PAGED_CODE();
+
+        auto secs = get_delay(++d.attempt);
+        d.due = KeQueryInterruptTime() + secs*wdm::second;
+
+        TraceDbg("'%!USTR!' attempt #%lu in %lu sec.", &d.line, d.attempt, secs);
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto start(_Inout_ persistent_device &d, _In_ WDFKEY key)
+{
+        PAGED_CODE();
+
+        if (d.attempt && removed(key, d.line)) {
+                TraceDbg("exclude %!USTR!", &d.line);
+                d.done = true;
+                return false;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%s:%s/%s", d.req.host, d.req.service, d.req.busid);
+
+        if (auto err = create_system_thread(d.thread, d.vhci, attach_device_thread, &d)) {
+                retry_later(d);
+                return false;
+        }
 
-                if (contains(b, s)) {
-                        ++i;
+        return true;
+}
+
+/*
+ * The thread has exited.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED void join(_Inout_ vhci_ctx &ctx, _Inout_ persistent_device &d)
+{
+        PAGED_CODE();
+
+        ObDereferenceObject(d.thread);
+        d.thread = nullptr;
+
+        ++ctx.restore.attempts;
+
+        if (NT_SUCCESS(d.status)) {
+                TraceDbg("'%!USTR!' port %d", &d.line, d.req.port);
+                ++ctx.restore.attached;
+                d.done = true;
+        } else {
+                Trace(TRACE_LEVEL_ERROR, "'%!USTR!' %!STATUS!", &d.line, d.status);
+
+                if (can_retry(d.status)) {
+                        retry_later(d);
                 } else {
-                        TraceDbg("exclude %!USTR!", &s);
-                        WdfCollectionRemoveItem(a, i);
-                        --cnt;
+                        d.done = true;
                 }
         }
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(APC_LEVEL)
+PAGED auto host_workers(_In_ const persistent_device *v, _In_ ULONG cnt, _In_ const char *host)
+{
+        PAGED_CODE();
+        ULONG n = 0;
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                n += v[i].thread && !_stricmp(v[i].req.host, host);
+        }
+
+        return n;
+}
+
 /*
- * Refreshing allows to remove devices that constantly fail to attach.
+ * Starts the threads for devices which time has come, while workers and host_workers limits allow,
+ * and waits for any of them to exit or for the next timer.
  */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED ULONG get_count(_In_ WDFCOLLECTION col, _In_ WDFKEY key, _In_ bool refresh)
+PAGED void attach_devices(_Inout_ vhci_ctx &ctx, _Inout_ persistent_device *v, _In_ ULONG cnt, _In_ WDFKEY key)
 {
         PAGED_CODE();
 
-        if (!refresh) {
-                //
-        } else if (auto newcol = get_persistent_devices(key)) {
-                intersection(col, newcol.get<WDFCOLLECTION>());
-        } else {
-                return 0;
-        }
+        ULONG workers = get_parameter(persistent_workers_value_name, WORKERS_DEFAULT);
+        workers = min(max(workers, 1UL), ULONG(WORKERS_MAX));
+
+        ULONG host_max = get_parameter(persistent_host_workers_value_name, HOST_WORKERS_DEFAULT);
+        host_max = max(host_max, 1UL);
 
-        return min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        TraceDbg("%lu device(s), workers %lu, host workers %lu", cnt, workers, host_max);
+        auto zero = make_timeout(0, wdm::period::relative);
+
+        for (auto stop = false; ; ) {
+
+                persistent_device *running[WORKERS_MAX];
+                ULONG n = 0;
+
+                auto now = KeQueryInterruptTime();
+                auto due = ~0ULL; // of the nearest timer
+
+                for (ULONG i = 0; i < cnt; ++i) {
+                        if (auto &d = v[i]; d.thread) {
+                                running[n++] = &d;
+                        }
+                }
+
+                for (ULONG i = 0; i < cnt && !stop; ++i) {
+                        if (auto &d = v[i]; d.done || d.thread) {
+                                //
+                        } else if (d.due > now) {
+                                due = min(due, d.due);
+                        } else if (n < workers && host_workers(v, cnt, d.req.host) < host_max) {
+                                if (start(d, key)) {
+                                        running[n++] = &d;
+                                } else if (!d.done) {
+                                        due = min(due, d.due);
+                                }
+                        }
+                }
+
+                if (!n && (stop || due == ~0ULL)) {
+                        break;
+                }
+
+                void *objects[WORKERS_MAX + 1];
+                ULONG obj_cnt = 0;
+
+                if (!stop) { // NotificationEvent, remains signaled
+                        objects[obj_cnt++] = &ctx.attach_thread_stop;
+                }
+
+                for (ULONG i = 0; i < n; ++i) {
+                        objects[obj_cnt++] = running[i]->thread;
+                }
+
+                KWAIT_BLOCK blocks[ARRAYSIZE(objects)];
+                auto timeout = make_timeout(due - now, wdm::period::relative);
+
+                auto st = KeWaitForMultipleObjects(obj_cnt, objects, WaitAny, Executive, KernelMode, false,
+                                                   stop || due == ~0ULL ? nullptr : &timeout, blocks);
+
+                if (st == STATUS_TIMEOUT) {
+                        continue;
+                } else if (!stop && st == STATUS_WAIT_0) {
+                        TraceDbg("thread stop requested, wait for %lu attach(es)", n);
+                        stop = true;
+                        continue;
+                } else if (!(st >= STATUS_WAIT_0 && st < STATUS_WAIT_0 + obj_cnt)) {
+                        Trace(TRACE_LEVEL_ERROR, "KeWaitForMultipleObjects %!STATUS!", st);
+                }
+
+                for (ULONG i = 0; i < n; ++i) { // several threads can exit at once
+                        if (auto &d = *running[i];
+                            KeWaitForSingleObject(d.thread, Executive, KernelMode, false, &zero) == STATUS_SUCCESS) {
+                                join(ctx, d);
+                        }
+                }
+        }
 }
 
 _IRQL_requires_same_
@@ -283,56 +369,54 @@ PAGED void plugin_persistent_devices(_In_ vhci_ctx &ctx)
         }
 
         auto devices = get_persistent_devices(key.get());
-        if (!(devices && WdfCollectionGetCount(devices.get<WDFCOLLECTION>()))) {
+        if (!devices) {
                 return;
         }
 
-        auto vhci = get_handle(&ctx);
+        auto col = devices.get<WDFCOLLECTION>();
 
-        auto target = make_target(vhci);
-        if (!target) {
+        ULONG cnt = min(WdfCollectionGetCount(col), ARRAYSIZE(vhci_ctx::devices));
+        if (!cnt) {
                 return;
         }
 
-        vhci::ioctl::plugin_hardware req{{ .size = sizeof(req) }};
+        auto started = KeQueryInterruptTime();
 
-        WDF_MEMORY_DESCRIPTOR input;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&input, &req, sizeof(req));
-
-        constexpr auto outlen = offsetof(vhci::ioctl::plugin_hardware, port) + sizeof(req.port);
-
-        WDF_MEMORY_DESCRIPTOR output;
-        WDF_MEMORY_DESCRIPTOR_INIT_BUFFER(&output, &req, outlen);
+        auto v = (persistent_device*)ExAllocatePoolZero(PagedPool, cnt*sizeof(*v), pooltag);
+        if (!v) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", cnt*sizeof(*v));
+                return;
+        }
 
-        for (ULONG attempt = 0; true; ++attempt) {
+        ULONG n = 0;
 
-                auto cnt = get_count(devices.get<WDFCOLLECTION>(), key.get(), attempt);
-                if (!cnt) {
-                        break;
-                }
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &d = v[n];
 
-                if (auto secs = get_delay(attempt, cnt)) {
-                        TraceDbg("attempt #%lu, %lu device(s), sleep %lu sec.", attempt, cnt, secs);
-                        if (!sleep(ctx, secs)) {
-                                break;
-                        }
+                if (auto s = (WDFSTRING)WdfCollectionGetItem(col, i)) {
+                        WdfStringGetUnicodeString(s, &d.line);
                 }
 
-                for (ULONG i = 0; i < cnt && sleep(ctx, 0); ) {
-                        UNICODE_STRING str{};
-                        if (auto s = (WDFSTRING)WdfCollectionGetItem(devices.get<WDFCOLLECTION>(), i)) {
-                                WdfStringGetUnicodeString(s, &str);
-                        }
+                d.req.size = sizeof(d.req);
 
-                        if (plugin_hardware(str, target.get<WDFIOTARGET>(), req, input, output, outlen)) {
-                                TraceDbg("exclude %!USTR!", &str);
-                                WdfCollectionRemoveItem(devices.get<WDFCOLLECTION>(), i);
-                                --cnt;
-                        } else {
-                                ++i;
-                        }
+                if (auto err = parse_string(d.req, d.line)) {
+                        Trace(TRACE_LEVEL_ERROR, "'%!USTR!' parse %!STATUS!", &d.line, err);
+                        RtlZeroMemory(&d, sizeof(d));
+                        continue; // skip malformed string
                 }
+
+                d.vhci = get_handle(&ctx);
+                ++n;
         }
+
+        ctx.restore.devices = n;
+        attach_devices(ctx, v, n, key.get());
+
+        ExFreePoolWithTag(v, pooltag);
+        ctx.restore.time = KeQueryInterruptTime() - started;
+
+        Trace(TRACE_LEVEL_INFORMATION, "%lu of %lu device(s) attached, %lu attempt(s), restore took %I64u ms",
+                ctx.restore.attached, n, ctx.restore.attempts, ctx.restore.time/wdm::msec);
 }
 
 /*
@@ -367,19 +451,7 @@ PAGED void usbip::plugin_persistent_devices(_In_ vhci_ctx *vhci)
 {
         PAGED_CODE();
 
-        const auto access = THREAD_ALL_ACCESS;
-        auto fdo = WdfDeviceWdmGetDeviceObject(get_handle(vhci));
-
-        if (HANDLE handle; 
-            auto err = IoCreateSystemThread(fdo, &handle, access, nullptr, nullptr, 
-                                            nullptr, persistent_devices_thread, vhci)) {
-                Trace(TRACE_LEVEL_ERROR, "IoCreateSystemThread %!STATUS!", err);
-        } else {
-                PVOID thread;
-                NT_VERIFY(NT_SUCCESS(ObReferenceObjectByHandle(handle, access, *PsThreadType, KernelMode, 
-                                                               &thread, nullptr)));
-
-                NT_VERIFY(NT_SUCCESS(ZwClose(handle)));
+        if (_KTHREAD *thread; !create_system_thread(thread, get_handle(vhci), persistent_devices_thread, vhci)) {
                 NT_VERIFY(!InterlockedExchangePointer(reinterpret_cast<PVOID*>(&vhci->attach_thread), thread));
                 TraceDbg("thread launched");
         }
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Does not depend on WDK headers and can be compiled in user mode.
+ */
+namespace usbip
+{
+
+/*
+ * Open addressing hash table with linear probing for requests that are in flight.
+ *
+ * Seqnums are issued sequentially, @see next_seqnum. The slot of a key is its counter without
+ * direction bit, @see extract_num. Consecutive seqnums occupy consecutive slots, collisions are possible
+ * only if a request outlives capacity() subsequent seqnums, f.e. pending interrupt IN.
+ * Backward shift deletion is used, there are no tombstones and probe sequences do not degrade over time.
+ *
+ * Zero key marks a free slot, @see is_valid_seqnum.
+ * The object must be zero-initialized, the caller is responsible for serialization.
+ */
+template<typename Key, typename T, unsigned int N>
+class request_table
+{
+public:
+        static_assert(N && !(N & (N - 1)), "N must be a power of two");
+
+        static constexpr auto capacity() { return N; }
+        static constexpr auto max_size() { return N - N/4; } // load factor limit
+
+        auto size() const { return m_size; }
+        auto empty() const { return !m_size; }
+
+        auto displaced() const { return m_displaced; } // elements that are not in their home slot
+
+        /*
+         * @return false if the table is full, key is zero or already present
+         */
+        bool insert(Key key, T *value)
+        {
+                if (!key || m_size == max_size()) {
+                        return false;
+                }
+
+                auto i = home(key);
+                for ( ; m_slots[i].key; i = next(i)) {
+                        if (m_slots[i].key == key) {
+                                return false;
+                        }
+                }
+
+                m_slots[i] = { key, value };
+                m_displaced += i != home(key);
+                ++m_size;
+                return true;
+        }
+
+        T* find(Key key) const
+        {
+                auto i = lookup(key);
+                return i < N ? m_slots[i].value : nullptr;
+        }
+
+        T* remove(Key key)
+        {
+                auto i = lookup(key);
+                return i < N ? erase(i) : nullptr;
+        }
+
+        /*
+         * Removes the first element for which pred(T*) returns true.
+         * Has linear complexity, use for purge and cleanup only.
+         */
+        template<typename Pred>
+        T* remove_if(const Pred &pred)
+        {
+                for (unsigned int i = 0; m_size && i < N; ++i) {
+                        if (auto &s = m_slots[i]; s.key && pred(s.value)) {
+                                return erase(i);
+                        }
+                }
+
+                return nullptr;
+        }
+
+        /*
+         * Removes all elements for which pred(T*) returns true in one pass, f(T*) is called for each of them.
+         * Backward shift can move an element into the freed slot, so the slot is checked again.
+         * Elements that were checked can be moved forward on wraparound and are checked twice.
+         * @return number of removed elements
+         */
+        template<typename Pred, typename F>
+        unsigned int remove_all_if(const Pred &pred, const F &f)
+        {
+                unsigned int cnt = 0;
+
+                for (unsigned int i = 0; m_size && i < N; ) {
+                        if (auto &s = m_slots[i]; s.key && pred(s.value)) {
+                                f(erase(i));
+                                ++cnt;
+                        } else {
+                                ++i;
+                        }
+                }
+
+                return cnt;
+        }
+
+private:
+        struct slot
+        {
+                Key key;
+                T *value;
+        };
+
+        slot m_slots[N];
+        unsigned int m_size;
+        unsigned int m_displaced; // elements that are not in their home slot
+
+        static auto next(unsigned int i) { return (i + 1) & (N - 1); }
+        static auto home(Key key) { return static_cast<unsigned int>(key >> 1) & (N - 1); }
+
+        /*
+         * @return N if not found
+         */
+        auto lookup(Key key) const
+        {
+                if (key) {
+                        for (auto i = home(key); m_slots[i].key; i = next(i)) {
+                                if (m_slots[i].key == key) {
+                                        return i;
+                                }
+                        }
+                }
+
+                return N;
+        }
+
+        /*
+         * Shift back the elements of the cluster that follows the freed slot
+         * unless their home slot is cyclically in (hole, j].
+         *
+         * Only displaced elements can be shifted, the scan stops when all of them are seen.
+         * Requests in flight form one cluster of consecutive seqnums that are usually in their
+         * home slots, so the cluster is not scanned to its end on each removal.
+         */
+        T* erase(unsigned int hole)
+        {
+                auto value = m_slots[hole].value;
+                m_displaced -= hole != home(m_slots[hole].key);
+
+                for (auto j = next(hole), unseen = m_displaced; unseen && m_slots[j].key; j = next(j)) {
+                        auto k = home(m_slots[j].key);
+
+                        if (k == j) {
+                                continue;
+                        }
+
+                        --unseen;
+
+                        if (hole <= j ? hole < k && k <= j : hole < k || k <= j) {
+                                continue;
+                        }
+
+                        m_slots[hole] = m_slots[j];
+                        m_displaced -= hole == k;
+                        hole = j;
+                }
+
+                m_slots[hole] = {};
+                --m_size;
+
+                return value;
+        }
+};
+
+} // namespace usbip
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * Does not depend on WDK headers and can be compiled in user mode.
+ */
+namespace usbip
+{
+
+/*
+ * Every slot (endpoint) has its own FIFO. Classes have strict priority, lesser class is served first.
+ * Slots of the same class share the bandwidth by deficit round-robin,
+ * the quantum of a slot is the number of bytes it may send per round.
+ *
+ * T must have members: T *next, send_len, send_slot, send_class, send_quantum.
+ * The slot takes the class and the quantum of the node that is pushed into its empty FIFO.
+ *
+ * The object must be zero-initialized, the caller is responsible for serialization.
+ */
+template<typename T, unsigned int Slots, unsigned int Classes>
+class send_scheduler
+{
+public:
+        auto size() const { return m_size; }
+        auto empty() const { return !m_size; }
+
+        void push(T *node)
+        {
+                auto &s = m_slots[node->send_slot];
+                node->next = nullptr;
+
+                if (s.tail) {
+                        s.tail->next = node;
+                } else {
+                        s.head = node;
+                        s.cls = node->send_class;
+                        s.quantum = node->send_quantum ? node->send_quantum : 1;
+                }
+
+                s.tail = node;
+                ++m_size;
+        }
+
+        /*
+         * @return nullptr if empty
+         */
+        T* pop()
+        {
+                for (unsigned int cls = 0; m_size && cls < Classes; ++cls) {
+                        if (auto node = pop(cls)) {
+                                return node;
+                        }
+                }
+
+                return nullptr;
+        }
+
+        /*
+         * Removes the nodes for which pred(node) is true, the order of the rest is kept.
+         * @return removed nodes linked by next, FIFO of each slot in turn
+         */
+        template<typename Pred>
+        T* remove_if(const Pred &pred)
+        {
+                T *head{};
+                T *tail{};
+
+                for (auto &s: m_slots) {
+                        T *prev{};
+
+                        for (auto node = s.head; node; ) {
+                                auto next = node->next;
+
+                                if (!pred(node)) {
+                                        prev = node;
+                                        node = next;
+                                        continue;
+                                }
+
+                                (prev ? prev->next : s.head) = next;
+                                if (s.tail == node) {
+                                        s.tail = prev;
+                                }
+
+                                node->next = nullptr;
+                                (tail ? tail->next : head) = node;
+                                tail = node;
+
+                                --m_size;
+                                node = next;
+                        }
+
+                        if (!s.head) {
+                                s.deficit = 0;
+                        }
+                }
+
+                return head;
+        }
+
+private:
+        struct slot
+        {
+                T *head;
+                T *tail;
+                unsigned long deficit;
+                unsigned long quantum;
+                unsigned int cls;
+        };
+
+        slot m_slots[Slots];
+        unsigned int m_current[Classes]; // slot that is being served
+        unsigned int m_size;
+
+        auto active(const slot &s, unsigned int cls) const { return s.head && s.cls == cls; }
+
+        /*
+         * @return next active slot of the class after i, can be i itself; Slots if none
+         */
+        auto next(unsigned int i, unsigned int cls) const
+        {
+                for (unsigned int k = 1; k <= Slots; ++k) {
+                        if (auto j = (i + k) % Slots; active(m_slots[j], cls)) {
+                                return j;
+                        }
+                }
+
+                return Slots;
+        }
+
+        T* pop(unsigned int cls)
+        {
+                for (auto i = m_current[cls]; ; ) {
+
+                        if (auto &s = m_slots[i]; active(s, cls) && s.head->send_len <= s.deficit) {
+                                auto node = s.head;
+                                s.deficit -= node->send_len;
+
+                                if (!(s.head = node->next)) {
+                                        s.tail = nullptr;
+                                        s.deficit = 0; // an idle slot does not accumulate credit
+                                }
+
+                                node->next = nullptr;
+                                --m_size;
+                                return node;
+                        }
+
+                        i = next(i, cls);
+                        if (i == Slots) {
+                                return nullptr;
+                        }
+
+                        m_current[cls] = i;
+                        m_slots[i].deficit += m_slots[i].quantum; // new round for this slot
+                }
+        }
+};
+
+} // namespace usbip
@@ -9,6 +9,7 @@
 #include "device.h"
 #include "vhci_ioctl.h"
 #include "persistent.h"
+#include "addrinfo_cache.h"
 
 #include <ntstrsafe.h>
 
@@ -59,6 +60,7 @@ PAGED void vhci_cleanup(_In_ WDFOBJECT object)
         TraceDbg("vhci %04x", ptr04x(vhci));
 
         attach_thread_join(vhci);
+        free_addrinfo_cache(*get_vhci_ctx(vhci));
 }
 
 _Function_class_(EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE)
@@ -114,10 +116,19 @@ PAGED auto init_context(_In_ WDFDEVICE vhci)
                 return err;
         }
 
+        if (auto err = WdfWaitLockCreate(&attr, &ctx.addrinfo_lock)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfWaitLockCreate %!STATUS!", err);
+                return err;
+        }
+
         if (auto err = create_read_queue(ctx.reads, attr, vhci)) {
                 return err;
         }
 
+        if (auto err = create_addrinfo_cache(ctx)) {
+                return err;
+        }
+
         KeInitializeEvent(&ctx.attach_thread_stop, NotificationEvent, false);
         InitializeListHead(&ctx.fileobjects);
 
@@ -481,7 +492,7 @@ PAGED auto make_device_state(
         attr.ParentObject = parent;
 
         WDFMEMORY mem{};
-        vhci::device_state *r{};
+        vhci::device_state_ex *r{};
         if (auto err = WdfMemoryCreate(&attr, PagedPool, 0, sizeof(*r), &mem, reinterpret_cast<PVOID*>(&r))) {
                 Trace(TRACE_LEVEL_ERROR, "WdfMemoryCreate %!STATUS!", err);
                 return mem;
@@ -490,6 +501,7 @@ PAGED auto make_device_state(
         RtlZeroMemory(r, sizeof(*r));
         r->size = sizeof(*r);
         r->state = state;
+        r->timestamp = KeQueryInterruptTime();
 
         if (auto err = fill(*r, ext, port)) {
                 WdfObjectDelete(mem);
@@ -709,14 +721,18 @@ PAGED void usbip::vhci::complete_read(_In_ WDFREQUEST request, _In_ WDFMEMORY ev
         PAGED_CODE();
 
         device_state *dst{};
-        auto dst_sz = sizeof(*dst);
+        size_t dst_sz{};
 
-        auto st = WdfRequestRetrieveOutputBuffer(request, dst_sz, reinterpret_cast<PVOID*>(&dst), nullptr);
+        auto st = WdfRequestRetrieveOutputBuffer(request, sizeof(*dst), reinterpret_cast<PVOID*>(&dst), &dst_sz);
         
         if (NT_SUCCESS(st)) {
                 size_t size{};
-                *dst = *reinterpret_cast<device_state*>(WdfMemoryGetBuffer(evt, &size));
-                NT_ASSERT(size == dst_sz);
+                auto src = reinterpret_cast<device_state_ex*>(WdfMemoryGetBuffer(evt, &size));
+                NT_ASSERT(size == sizeof(*src));
+
+                dst_sz = dst_sz < sizeof(*src) ? sizeof(*dst) : sizeof(*src); // @see device_read
+                RtlCopyMemory(dst, src, dst_sz);
+                dst->size = ULONG(dst_sz);
         } else {
                 Trace(TRACE_LEVEL_ERROR, "WdfRequestRetrieveOutputBuffer %!STATUS!", st);
                 dst_sz = 0;
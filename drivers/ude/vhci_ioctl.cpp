@@ -12,13 +12,19 @@
 #include "network.h"
 #include "ioctl.h"
 #include "persistent.h"
+#include "driver.h"
+#include "wsk_receive.h"
+#include "descriptor_cache.h"
+#include "addrinfo_cache.h"
 
-#include <usbip\proto_op.h>
+#include <usbip\codec.h>
 
 #include <libdrv\dbgcommon.h>
 #include <libdrv\strconv.h>
+#include <libdrv\wait_timeout.h>
 
 #include <ntstrsafe.h>
+#include <ip2string.h>
 #include <usbuser.h>
 
 namespace
@@ -29,6 +35,8 @@ using namespace usbip;
 static_assert(sizeof(vhci::imported_device_location::service) == NI_MAXSERV);
 static_assert(sizeof(vhci::imported_device_location::host) == NI_MAXHOST);
 
+enum : LONGLONG { CONNECT_ATTEMPT_DELAY = 250*wdm::msec }; // RFC 8305, 5. Establishing Connections
+
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 PAGED void log(_In_ const usbip_usb_device &d)
@@ -64,8 +72,8 @@ PAGED auto send_req_import(_In_ device_ctx_ext &ext)
                 return err;
         }
 
-        PACK_OP_COMMON(false, &req.hdr);
-        PACK_OP_IMPORT_REQUEST(false, &req.body);
+        wire::byteswap(req.hdr);
+        wire::byteswap(req.body);
 
         return send(ext.sock, memory::stack, &req, sizeof(req));
 }
@@ -85,7 +93,7 @@ PAGED auto recv_rep_import(_In_ device_ctx_ext &ext, _In_ memory pool, _Out_ op_
                 Trace(TRACE_LEVEL_ERROR, "Receive op_import_reply %!STATUS!", err);
                 return USBIP_ERROR_NETWORK;
         }
-        PACK_OP_IMPORT_REPLY(false, &reply);
+        wire::byteswap(reply);
 
         if (char busid[sizeof(reply.udev.busid)];
             DWORD err = libdrv::unicode_to_utf8(busid, sizeof(busid), ext.busid)) {
@@ -125,6 +133,8 @@ PAGED auto import_remote_device(_Inout_ device_ctx_ext &ext)
                 d->product = udev.idProduct;
         }
 
+        ext.num_configurations = udev.bNumConfigurations;
+
         return USBIP_ERROR_SUCCESS;
 }
 
@@ -190,7 +200,7 @@ PAGED auto set_options(wsk::SOCKET *sock)
 
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
+PAGED NTSTATUS prepare_socket(_In_ wsk::SOCKET *sock, _In_ const ADDRINFOEXW &ai, _Inout_opt_ void*)
 {
         PAGED_CODE();
 
@@ -205,30 +215,75 @@ PAGED auto try_connect(wsk::SOCKET *sock, const ADDRINFOEXW &ai, void*)
                 return err;
         }
 
-        auto err = connect(sock, ai.ai_addr);
-        if (err) {
-                Trace(TRACE_LEVEL_ERROR, "WskConnect %!STATUS!", err);
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto to_string(_Out_writes_z_(len) char *buf, _In_ ULONG len, _In_ const SOCKADDR &addr)
+{
+        PAGED_CODE();
+        *buf = '\0';
+
+        switch (addr.sa_family) {
+        case AF_INET:
+                if (auto &a = reinterpret_cast<const SOCKADDR_IN&>(addr); true) {
+                        RtlIpv4AddressToStringExA(&a.sin_addr, a.sin_port, buf, &len);
+                }
+                break;
+        case AF_INET6:
+                if (auto &a = reinterpret_cast<const SOCKADDR_IN6&>(addr); true) {
+                        RtlIpv6AddressToStringExA(&a.sin6_addr, a.sin6_scope_id, a.sin6_port, buf, &len);
+                }
+                break;
         }
-        return err;
+
+        return buf;
 }
 
+/*
+ * @param sock receives the connected socket, ext is its SocketContext
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
-PAGED auto connect(_Inout_ device_ctx_ext &ext)
+PAGED auto connect(_Out_ wsk::SOCKET* &sock, _In_ WDFDEVICE vhci, _Inout_ device_ctx_ext &ext)
 {
         PAGED_CODE();
+        auto &vctx = *get_vhci_ctx(vhci);
+
+        addrinfo_list cached;
+        const ADDRINFOEXW *head = cached.ai;
 
-        ADDRINFOEXW *ai{};
-        if (auto err = getaddrinfo(ai, ext)) {
-                Trace(TRACE_LEVEL_ERROR, "getaddrinfo %!STATUS!", err);
-                return USBIP_ERROR_ADDRINFO;
+        ADDRINFOEXW *ai{}; // must be free-d
+        if (!get_cached_addrinfo(vctx, ext.node_name, ext.service_name, cached)) {
+                if (auto err = getaddrinfo(ai, ext)) {
+                        Trace(TRACE_LEVEL_ERROR, "getaddrinfo %!STATUS!", err);
+                        return USBIP_ERROR_ADDRINFO;
+                }
+                head = ai;
         }
 
-        NT_ASSERT(!ext.sock);
-        ext.sock = wsk::for_each(WSK_FLAG_CONNECTION_SOCKET, &ext, nullptr, ai, try_connect, nullptr);
+        NT_ASSERT(!sock);
+        auto dispatch = ext.receive_events ? &receive_events_dispatch : nullptr;
+
+        auto started = KeQueryInterruptTime();
+        const ADDRINFOEXW *winner{};
+
+        sock = wsk::connect_any(WSK_FLAG_CONNECTION_SOCKET, &ext, dispatch, head, prepare_socket, nullptr,
+                                CONNECT_ATTEMPT_DELAY, winner);
+
+        if (char str[INET6_ADDRSTRLEN]; sock) {
+                Trace(TRACE_LEVEL_INFORMATION, "%s connected in %I64u ms%s",
+                        to_string(str, sizeof(str), *winner->ai_addr), (KeQueryInterruptTime() - started)/10'000,
+                        ai ? "" : ", cached address");
+
+                update_addrinfo_cache(vctx, ext.node_name, ext.service_name, head, *winner);
+        } else {
+                invalidate_addrinfo_cache(vctx, ext.node_name, ext.service_name);
+        }
 
         wsk::free(ai);
-        return ext.sock ? USBIP_ERROR_SUCCESS : USBIP_ERROR_CONNECT;
+        return sock ? USBIP_ERROR_SUCCESS : USBIP_ERROR_CONNECT;
 }
 
 _IRQL_requires_same_
@@ -295,7 +350,8 @@ PAGED auto start_device(_Out_ int &port, _In_ UDECXUSBDEVICE device)
         }
 
         if (auto dev = get_device_ctx(device)) {
-                sched_receive_usbip_header(*dev);
+                dev->stats.started = KeQueryInterruptTime();
+                start_receive(*dev);
         }
 
         return USBIP_ERROR_SUCCESS;
@@ -311,14 +367,23 @@ PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::plugin_hard
         auto &port = r.port;
         r.port = 0;
 
+        auto started = KeQueryInterruptTime();
+
         device_ctx_ext_ptr ext(vhci);
         if (NT_ERROR(create_device_ctx_ext(ext.ptr, r))) {
                 return USBIP_ERROR_GENERAL;
         }
 
+        ext->receive_events = bool(get_parameter(receive_events_value_name, false));
+        ext->inline_receive = bool(get_parameter(inline_receive_value_name, true));
+        ext->send_coalescing = bool(get_parameter(send_coalescing_value_name, false));
+        ext->inline_out_max = min(get_parameter(inline_out_max_value_name, SEND_INLINE_DEFAULT), ULONG(SEND_INLINE_MAX));
+        ext->prefetch_descriptors = bool(get_parameter(prefetch_descriptors_value_name, true));
+        ext->resume_timeout = get_parameter(resume_timeout_value_name, 0);
+
         device_state_changed(vhci, *ext, port, vhci::state::connecting);
 
-        if (auto err = connect(*ext)) {
+        if (auto err = connect(ext->sock, vhci, *ext)) {
                 Trace(TRACE_LEVEL_ERROR, "Can't connect to %!USTR!:%!USTR!", &ext->node_name, &ext->service_name);
                 return err;
         }
@@ -336,12 +401,19 @@ PAGED auto plugin_hardware(_In_ WDFDEVICE vhci, _Inout_ vhci::ioctl::plugin_hard
         }
         ext.release(); // now dev owns it
 
+        if (auto ctx = get_device_ctx(dev); ctx->ext->prefetch_descriptors &&
+            NT_ERROR(prefetch_descriptors(*ctx, ctx->ext->num_configurations))) {
+                WdfObjectDelete(dev);
+                return USBIP_ERROR_NETWORK;
+        }
+
         if (auto err = start_device(port, dev)) {
                 WdfObjectDelete(dev); // UdecxUsbDevicePlugIn failed or was not called
                 return err;
         }
 
-        Trace(TRACE_LEVEL_INFORMATION, "dev %04x plugged in, port %d", ptr04x(dev), port);
+        Trace(TRACE_LEVEL_INFORMATION, "dev %04x plugged in, port %d, attach took %I64u ms",
+                ptr04x(dev), port, (KeQueryInterruptTime() - started)/10'000);
 
         if (auto ctx = get_device_ctx(dev)) {
                 device_state_changed(*ctx, vhci::state::plugged);
@@ -380,6 +452,148 @@ PAGED auto plugin_hardware(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+struct batch_request;
+
+struct batch_attach
+{
+        batch_request *batch;
+        vhci::ioctl::plugin_hardware_entry *entry; // in the buffer of the request
+};
+
+/*
+ * The request is completed by the last attach thread, @see release.
+ */
+struct batch_request
+{
+        WDFDEVICE vhci;
+        WDFREQUEST request;
+        size_t length; // of the buffer of the request
+
+        vhci::ioctl::plugin_hardware_batch *r;
+        ULONG cnt; // devices that are attached by threads, the rest get USBIP_ERROR_PORTFULL
+
+        ULONGLONG started;
+        volatile LONG refcnt; // attach threads and the caller of plugin_hardware_batch
+
+        batch_attach devices[TOTAL_PORTS];
+};
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void release(_Inout_ batch_request &b)
+{
+        PAGED_CODE();
+
+        if (InterlockedDecrement(&b.refcnt)) {
+                return;
+        }
+
+        ULONG attached = 0;
+        for (ULONG i = 0; i < b.cnt; ++i) {
+                attached += !b.r->devices[i].status;
+        }
+
+        Trace(TRACE_LEVEL_INFORMATION, "%lu of %lu device(s) attached in %I64u ms", 
+                attached, b.r->count, (KeQueryInterruptTime() - b.started)/10'000);
+
+        auto request = b.request;
+        auto length = b.length;
+
+        ExFreePoolWithTag(&b, pooltag);
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, length);
+}
+
+_IRQL_requires_same_
+_Function_class_(KSTART_ROUTINE)
+PAGED void batch_attach_thread(_In_ void *ctx)
+{
+        PAGED_CODE();
+
+        auto &a = *static_cast<batch_attach*>(ctx);
+        auto &e = *a.entry;
+
+        vhci::ioctl::plugin_hardware r{{ .size = sizeof(r) }};
+        static_cast<vhci::imported_device_location&>(r) = e;
+
+        e.status = plugin_hardware(a.batch->vhci, r);
+        e.port = r.port;
+
+        release(*a.batch);
+}
+
+/*
+ * Each device is attached by its own system thread, so the batch takes as long as the slowest device.
+ * The batch can be larger than the number of ports, the devices beyond it are not attached
+ * and USBIP_ERROR_PORTFULL is returned for each of them.
+ *
+ * The request is on vhci_ctx::batches, the threads are not waited for, the last one completes it.
+ * @return STATUS_PENDING if the request will be completed by release
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto plugin_hardware_batch(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::plugin_hardware_batch *r{};
+        size_t length;
+
+        if (auto err = WdfRequestRetrieveInputBuffer(request, vhci::ioctl::plugin_hardware_batch_size(1), 
+                                                     reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "plugin_hardware_batch.size %lu != sizeof(plugin_hardware_batch) %Iu", 
+                                          r->size, sizeof(*r));
+
+                return as_ntstatus(USBIP_ERROR_ABI);
+        } else if (auto max_cnt = (length - offsetof(vhci::ioctl::plugin_hardware_batch, devices))/sizeof(*r->devices);
+                   !(r->count && r->count <= max_cnt && length == vhci::ioctl::plugin_hardware_batch_size(r->count))) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (PVOID out; auto err = WdfRequestRetrieveOutputBuffer(request, length, &out, nullptr)) {
+                return err;
+        }
+
+        auto b = (batch_request*)ExAllocatePoolZero(PagedPool, sizeof(batch_request), pooltag);
+        if (!b) {
+                Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", sizeof(batch_request));
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        b->vhci = get_vhci(request);
+        b->request = request;
+        b->length = length;
+        b->r = r;
+        b->cnt = min(r->count, ULONG(TOTAL_PORTS));
+        b->started = KeQueryInterruptTime();
+        b->refcnt = 1;
+
+        for (auto i = b->cnt; i < r->count; ++i) {
+                auto &e = r->devices[i];
+                e.port = 0;
+                e.status = USBIP_ERROR_PORTFULL;
+        }
+
+        for (ULONG i = 0; i < b->cnt; ++i) {
+                auto &a = b->devices[i];
+
+                a.batch = b;
+                a.entry = &r->devices[i];
+
+                InterlockedIncrement(&b->refcnt);
+
+                if (_KTHREAD *thread; create_system_thread(thread, b->vhci, batch_attach_thread, &a)) {
+                        a.entry->port = 0;
+                        a.entry->status = USBIP_ERROR_GENERAL;
+                        InterlockedDecrement(&b->refcnt); // is not the last reference
+                } else {
+                        ObDereferenceObject(thread); // is not waited for, IoCreateSystemThread references the device object
+                }
+        }
+
+        release(*b);
+        return STATUS_PENDING;
+}
+
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED auto plugout_hardware(_In_ WDFREQUEST request)
@@ -496,6 +710,57 @@ PAGED auto driver_registry_path(_In_ WDFREQUEST request)
         return STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto get_statistics(_In_ WDFREQUEST request)
+{
+        PAGED_CODE();
+
+        vhci::ioctl::get_statistics *r;
+
+        if (size_t length;
+            auto err = WdfRequestRetrieveOutputBuffer(request, sizeof(*r), reinterpret_cast<PVOID*>(&r), &length)) {
+                return err;
+        } else if (length != sizeof(*r)) {
+                return STATUS_INVALID_BUFFER_SIZE;
+        } else if (r->size != sizeof(*r)) {
+                Trace(TRACE_LEVEL_ERROR, "get_statistics.size %lu != sizeof(get_statistics) %Iu", r->size, sizeof(*r));
+                return as_ntstatus(USBIP_ERROR_ABI);
+        }
+
+        wsk_context_stats pools[WSK_CONTEXT_POOLS];
+        static_assert(ARRAYSIZE(pools) == ARRAYSIZE(r->wsk_context));
+
+        get_wsk_context_stats(pools);
+
+        for (int i = 0; i < ARRAYSIZE(pools); ++i) {
+                auto &src = pools[i];
+                auto &dst = r->wsk_context[i];
+
+                dst.isoc_packets = src.isoc_packets;
+                dst.hits = src.hits;
+                dst.misses = src.misses;
+                dst.isoc_grown = src.isoc_grown;
+        }
+
+        mdl_cache_stats mdl;
+        get_mdl_cache_stats(mdl);
+
+        r->mdl_cache.hits = mdl.hits;
+        r->mdl_cache.misses = mdl.misses;
+        r->mdl_cache.trimmed = mdl.trimmed;
+
+        auto &restore = get_vhci_ctx(get_vhci(request))->restore;
+
+        r->persistent.devices = restore.devices;
+        r->persistent.attached = restore.attached;
+        r->persistent.attempts = restore.attempts;
+        r->persistent.time_ms = ULONG(restore.time/10'000);
+
+        WdfRequestSetInformation(request, sizeof(*r));
+        return STATUS_SUCCESS;
+}
+
 /*
  * IRP_MJ_DEVICE_CONTROL
  * 
@@ -529,6 +794,15 @@ PAGED void device_control(
         case vhci::ioctl::PLUGIN_HARDWARE:
                 st = plugin_hardware(Request);
                 break;
+        case vhci::ioctl::PLUGIN_HARDWARE_BATCH: // takes as long as the slowest device, must not block this queue
+                if (auto &vhci = *get_vhci_ctx(WdfIoQueueGetDevice(Queue)); 
+                    auto err = WdfRequestForwardToIoQueue(Request, vhci.batches)) {
+                        Trace(TRACE_LEVEL_ERROR, "WdfRequestForwardToIoQueue %!STATUS!", err);
+                        st = err;
+                } else {
+                        complete = false;
+                }
+                break;
         case vhci::ioctl::PLUGOUT_HARDWARE:
                 st = plugout_hardware(Request);
                 break;
@@ -538,6 +812,9 @@ PAGED void device_control(
         case vhci::ioctl::DRIVER_REGISTRY_PATH:
                 st = driver_registry_path(Request);
                 break;
+        case vhci::ioctl::GET_STATISTICS:
+                st = get_statistics(Request);
+                break;
         case IOCTL_USB_USER_REQUEST:
                 NT_ASSERT(!has_urb(Request));
                 if (USBUSER_REQUEST_HEADER *hdr; 
@@ -557,6 +834,51 @@ PAGED void device_control(
         }
 }
 
+/*
+ * vhci_ctx::batches
+ */
+_Function_class_(EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+PAGED void batch_control(
+        _In_ WDFQUEUE, _In_ WDFREQUEST Request, _In_ size_t, _In_ size_t, _In_ ULONG IoControlCode)
+{
+        PAGED_CODE();
+        NT_ASSERT(IoControlCode == vhci::ioctl::PLUGIN_HARDWARE_BATCH);
+
+        if (auto st = plugin_hardware_batch(Request); st != STATUS_PENDING) {
+                TraceDbg("%s(%#08lX) %!STATUS!", device_control_name(IoControlCode), IoControlCode, st);
+                WdfRequestComplete(Request, st);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED auto create_batch_queue(_In_ WDFDEVICE vhci)
+{
+        PAGED_CODE();
+
+        WDF_IO_QUEUE_CONFIG cfg;
+        WDF_IO_QUEUE_CONFIG_INIT(&cfg, WdfIoQueueDispatchParallel);
+        cfg.PowerManaged = WdfFalse;
+        cfg.EvtIoDeviceControl = batch_control;
+
+        WDF_OBJECT_ATTRIBUTES attr;
+        WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+        attr.ExecutionLevel = WdfExecutionLevelPassive;
+        attr.ParentObject = vhci;
+
+        auto &queue = get_vhci_ctx(vhci)->batches;
+
+        if (auto err = WdfIoQueueCreate(vhci, &cfg, &attr, &queue)) {
+                Trace(TRACE_LEVEL_ERROR, "WdfIoQueueCreate %!STATUS!", err);
+                return err;
+        }
+
+        TraceDbg("%04x", ptr04x(queue));
+        return STATUS_SUCCESS;
+}
+
 _Function_class_(EVT_WDF_IO_QUEUE_IO_READ)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -569,7 +891,7 @@ PAGED void device_read(_In_ WDFQUEUE queue, _In_ WDFREQUEST request, _In_ size_t
 
         TraceDbg("fobj %04x, request %04x, length %Iu", ptr04x(fileobj), ptr04x(request), length);
 
-        if (length != sizeof(vhci::device_state)) {
+        if (!(length == sizeof(vhci::device_state) || length == sizeof(vhci::device_state_ex))) {
                 WdfRequestCompleteWithInformation(request, STATUS_INVALID_BUFFER_SIZE, 0);
                 return;
         }
@@ -624,5 +946,56 @@ PAGED NTSTATUS usbip::vhci::create_default_queue(_In_ WDFDEVICE vhci)
         }
 
         TraceDbg("%04x", ptr04x(queue));
+        return create_batch_queue(vhci);
+}
+
+/*
+ * The new socket is published after OP_REP_IMPORT, concurrent senders must not write to it before.
+ * The replaced socket must be closed, it is not free-d because device_ctx::sock() could have read it.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::reconnect(_Inout_ device_ctx_ext &ext)
+{
+        PAGED_CODE();
+
+        auto tmp = ext; // shallow copy for import_remote_device
+        tmp.sock = nullptr;
+
+        if (auto err = connect(tmp.sock, ext.ctx->vhci, ext)) {
+                return as_ntstatus(err);
+        }
+
+        if (auto err = import_remote_device(tmp)) {
+                close_socket(tmp.sock);
+                free(tmp.sock);
+                return as_ntstatus(err);
+        }
+
+        if (auto &d = tmp.dev; d.vendor != ext.dev.vendor || d.product != ext.dev.product) {
+                Trace(TRACE_LEVEL_ERROR, "Other device %04x:%04x is imported, expected %04x:%04x",
+                        d.vendor, d.product, ext.dev.vendor, ext.dev.product);
+
+                close_socket(tmp.sock);
+                free(tmp.sock);
+                return as_ntstatus(USBIP_ERROR_PROTOCOL);
+        }
+
+        ext.dev.devid = tmp.dev.devid;
+
+        free(ext.old_sock);
+        ext.old_sock = static_cast<wsk::SOCKET*>(InterlockedExchangePointer(reinterpret_cast<PVOID*>(&ext.sock), tmp.sock));
+
+        Trace(TRACE_LEVEL_INFORMATION, "Reconnected to %!USTR!:%!USTR!", &ext.node_name, &ext.service_name);
         return STATUS_SUCCESS;
 }
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS usbip::vhci::attach(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r)
+{
+        PAGED_CODE();
+
+        auto err = plugin_hardware(vhci, r);
+        return as_ntstatus(err);
+}
@@ -7,11 +7,41 @@
 #include <libdrv\codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+namespace usbip
+{
+        struct device_ctx_ext;
+} // namespace usbip
+
+namespace usbip::vhci::ioctl
+{
+        struct plugin_hardware;
+} // namespace usbip::vhci::ioctl
+
+
 namespace usbip::vhci
 {
 
+/*
+ * Also creates vhci_ctx::batches.
+ */
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS create_default_queue(_In_ WDFDEVICE vhci);
 
+/*
+ * Connect to the server again and import the same remote device, device_ctx_ext::sock is replaced.
+ * @see device::async_resume
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS reconnect(_Inout_ device_ctx_ext &ext);
+
+/*
+ * The same as ioctl::PLUGIN_HARDWARE, but is not serialized by the default queue.
+ * @return USBIP_ERROR_* converted by as_ntstatus
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED NTSTATUS attach(_In_ WDFDEVICE vhci, _Inout_ ioctl::plugin_hardware &r);
+
 } // namespace usbip::vhci
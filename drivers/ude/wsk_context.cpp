@@ -6,6 +6,8 @@
 #include "trace.h"
 #include "wsk_context.tmh"
 
+#include "context.h"
+
 #include <libdrv/codeseg.h>
 
 namespace
@@ -13,9 +15,41 @@ namespace
 
 using namespace usbip;
 
+const ULONG pool_packets[WSK_CONTEXT_POOLS] { 0, 8, 32, 128, USBIP_MAX_ISO_PACKETS }; // capacity of isoc
+const USHORT cpu_depth[WSK_CONTEXT_POOLS] { 64, 16, 16, 8, 4 }; // of a per-CPU free list
+
 ULONG g_tag;
 bool g_initialized;
-LOOKASIDE_LIST_EX g_lookaside;
+LOOKASIDE_LIST_EX g_lookaside[WSK_CONTEXT_POOLS];
+
+struct cpu_cache // is allocated with POOL_FLAG_CACHE_ALIGNED
+{
+        SLIST_HEADER free[WSK_CONTEXT_POOLS]; // entry overlaps wsk_context::dev like in lookaside list
+        wsk_context_stats stats[WSK_CONTEXT_POOLS];
+};
+
+cpu_cache *g_cpus;
+ULONG g_cpu_cnt;
+
+/*
+ * The thread can be rescheduled to another CPU, lists are interlocked and that is not an issue.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+inline auto& get_cpu_cache()
+{
+        return g_cpus[KeGetCurrentProcessorNumberEx(nullptr) % g_cpu_cnt];
+}
+
+/*
+ * @return the pool which isoc can hold NumberOfPackets
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto get_pool(_In_ ULONG NumberOfPackets)
+{
+        UCHAR pool = 0;
+        for ( ; pool < WSK_CONTEXT_POOLS - 1 && pool_packets[pool] < NumberOfPackets; ++pool);
+        return pool;
+}
 
 _IRQL_requires_same_
 _Function_class_(free_function_ex)
@@ -41,6 +75,9 @@ void free_function_ex(_In_ __drv_freesMem(Mem) void *Buffer, _Inout_ LOOKASIDE_L
         ExFreePoolWithTag(ctx, g_tag);
 }
 
+/*
+ * isoc is preallocated for the capacity of the pool.
+ */
 _IRQL_requires_same_
 _Function_class_(allocate_function_ex)
 void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _In_ ULONG Tag, _Inout_ LOOKASIDE_LIST_EX *list)
@@ -54,7 +91,8 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
                 return nullptr;
         }
 
-        ctx->mdl_hdr = Mdl(&ctx->hdr, sizeof(ctx->hdr));
+        static_assert(offsetof(wsk_context, hdr_payload) == offsetof(wsk_context, hdr) + sizeof(ctx->hdr));
+        ctx->mdl_hdr = Mdl(&ctx->hdr, sizeof(ctx->hdr) + sizeof(ctx->hdr_payload));
 
         if (auto err = ctx->mdl_hdr.prepare_nonpaged()) {
                 Trace(TRACE_LEVEL_ERROR, "mdl_hdr %!STATUS!", err);
@@ -69,6 +107,19 @@ void *allocate_function_ex(_In_ POOL_TYPE PoolType, _In_ SIZE_T NumberOfBytes, _
                 return nullptr;
         }
 
+        ctx->pool = UCHAR(list - g_lookaside);
+        NT_ASSERT(ctx->pool < WSK_CONTEXT_POOLS);
+
+        if (auto cnt = pool_packets[ctx->pool]) {
+                ctx->isoc = (usbip_iso_packet_descriptor*)ExAllocatePoolZero(PoolType, cnt*sizeof(*ctx->isoc), Tag);
+                if (!ctx->isoc) {
+                        Trace(TRACE_LEVEL_ERROR, "Can't allocate isoc[%lu]", cnt);
+                        free_function_ex(ctx, list);
+                        return nullptr;
+                }
+                ctx->isoc_alloc_cnt = cnt;
+        }
+
         TraceWSK("%04x", ptr04x(ctx));
         return ctx;
 }
@@ -81,25 +132,109 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto alloc_wsk_context(_In_ ULONG NumberOfPackets)
 {
-        auto ctx = (wsk_context*)ExAllocateFromLookasideListEx(&g_lookaside);
+        auto pool = get_pool(NumberOfPackets);
+        auto &cpu = get_cpu_cache();
+
+        auto ctx = reinterpret_cast<wsk_context*>(InterlockedPopEntrySList(&cpu.free[pool]));
+
+        if (ctx) {
+                InterlockedIncrement64(&cpu.stats[pool].hits);
+        } else {
+                InterlockedIncrement64(&cpu.stats[pool].misses);
+                ctx = (wsk_context*)ExAllocateFromLookasideListEx(&g_lookaside[pool]);
+        }
 
         if (!ctx) {
                 Trace(TRACE_LEVEL_ERROR, "ExAllocateFromLookasideListEx error");
         } else if (auto err = prepare_isoc(*ctx, NumberOfPackets)) {
                 Trace(TRACE_LEVEL_ERROR, "prepare_isoc(NumberOfPackets %lu) %!STATUS!", NumberOfPackets, err);
-                free_function_ex(ctx, &g_lookaside);
+                free_function_ex(ctx, &g_lookaside[pool]);
                 ctx = nullptr;
         }
 
         return ctx;
 }
 
+/*
+ * The entry overwrites wsk_context::dev.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_to_pool(_In_ wsk_context *ctx)
+{
+        auto &head = get_cpu_cache().free[ctx->pool];
+
+        if (ExQueryDepthSList(&head) < cpu_depth[ctx->pool]) {
+                InterlockedPushEntrySList(&head, reinterpret_cast<SLIST_ENTRY*>(ctx));
+        } else {
+                ExFreeToLookasideListEx(&g_lookaside[ctx->pool], ctx);
+        }
+}
+
+/*
+ * @return list of device_ctx::reserve
+ */
+constexpr auto reserve_list(_In_ bool isoch) { return int(isoch); }
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+wsk_context *take_from_reserve(_Inout_ device_ctx &dev, _In_ ULONG NumberOfPackets)
+{
+        auto &r = dev.reserve;
+        auto i = reserve_list(NumberOfPackets);
+
+        auto ctx = reinterpret_cast<wsk_context*>(InterlockedPopEntrySList(&r.list[i]));
+        if (!ctx) {
+                return nullptr;
+        }
+
+        if (auto err = prepare_isoc(*ctx, NumberOfPackets)) {
+                Trace(TRACE_LEVEL_ERROR, "prepare_isoc(NumberOfPackets %lu) %!STATUS!", NumberOfPackets, err);
+                InterlockedPushEntrySList(&r.list[i], reinterpret_cast<SLIST_ENTRY*>(ctx));
+                return nullptr;
+        }
+
+        InterlockedIncrement64(&dev.stats.reserve_used);
+        return ctx;
+}
+
+/*
+ * A context that can hold USBIP_MAX_ISO_PACKETS refills the isoch list first.
+ * The retry workitem is enqueued for throttled URBs.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto return_to_reserve(_In_ wsk_context *ctx)
+{
+        auto &dev = *ctx->dev;
+        if (dev.unplugged) { // @see free_wsk_context_reserve
+                return false;
+        }
+
+        auto &r = dev.reserve;
+        auto full = [&r] (auto i) { return ExQueryDepthSList(&r.list[i]) >= r.target[i]; };
+
+        auto i = reserve_list(ctx->pool == WSK_CONTEXT_POOLS - 1);
+        if (full(i) && full(i = reserve_list(false))) {
+                return false;
+        }
+
+        InterlockedPushEntrySList(&r.list[i], reinterpret_cast<SLIST_ENTRY*>(ctx)); // overwrites dev
+
+        if (r.throttled_cnt) {
+                WdfWorkItemEnqueue(r.retry);
+        }
+
+        return true;
+}
+
 } // namespace
 
 
 /*
  * LOOKASIDE_LIST_EX.L.Depth is zero if Driver Verifier is enabled.
  * For this reason ExFreeToLookasideListEx always calls L.FreeEx instead of InterlockedPushEntrySList.
+ * Per-CPU free lists are in front of the lookaside lists, one list for each pool.
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -110,20 +245,79 @@ NTSTATUS usbip::init_wsk_context_list(_In_ ULONG tag)
         }
 
         g_tag = tag;
-        auto err = ExInitializeLookasideListEx(&g_lookaside, allocate_function_ex, free_function_ex, 
-                                               NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0);
+        g_cpu_cnt = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+        g_cpus = (cpu_cache*)ExAllocatePool2(POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED, 
+                                             g_cpu_cnt*sizeof(*g_cpus), tag);
+        if (!g_cpus) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        for (ULONG i = 0; i < g_cpu_cnt; ++i) {
+                for (auto &head: g_cpus[i].free) {
+                        InitializeSListHead(&head);
+                }
+        }
+
+        for (auto &list: g_lookaside) {
+                if (auto err = ExInitializeLookasideListEx(&list, allocate_function_ex, free_function_ex, 
+                                                           NonPagedPoolNx, 0, sizeof(wsk_context), tag, 0)) {
+                        for (auto i = g_lookaside; i != &list; ++i) {
+                                ExDeleteLookasideListEx(i);
+                        }
 
-        g_initialized = !err;
-        return err;
+                        ExFreePoolWithTag(g_cpus, tag);
+                        g_cpus = nullptr;
+
+                        return err;
+                }
+        }
+
+        g_initialized = true;
+        return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void usbip::delete_wsk_context_list()
 {
-        if (g_initialized) {
-                ExDeleteLookasideListEx(&g_lookaside);
-                g_initialized = false;
+        if (!g_initialized) {
+                return;
+        }
+
+        for (ULONG i = 0; i < g_cpu_cnt; ++i) {
+                for (auto &head: g_cpus[i].free) {
+                        while (auto entry = InterlockedPopEntrySList(&head)) {
+                                free_function_ex(entry, nullptr);
+                        }
+                }
+        }
+
+        for (auto &list: g_lookaside) {
+                ExDeleteLookasideListEx(&list);
+        }
+
+        ExFreePoolWithTag(g_cpus, g_tag);
+        g_cpus = nullptr;
+
+        g_initialized = false;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::get_wsk_context_stats(_Out_writes_(WSK_CONTEXT_POOLS) wsk_context_stats *stats)
+{
+        for (int pool = 0; pool < WSK_CONTEXT_POOLS; ++pool) {
+                auto &s = stats[pool];
+                s = { .isoc_packets = pool_packets[pool] };
+
+                for (ULONG i = 0; g_initialized && i < g_cpu_cnt; ++i) {
+                        auto &c = g_cpus[i].stats[pool];
+
+                        s.hits += c.hits;
+                        s.misses += c.misses;
+                        s.isoc_grown += c.isoc_grown;
+                }
         }
 }
 
@@ -135,6 +329,10 @@ auto usbip::alloc_wsk_context(
         NT_ASSERT(dev);
 
         auto ctx = ::alloc_wsk_context(NumberOfPackets);
+        if (!ctx) {
+                ctx = take_from_reserve(*dev, NumberOfPackets);
+        }
+
         if (ctx) {
                 ctx->dev = dev;
                 ctx->request = request;
@@ -160,7 +358,60 @@ void usbip::free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp)
                 IoReuseIrp(ctx->wsk_irp, STATUS_SUCCESS);
         }
 
-        ExFreeToLookasideListEx(&g_lookaside, ctx);
+        if (!return_to_reserve(ctx)) {
+                free_to_pool(ctx);
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS usbip::reserve_wsk_contexts(_Inout_ device_ctx &dev, _In_ LONG cnt, _In_ bool isoch)
+{
+        auto i = reserve_list(isoch);
+        auto &r = dev.reserve;
+
+        InterlockedAdd(&r.target[i], cnt);
+
+        for (LONG k = 0; k < cnt; ++k) {
+                auto ctx = ::alloc_wsk_context(isoch ? USBIP_MAX_ISO_PACKETS : 0);
+                if (!ctx) {
+                        return STATUS_INSUFFICIENT_RESOURCES; // will be refilled by free()
+                }
+                InterlockedPushEntrySList(&r.list[i], reinterpret_cast<SLIST_ENTRY*>(ctx));
+        }
+
+        return STATUS_SUCCESS;
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::release_wsk_contexts(_Inout_ device_ctx &dev, _In_ LONG cnt, _In_ bool isoch)
+{
+        auto i = reserve_list(isoch);
+        auto &r = dev.reserve;
+
+        for (auto target = InterlockedAdd(&r.target[i], -cnt); ExQueryDepthSList(&r.list[i]) > target; ) {
+                if (auto ctx = reinterpret_cast<wsk_context*>(InterlockedPopEntrySList(&r.list[i]))) {
+                        free_to_pool(ctx);
+                } else {
+                        break;
+                }
+        }
+}
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void usbip::free_wsk_context_reserve(_Inout_ device_ctx &dev)
+{
+        auto &r = dev.reserve;
+
+        for (auto &head: r.list) {
+                while (auto ctx = reinterpret_cast<wsk_context*>(InterlockedPopEntrySList(&head))) {
+                        free_to_pool(ctx);
+                }
+        }
+
+        RtlZeroMemory(r.target, sizeof(r.target));
 }
 
 _IRQL_requires_same_
@@ -176,7 +427,9 @@ NTSTATUS usbip::prepare_isoc(_In_ wsk_context &ctx, _In_ ULONG NumberOfPackets)
 
         ULONG isoc_len = NumberOfPackets*sizeof(*ctx.isoc);
 
-        if (ctx.isoc_alloc_cnt < NumberOfPackets) {
+        if (ctx.isoc_alloc_cnt < NumberOfPackets) { // NumberOfPackets > USBIP_MAX_ISO_PACKETS
+                InterlockedIncrement64(&get_cpu_cache().stats[ctx.pool].isoc_grown);
+
                 auto isoc = (usbip_iso_packet_descriptor*)ExAllocatePoolZero(NonPagedPoolNx, isoc_len, g_tag);
                 if (!isoc) {
                         return STATUS_INSUFFICIENT_RESOURCES;
@@ -14,6 +14,9 @@ namespace usbip
 
 struct device_ctx;
 
+enum { SEND_INLINE_MAX = 512 }; // maximum for device_ctx_ext::inline_out_max
+enum { SEND_INLINE_DEFAULT = 256 }; // @see tests/inline_out_sweep.cpp
+
 struct wsk_context
 {
         device_ctx *dev; // UDECXUSBDEVICE can be obtained from WDFREQUEST, but it is optional
@@ -23,17 +26,38 @@ struct wsk_context
         WDFREQUEST request; // can be WDF_NO_HANDLE
         Mdl mdl_buf; // describes URB_FROM_IRP()->TransferBuffer(MDL)
 
+        // for device_ctx::sendq, @see send_scheduler
+        wsk_context *next;
+        ULONG send_len; // of the PDU
+        ULONG send_quantum;
+        UCHAR send_slot;
+        UCHAR send_class;
+        bool send_gather; // into one WskSend even if not coalescing, @see device::send_cmd_unlinks_and_cancel
+        ULONGLONG send_queued; // KeQueryInterruptTime
+
         // preallocated data
 
         IRP *wsk_irp;
 
-        Mdl mdl_hdr;
+        Mdl mdl_hdr; // describes hdr and hdr_payload, its ByteCount is set for each PDU
         usbip_header hdr;
+        UCHAR hdr_payload[SEND_INLINE_MAX]; // small OUT transfer buffer is copied here instead of mdl_buf
 
         Mdl mdl_isoc;
         usbip_iso_packet_descriptor *isoc;
         ULONG isoc_alloc_cnt;
         bool is_isoc;
+        UCHAR pool; // index, @see alloc_wsk_context
+};
+
+enum { WSK_CONTEXT_POOLS = 5 }; // capacity of wsk_context::isoc is 0, 8, 32, 128, USBIP_MAX_ISO_PACKETS
+
+struct wsk_context_stats
+{
+        ULONG isoc_packets; // capacity of wsk_context::isoc in this pool
+        LONG64 hits; // taken from a per-CPU free list
+        LONG64 misses; // taken from the lookaside list
+        LONG64 isoc_grown; // wsk_context::isoc was reallocated
 };
 
 
@@ -45,15 +69,48 @@ _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void delete_wsk_context_list();
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void get_wsk_context_stats(_Out_writes_(WSK_CONTEXT_POOLS) wsk_context_stats *stats);
+
 
+/*
+ * The context is taken from the pool which wsk_context::isoc can hold NumberOfPackets.
+ * If the pool is exhausted, the context is taken from device_ctx::reserve.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 wsk_context *alloc_wsk_context(_In_ device_ctx *dev, _In_opt_ WDFREQUEST request, _In_ ULONG NumberOfPackets = 0);
 
+/*
+ * The context is returned to device_ctx::reserve if it is not full.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 void free(_In_opt_ wsk_context *ctx, _In_ bool reuse_irp);
 
+/*
+ * Grow device_ctx::reserve by cnt contexts.
+ * @param isoch the contexts can hold USBIP_MAX_ISO_PACKETS
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS reserve_wsk_contexts(_Inout_ device_ctx &dev, _In_ LONG cnt, _In_ bool isoch);
+
+/*
+ * Shrink device_ctx::reserve by cnt contexts.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void release_wsk_contexts(_Inout_ device_ctx &dev, _In_ LONG cnt, _In_ bool isoch);
+
+/*
+ * Free all contexts of device_ctx::reserve, they must not be used anymore.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_wsk_context_reserve(_Inout_ device_ctx &dev);
+
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
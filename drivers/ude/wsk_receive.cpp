@@ -13,6 +13,7 @@
 #include "network.h"
 #include "driver.h"
 #include "ioctl.h"
+#include "descriptor_cache.h"
 
 #include <libdrv\usbd_helper.h>
 #include <libdrv\dbgcommon.h>
@@ -33,6 +34,23 @@ inline auto& get_wsk_context(_In_ WDFWORKITEM wi)
 	return *WdfObjectGet_PWSK_CONTEXT(wi);
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void free_recv_buf(_Inout_ device_ctx &dev)
+{
+	auto &r = dev.recv_buf;
+
+	if (auto &mdl = r.mdl) {
+		IoFreeMdl(mdl);
+		mdl = nullptr;
+	}
+
+	if (auto &data = r.data) {
+		ExFreePoolWithTag(data, pooltag);
+		data = nullptr;
+	}
+}
+
 _Function_class_(EVT_WDF_OBJECT_CONTEXT_DESTROY)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -45,6 +63,7 @@ PAGED void NTAPI workitem_destroy(_In_ WDFOBJECT Object)
 
 	if (auto ctx = get_wsk_context(wi)) {
 		NT_ASSERT(!ctx->request); // must be completed and zeroed
+		free_recv_buf(*ctx->dev);
 		free(ctx, true);
 	}
 }
@@ -99,6 +118,10 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
  * Buffer from the server has no gaps (compacted), SUM(src->actual_length) == actual_length,
  * src->offset is ignored for that reason.
  *
+ * The payload is received at the beginning of the transfer buffer. If IsoPacket[].Offset-s are contiguous,
+ * this is the layout where every packet is full, so the packets are already in place (fast path). 
+ * Only packets that are short or follow a short packet are moved.
+ *
  * For isochronous packets: actual length is the sum of
  * the actual length of the individual, packets, but as
  * the packet offsets are not changed there will be
@@ -112,7 +135,7 @@ inline auto& get_ret_submit(_In_ const wsk_context &ctx)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_ ULONG length, 
-	_In_ const usbip_iso_packet_descriptor *src)
+	_In_ const usbip_iso_packet_descriptor *src, _Inout_ endpoint_ctx &endp)
 {
 	NT_ASSERT(length <= r.TransferBufferLength);
 	auto dir_out = !buffer;
@@ -133,10 +156,7 @@ auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_
 			continue;
 		}
 
-		if (sd->actual_length > sd->length) {
-			Trace(TRACE_LEVEL_ERROR, "actual_length(%u) > length(%u)", sd->actual_length, sd->length);
-			return STATUS_INVALID_PARAMETER;
-		}
+		NT_ASSERT(sd->actual_length <= sd->length); // @see byteswap_and_validate
 
 		if (sd->offset != dd->Offset) { // buffer is compacted, but offsets are intact
 			Trace(TRACE_LEVEL_ERROR, "src.offset(%u) != dst.Offset(%lu)", sd->offset, dd->Offset);
@@ -163,14 +183,20 @@ auto fill_isoc_data(_Inout_ _URB_ISOCH_TRANSFER &r, _In_opt_ UCHAR *buffer, _In_
 
 		if (dd->Offset > length) {
 			RtlMoveMemory(buffer + dd->Offset, buffer + length, sd->actual_length);
+			++endp.isoch_in.moved;
+			endp.isoch_in.moved_bytes += sd->actual_length;
 		}
 
 		dd->Length = sd->actual_length;
 	}
 
-	if (length && !dir_out) {
+	if (dir_out) {
+		//
+	} else if (length) {
 		Trace(TRACE_LEVEL_ERROR, "SUM(actual_length) != actual_length, delta is %lu", length);
 		return STATUS_INVALID_PARAMETER; 
+	} else {
+		endp.isoch_in.packets += r.NumberOfPackets;
 	}
 
 	return STATUS_SUCCESS;
@@ -198,12 +224,18 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 
 	if (cnt >= 0 && ULONG(cnt) == r.NumberOfPackets) {
 		NT_ASSERT(r.NumberOfPackets == number_of_packets(ctx));
-		byteswap(ctx.isoc, cnt);
 	} else {
 		Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) != NumberOfPackets(%lu)", cnt, r.NumberOfPackets);
 		return STATUS_INVALID_PARAMETER;
 	}
 
+	if (auto i = byteswap_and_validate(ctx.isoc, cnt); i != size_t(cnt)) {
+		auto &d = ctx.isoc[i];
+		Trace(TRACE_LEVEL_ERROR, "isoc[%Iu]: offset %u, length %u, actual_length %u", 
+			                  i, d.offset, d.length, d.actual_length);
+		return STATUS_INVALID_PARAMETER;
+	}
+
 	UCHAR *buffer{};
 
 	if (is_transfer_dir_in(ctx.hdr)) { // TransferFlags can have wrong direction
@@ -215,7 +247,8 @@ auto isoch_transfer(_In_ wsk_context &ctx, _In_ const usbip_header_ret_submit &r
 		NT_ASSERT(length == r.TransferBufferLength);
 	}
 
-	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc);
+	auto &endp = *get_endpoint_ctx(get_request_ctx(ctx.request)->endpoint);
+	return fill_isoc_data(r, buffer, ret.actual_length, ctx.isoc, endp);
 }
 
 _IRQL_requires_same_
@@ -265,13 +298,19 @@ void post_control_transfer(_In_ const _URB_CONTROL_TRANSFER &r, _In_ void *Trans
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-void post_process_transfer_buffer(_In_ const URB &urb, _In_ void *TransferBuffer)
+void post_process_transfer_buffer(
+	_Inout_ wsk_context &ctx, _In_ const URB &urb, _In_ void *TransferBuffer, _In_ ULONG TransferBufferLength)
 {
 	switch (urb.UrbHeader.Function) {
 	case URB_FUNCTION_CONTROL_TRANSFER_EX:
 	case URB_FUNCTION_CONTROL_TRANSFER: // structures are binary compatible, see urbtransfer.cpp
 		static_assert(sizeof(urb.UrbControlTransfer) == sizeof(urb.UrbControlTransferEx));
 		post_control_transfer(urb.UrbControlTransfer, TransferBuffer);
+
+		if (urb.UrbHeader.Status == USBD_STATUS_SUCCESS) {
+			auto &pkt = get_setup_packet(urb.UrbControlTransfer);
+			update_descriptor_cache(*ctx.dev, ctx.request, pkt, TransferBuffer, TransferBufferLength);
+		}
 	}
 }
 
@@ -294,13 +333,13 @@ auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit
 		return st; // URB has no transfer buffer
 	}
 
-	if (TransferBufferLength != ULONG(ret.actual_length)) { // prepare_wsk_mdl can set it
+	if (TransferBufferLength != ULONG(ret.actual_length)) { // prepare_payload can set it
 		st = assign(TransferBufferLength, ret.actual_length); // DIR_OUT or !actual_length
 		UdecxUrbSetBytesCompleted(ctx.request, TransferBufferLength);
 	}
 
 	if (NT_SUCCESS(st) && TransferBufferLength) {
-		post_process_transfer_buffer(urb, TransferBuffer);
+		post_process_transfer_buffer(ctx, urb, TransferBuffer, TransferBufferLength);
 	}
 
 	return st;
@@ -308,6 +347,15 @@ auto ret_submit_urb(_Inout_ wsk_context &ctx, _In_ const usbip_header_ret_submit
 
 enum { RECV_NEXT_USBIP_HDR = STATUS_SUCCESS, RECV_MORE_DATA_REQUIRED = STATUS_PENDING };
 
+enum { 
+	RECV_BUF_SIZE = 64*1024, // @see device_ctx::recv_buf
+	RECV_DIRECT_MIN = PAGE_SIZE, // the rest of the payload is received by separate WskReceive
+	RECV_INLINE_DEPTH = 4, // @see receive_next
+	RECV_INLINE_STACK = KERNEL_STACK_SIZE/2
+};
+
+LONG g_receive_depth[64]; // nested receive_next per CPU, CPUs with the same index modulo size share a slot
+
 _Function_class_(device_ctx::received_fn)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -320,6 +368,7 @@ NTSTATUS ret_submit(_Inout_ wsk_context &ctx)
 		  ret.status ? STATUS_UNSUCCESSFUL : 
 		  STATUS_SUCCESS;
 
+	ctx.mdl_buf.reset(); // unmap and unlock before the request is completed
 	complete_and_set_null(ctx.request, st);
 	return RECV_NEXT_USBIP_HDR;
 }
@@ -331,8 +380,7 @@ auto make_mdl_chain(_In_ wsk_context &ctx)
 	MDL *head{};
 
 	if (!ctx.is_isoc) { // IN
-		head = ctx.mdl_buf.get();
-		NT_ASSERT(!head->Next);
+		head = ctx.mdl_buf.get(); // can be a chain
 	} else if (auto &chain = ctx.mdl_buf) { // isoch IN
 		auto t = tail(chain);
 		t->Next = ctx.mdl_isoc.get();
@@ -351,16 +399,17 @@ auto make_mdl_chain(_In_ wsk_context &ctx)
  * Ensure that URB has TransferBuffer and its size is sufficient.
  * Do others checks when payload will be read.
  * 
- * recv_payload -> prepare_wsk_mdl, there is payload to receive.
+ * IN data is copied through ctx.mdl_buf at DISPATCH_LEVEL, TransferBuffer could be allocated 
+ * from paged pool and TransferBufferMDL can be a chain, @see recv_pdu_handler::on_data.
+ * 
  * Payload layout:
  * a) DIR_IN: any type of transfer, [transfer_buffer] OR|AND [usbip_iso_packet_descriptor...]
  * b) DIR_OUT: ISOCH, <usbip_iso_packet_descriptor...>
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ URB &urb)
+NTSTATUS prepare_payload(_Inout_ wsk_context &ctx, _In_ const URB &urb)
 {
-	mdl = nullptr;
 	auto &ret = get_ret_submit(ctx);
 
 	if (auto err = prepare_isoc(ctx, ret.number_of_packets)) { // sets ctx.is_isoc
@@ -392,40 +441,21 @@ auto prepare_wsk_mdl(_Out_ MDL* &mdl, _Inout_ wsk_context &ctx, _Inout_ URB &urb
 		return STATUS_INVALID_BUFFER_SIZE;
 	}
 
+	NT_ASSERT(!dir_out || ctx.is_isoc);
+
 	if (dir_out) {
-		NT_ASSERT(ctx.is_isoc);
 		NT_ASSERT(!ctx.mdl_buf);
-	} else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, ret.actual_length, IoWriteAccess, urb)) {
+	} else if (auto err = make_transfer_buffer_mdl(ctx.mdl_buf, ret.actual_length, IoWriteAccess, urb)) { // is not mapped
 		Trace(TRACE_LEVEL_ERROR, "make_transfer_buffer_mdl %!STATUS!", err);
 		return err;
 	}
 
-	mdl = make_mdl_chain(ctx);
 	return STATUS_SUCCESS;
 }
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-inline auto alloc_drain_buffer(_Inout_ wsk_context &ctx, _In_ size_t length)
-{  
-	auto &buf = ctx.request;
-	NT_ASSERT(!buf);
-	return buf = (WDFREQUEST)ExAllocatePoolUninitialized(NonPagedPoolNx, length, pooltag); 
-}
-
-_Function_class_(device_ctx::received_fn)
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS free_drain_buffer(_Inout_ wsk_context &ctx)
-{  
-	auto &buf = ctx.request;
-	NT_ASSERT(buf);
-
-	ExFreePoolWithTag(buf, pooltag);
-	buf = WDF_NO_HANDLE;
-
-	return RECV_NEXT_USBIP_HDR;
-};
+void receive_next(_Inout_ wsk_context &ctx);
 
 _Function_class_(IO_COMPLETION_ROUTINE)
 _IRQL_requires_same_
@@ -439,49 +469,52 @@ NTSTATUS receive_complete(
 	auto &ios = wsk_irp->IoStatus;
 	TraceWSK("req %04x, %!STATUS!, Information %Iu", ptr04x(ctx.request), ios.Status, ios.Information);
 
+	++dev.stats.recv_irps;
+
 	auto st = NT_ERROR(ios.Status) ? ios.Status :
-		  ios.Information == dev.receive_size ? dev.received(ctx) :
-		  ios.Information ? STATUS_RECEIVE_PARTIAL : 
-		  STATUS_CONNECTION_DISCONNECTED; // EOF
+		  !ios.Information ? STATUS_CONNECTION_DISCONNECTED : // EOF
+		  ios.Information == dev.receive_size || !dev.receive_size ? dev.received(ctx) :
+		  STATUS_RECEIVE_PARTIAL;
 
 	switch (st) {
 	case RECV_NEXT_USBIP_HDR:
 		if (!dev.unplugged) { // IOCTL_PLUGOUT_HARDWARE set this flag on PASSIVE_LEVEL
-			sched_receive_usbip_header(dev);
+			receive_next(ctx);
 		}
 		[[fallthrough]];
 	case RECV_MORE_DATA_REQUIRED:
 		return StopCompletion;
 	}
 
-	if (dev.received == free_drain_buffer) { // ctx.request is a drain buffer
-		free_drain_buffer(ctx);
-	} else if (auto &req = ctx.request) {
+	if (auto &req = ctx.request) {
 		NT_ASSERT(dev.received != ret_submit); // never fails
+		ctx.mdl_buf.reset();
 		complete_and_set_null(req, st);
 	}
-	NT_ASSERT(!ctx.request);
 
 	if (!dev.unplugged) {
 		auto hdev = get_handle(&dev);
-		TraceDbg("dev %04x, unplugging after %!STATUS!", ptr04x(hdev), st);
-		device::async_plugout_and_delete(hdev);
+		TraceDbg("dev %04x, connection lost %!STATUS!", ptr04x(hdev), st);
+		device::async_resume(hdev);
 	}
 
 	return StopCompletion;
 }
 
 /*
- * @param received will be called if requested number of bytes are received without error
+ * @param received will be called if requested number of bytes are received without error,
+ *        any number of bytes if flags do not have WSK_FLAG_WAITALL
  */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_context &ctx)
+auto receive(
+	_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_context &ctx, 
+	_In_ ULONG flags = WSK_FLAG_WAITALL)
 {
 	auto &dev = *ctx.dev;
 
 	NT_ASSERT(verify(buf, ctx.is_isoc));
-	dev.receive_size = buf.Length; // checked by verify()
+	dev.receive_size = flags & WSK_FLAG_WAITALL ? buf.Length : 0; // checked by verify()
 
 	NT_ASSERT(received);
 	dev.received = received;
@@ -491,7 +524,7 @@ auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_
 
 	IoSetCompletionRoutine(irp, receive_complete, &ctx, true, true, true);
 
-	switch (auto st = receive(dev.sock(), &buf, WSK_FLAG_WAITALL, irp)) {
+	switch (auto st = receive(dev.sock(), &buf, flags, irp)) {
 	case STATUS_PENDING:
 	case STATUS_SUCCESS:
 		TraceWSK("wsk irp %04x, %Iu bytes, %!STATUS!", ptr04x(irp), buf.Length, st);
@@ -506,169 +539,362 @@ auto receive(_In_ WSK_BUF &buf, _In_ device_ctx::received_fn received, _In_ wsk_
 	return RECV_MORE_DATA_REQUIRED;
 }
 
+/*
+ * The rest of the payload that is not in dev.recv_buf is received directly into URB transfer buffer 
+ * and ctx.isoc, prepare_payload was called by recv_pdu_handler::on_header and made ctx.mdl_buf.
+ * 
+ * @param offset of the rest in the payload
+ * @param length of the rest of the payload
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS drain_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t offset, _In_ size_t length)
 {
-	if (ULONG(length) != length) {
-		Trace(TRACE_LEVEL_ERROR, "Buffer size truncation: ULONG(%lu) != size_t(%Iu)", ULONG(length), length);
-		return STATUS_INVALID_PARAMETER;
+	NT_ASSERT(is_transfer_dir_out(ctx.hdr) ? !ctx.mdl_buf : 
+		  !get_ret_submit(ctx).actual_length || ctx.mdl_buf);
+
+	WSK_BUF buf{ .Mdl = make_mdl_chain(ctx), .Offset = ULONG(offset), .Length = length };
+
+	for (ULONG len; buf.Offset >= (len = MmGetMdlByteCount(buf.Mdl)); ) { // WSK_BUF.Offset is applied to the first MDL only
+		NT_ASSERT(buf.Mdl->Next); // ctx.mdl_isoc if offset >= data_len
+		buf.Offset -= len;
+		buf.Mdl = buf.Mdl->Next;
 	}
 
-	if (auto addr = alloc_drain_buffer(ctx, length)) {
-		ctx.mdl_buf = Mdl(addr, ULONG(length));
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Can't allocate %Iu bytes", length);
-		return STATUS_INSUFFICIENT_RESOURCES;
+	return receive(buf, ret_submit, ctx);
+}
+
+/*
+ * Handler for ret_parser, the header is copied to ctx.hdr.
+ * Payload is skipped if the request is not found, it was cancelled (RET_UNLINK will be received) or
+ * the device is unplugged.
+ * 
+ * For RET_UNLINK irp was completed right after CMD_UNLINK was issued.
+ * @see send_cmd_unlink
+ *
+ * USBIP_RET_UNLINK
+ * 1) if UNLINK is successful, status is -ECONNRESET
+ * 2) if USBIP_CMD_UNLINK is after USBIP_RET_SUBMIT status is 0
+ * See: <kernel>/Documentation/usb/usbip_protocol.rst
+ */
+struct recv_pdu_handler
+{
+	device_ctx &dev;
+	wsk_context &ctx;
+	NTSTATUS status; // if on_header returns false
+
+	_IRQL_requires_same_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	bool on_header(_In_ const usbip_header &hdr, _In_ size_t data_len, _In_ size_t payload_size);
+
+	_IRQL_requires_same_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void on_data(_In_ size_t offset, _In_ const void *src, _In_ size_t len)
+	{
+		auto data = dev.recv_pdu.data;
+		if (!data) {
+			dev.stats.drained_bytes += len;
+		} else if (auto err = copy_to_mdl_chain(data, offset, src, len)) {
+			Trace(TRACE_LEVEL_ERROR, "req %04x, copy_to_mdl_chain %!STATUS!", ptr04x(ctx.request), err);
+			dev.recv_pdu.data = nullptr; // the rest is drained
+			ctx.mdl_buf.reset();
+			complete_and_set_null(ctx.request, err);
+		}
 	}
 
-	if (auto err = ctx.mdl_buf.prepare_nonpaged()) {
-		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
-		Trace(TRACE_LEVEL_ERROR, "prepare_nonpaged %!STATUS!", err);
-		free_drain_buffer(ctx);
-		return err;
+	_IRQL_requires_same_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void on_isoc(_In_ size_t offset, _In_ const void *src, _In_ size_t len)
+	{
+		if (ctx.request) {
+			RtlCopyMemory(reinterpret_cast<UCHAR*>(ctx.isoc) + offset, src, len);
+		} else {
+			dev.stats.drained_bytes += len;
+		}
 	}
 
-	WSK_BUF buf{ .Mdl = ctx.mdl_buf.get(), .Length = length };
-	return receive(buf, free_drain_buffer, ctx);
-}
+	_IRQL_requires_same_
+	_IRQL_requires_max_(DISPATCH_LEVEL)
+	void on_end()
+	{
+		if (ctx.request) {
+			ret_submit(ctx);
+		}
+		++dev.stats.recv_pdus;
+	}
+};
 
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS recv_payload(_Inout_ wsk_context &ctx, _In_ size_t length)
+bool recv_pdu_handler::on_header(_In_ const usbip_header &hdr, _In_ size_t data_len, _In_ size_t payload_size)
 {
-	auto &urb = get_urb(ctx.request); // only IOCTL_INTERNAL_USB_SUBMIT_URB has payload
-	WSK_BUF buf{ .Length = length };
+	ctx.hdr = hdr;
+	ctx.mdl_buf.reset(); // of the previous PDU
 
-	if (auto err = prepare_wsk_mdl(buf.Mdl, ctx, urb)) {
-		NT_ASSERT(err != RECV_MORE_DATA_REQUIRED);
-		Trace(TRACE_LEVEL_ERROR, "prepare_wsk_mdl %!STATUS!", err);
-		return err;
+	ctx.request = hdr.base.command == USBIP_RET_SUBMIT ? // request must be completed
+		      device::remove_request(dev, hdr.base.seqnum) : WDF_NO_HANDLE;
+	{
+		char buf[DBG_USBIP_HDR_BUFSZ];
+		TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s",
+			ptr04x(ctx.request), sizeof(hdr) + payload_size, dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
 	}
 
-	return receive(buf, ret_submit, ctx);
+	auto &data = dev.recv_pdu.data;
+	data = nullptr; // skip by default
+
+	if (!(payload_size && ctx.request)) {
+		return true;
+	} else if (dev.unplugged) {
+		TraceDbg("dev %04x is unplugged, skip payload[%Iu]", ptr04x(&dev), payload_size);
+		complete_and_set_null(ctx.request, STATUS_CANCELLED);
+		return true;
+	}
+
+	if (auto err = prepare_payload(ctx, get_urb(ctx.request))) {
+		Trace(TRACE_LEVEL_ERROR, "prepare_payload %!STATUS!", err);
+		status = err;
+		return false;
+	}
+
+	data = ctx.mdl_buf.get(); // NULL if actual_length is zero
+
+	NT_ASSERT(data_len + number_of_packets(ctx)*sizeof(*ctx.isoc) == payload_size);
+	return true;
 }
 
+/*
+ * Copies a contiguous chunk of received data to its destination, PDUs can span chunks.
+ */
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto find_request(_Inout_ device_ctx &dev, _In_ seqnum_t seqnum)
+NTSTATUS recv_pdu_chunk(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const UCHAR *src, _In_ size_t len)
 {
-	auto req = device::remove_egress_request(dev, seqnum); // most of the time it's still there
-	if (!req) {
-		req = device::dequeue_request(dev, seqnum); // could be cancelled on queue
+	recv_pdu_handler h{ .dev = dev, .ctx = ctx };
+
+	switch (auto res = dev.recv_pdu.parser.feed(h, src, len)) {
+	case parse_result::ok:
+		return STATUS_SUCCESS;
+	case parse_result::aborted:
+		return h.status;
+	default:
+		Trace(TRACE_LEVEL_ERROR, "dev %04x, %s", ptr04x(&dev), to_string(res));
+		return STATUS_INVALID_PARAMETER;
 	}
-	return req;
 }
 
 /*
- * For RET_UNLINK irp was completed right after CMD_UNLINK was issued.
- * @see send_cmd_unlink
+ * All PDUs that are in dev.recv_buf are processed at once, so one WskReceive completes many small URBs.
+ * 
+ * If the last PDU is incomplete and the rest of its payload is large, the rest is received by separate
+ * WskReceive directly into its destination (zero-copy). Otherwise the PDU will be continued 
+ * by the next receive into dev.recv_buf.
  *
- * USBIP_RET_UNLINK
- * 1) if UNLINK is successful, status is -ECONNRESET
- * 2) if USBIP_CMD_UNLINK is after USBIP_RET_SUBMIT status is 0
- * See: <kernel>/Documentation/usb/usbip_protocol.rst
+ * Payload that must be skipped is always received into dev.recv_buf and discarded, 
+ * so draining does not allocate memory whatever its length is.
  */
 _Function_class_(device_ctx::received_fn)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS ret_command(_Inout_ wsk_context &ctx)
+NTSTATUS recv_buf_received(_Inout_ wsk_context &ctx)
 {
-	auto &hdr = ctx.hdr;
+	auto &dev = *ctx.dev;
+	auto len = ctx.wsk_irp->IoStatus.Information;
 
-	ctx.request = hdr.base.command == USBIP_RET_SUBMIT ? // request must be completed
-		      find_request(*ctx.dev, hdr.base.seqnum) : WDF_NO_HANDLE;
+	if (auto err = recv_pdu_chunk(dev, ctx, dev.recv_buf.data, len)) {
+		return err;
+	}
 
-	{
-		char buf[DBG_USBIP_HDR_BUFSZ];
-		TraceEvents(TRACE_LEVEL_VERBOSE, FLAG_USBIP, "req %04x <- %Iu%s",
-			ptr04x(ctx.request), get_total_size(hdr), dbg_usbip_hdr(buf, sizeof(buf), &hdr, false));
+	auto &p = dev.recv_pdu.parser;
+	if (dev.unplugged || !(p.has_header() && ctx.request) || p.remaining() < RECV_DIRECT_MIN) {
+		return RECV_NEXT_USBIP_HDR;
 	}
 
-	if (auto sz = get_payload_size(hdr); sz && !ctx.dev->unplugged) {
-		auto f = ctx.request ? recv_payload : drain_payload;
-		return f(ctx, sz);
-	} else if (!ctx.request) {
-		//
-	} else if (!sz) [[likely]] {
-		ret_submit(ctx);
-	} else {
-		TraceDbg("dev %04x is unplugged, skip payload[%Iu]", ptr04x(ctx.dev), sz);
-		complete_and_set_null(ctx.request, STATUS_CANCELLED);
+	auto offset = p.offset() - p.hdr_size; // in the payload
+	auto length = p.remaining();
+
+	p.reset(); // will be completed by receive_complete
+	++dev.stats.recv_pdus;
+
+	return recv_payload(ctx, offset, length);
+}
+
+/*
+ * WskReceive without WSK_FLAG_WAITALL completes as soon as any data is available.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void receive_recv_buf(_Inout_ wsk_context &ctx)
+{
+	auto &dev = *ctx.dev;
+
+	NT_ASSERT(!ctx.request || dev.recv_pdu.parser.has_header()); // payload is continued
+	if (!ctx.request) {
+		ctx.mdl_buf.reset(); // otherwise it receives the rest of the data, @see recv_pdu_handler::on_data
 	}
 
-	return RECV_NEXT_USBIP_HDR;
+	WSK_BUF buf{ .Mdl = dev.recv_buf.mdl, .Length = RECV_BUF_SIZE };
+	receive(buf, recv_buf_received, ctx, 0);
 }
 
+_Function_class_(EVT_WDF_WORKITEM)
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-auto validate_header(_Inout_ usbip_header &hdr)
+void NTAPI receive_usbip_header(_In_ WDFWORKITEM WorkItem)
 {
-	byteswap_header(hdr, swap_dir::net2host);
+	receive_recv_buf(*get_wsk_context(WorkItem));
+}
 
-	auto &base = hdr.base;
-	auto cmd = static_cast<usbip_request_type>(base.command);
+/*
+ * A WSK application should not call new WSK functions in the context of the IoCompletion routine. 
+ * Doing so may result in recursive calls and exhaust the kernel mode stack. 
+ * When executing at IRQL = DISPATCH_LEVEL, this can also lead to starvation of other threads.
+ *
+ * The recursion happens if WskReceive completes synchronously. The number of nested calls on a CPU 
+ * and the remaining stack are checked, the workitem is used if they are beyond the limits.
+ * Reading of payload does not use the workitem and it's OK.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void receive_next(_Inout_ wsk_context &ctx)
+{
+	auto &dev = *ctx.dev;
+
+	if (dev.ext->inline_receive) {
+		KIRQL irql;
+		KeRaiseIrql(DISPATCH_LEVEL, &irql); // stay on this CPU
 
-	switch (cmd) {
-	case USBIP_RET_SUBMIT: {
-		auto &ret = hdr.u.ret_submit;
-		if (ret.number_of_packets == number_of_packets_non_isoch) {
-			ret.number_of_packets = 0;
-		} else if (!is_valid_number_of_packets(ret.number_of_packets)) {
-			Trace(TRACE_LEVEL_ERROR, "number_of_packets(%d) is out of range", ret.number_of_packets);
-			return false;
+		auto &depth = g_receive_depth[KeGetCurrentProcessorIndex() % ARRAYSIZE(g_receive_depth)];
+
+		auto ok = InterlockedIncrement(&depth) <= RECV_INLINE_DEPTH && 
+			  IoGetRemainingStackSize() >= RECV_INLINE_STACK;
+
+		if (ok) {
+			++dev.stats.recv_inline;
+			receive_recv_buf(ctx); // do not access ctx and dev after that
+		}
+
+		InterlockedDecrement(&depth);
+		KeLowerIrql(irql);
+
+		if (ok) {
+			return;
 		}
-	}	break;
-	case USBIP_RET_UNLINK:
-		break;
-	default:
-		Trace(TRACE_LEVEL_ERROR, "USBIP_RET_* expected, got %!usbip_request_type!", cmd);
-		return false;
 	}
 
-	auto ok = is_valid_seqnum(base.seqnum);
+	++dev.stats.recv_hops;
+	sched_receive_usbip_header(dev);
+}
 
-	if (ok) {
-		base.direction = extract_dir(base.seqnum); // always zero in server response
-	} else {
-		Trace(TRACE_LEVEL_ERROR, "Invalid seqnum %u", base.seqnum);
+/*
+ * WSK_BUF.Offset is applied to the first MDL only.
+ */
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+auto recv_event_buf(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ const WSK_BUF &buf)
+{
+	auto offset = buf.Offset;
+	auto length = buf.Length;
+
+	for (auto mdl = buf.Mdl; mdl && length; mdl = mdl->Next, offset = 0) {
+
+		auto sz = MmGetMdlByteCount(mdl);
+		NT_ASSERT(offset < sz);
+
+		auto va = (UCHAR*)MmGetSystemAddressForMdlSafe(mdl, NormalPagePriority | MdlMappingNoExecute);
+		if (!va) {
+			Trace(TRACE_LEVEL_ERROR, "MmGetSystemAddressForMdlSafe error");
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		auto cnt = min(sz - offset, length);
+
+		if (auto err = recv_pdu_chunk(dev, ctx, va + offset, cnt)) {
+			return err;
+		}
+
+		length -= cnt;
 	}
 
-	return ok;
+	return length ? STATUS_INVALID_BUFFER_SIZE : STATUS_SUCCESS;
 }
 
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+void recv_event_failed(_Inout_ device_ctx &dev, _Inout_ wsk_context &ctx, _In_ NTSTATUS status)
+{
+	dev.recv_pdu.failed = true;
+
+	if (auto &req = ctx.request) {
+		ctx.mdl_buf.reset();
+		complete_and_set_null(req, status);
+	}
+
+	if (!dev.unplugged) {
+		auto hdev = get_handle(&dev);
+		TraceDbg("dev %04x, connection lost %!STATUS!", ptr04x(hdev), status);
+		device::async_resume(hdev);
+	}
+}
 
 /*
- * A WSK application should not call new WSK functions in the context of the IoCompletion routine. 
- * Doing so may result in recursive calls and exhaust the kernel mode stack. 
- * When executing at IRQL = DISPATCH_LEVEL, this can also lead to starvation of other threads.
- *
- * For this reason work queue is used here, but reading of payload does not use it and it's OK.
+ * Data is copied to usbip_header, URB transfer buffer and usbip_iso_packet_descriptor[]
+ * as it arrives, incomplete PDU is continued on the next indication. Indications are never retained,
+ * so WSK_FLAG_RELEASE_ASAP is always satisfied and WskRelease is not required.
+ * 
+ * Callbacks for a connection-oriented socket are not called concurrently, data is indicated in order.
+ * DataIndication is NULL if the socket is no longer functional. 
  */
-_Function_class_(EVT_WDF_WORKITEM)
+_Function_class_(PFN_WSK_RECEIVE_EVENT)
 _IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL) // do not define as PAGED, lambda "received" must be resident
-void NTAPI receive_usbip_header(_In_ WDFWORKITEM WorkItem)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI receive_event(
+	_In_opt_ void *SocketContext, _In_ ULONG Flags, 
+	_In_opt_ WSK_DATA_INDICATION *DataIndication, _In_ SIZE_T BytesIndicated, _Inout_ SIZE_T*)
 {
-	auto &ctx = *get_wsk_context(WorkItem);
+	auto &ext = *static_cast<device_ctx_ext*>(SocketContext);
+	auto &dev = *ext.ctx; // receive events are enabled after device::create
+	auto &ctx = *get_wsk_context(dev.recv_hdr);
 
-	NT_ASSERT(!ctx.request); // must be completed and zeroed on every cycle
-	ctx.mdl_buf.reset();
+	{
+		char buf[wsk::RECEIVE_EVENT_FLAGS_BUFBZ];
+		TraceWSK("dev %04x, BytesIndicated %Iu%s", ptr04x(&dev), BytesIndicated, 
+			  wsk::ReceiveEventFlags(buf, sizeof(buf), Flags));
+	}
 
-	ctx.mdl_hdr.next(nullptr);
-	WSK_BUF buf{ .Mdl = ctx.mdl_hdr.get(), .Length = sizeof(ctx.hdr) };
+	if (!DataIndication) {
+		recv_event_failed(dev, ctx, STATUS_CONNECTION_DISCONNECTED);
+	} else if (dev.recv_pdu.failed || dev.unplugged) {
+		// discard
+	} else for (auto di = DataIndication; di; di = di->Next) {
+		if (auto err = recv_event_buf(dev, ctx, di->Buffer)) {
+			recv_event_failed(dev, ctx, err);
+			break;
+		}
+	}
 
-	auto received = [] (auto &ctx) // inherits PAGED from the function, can be called on DISPATCH_LEVEL
-	{
-		return validate_header(ctx.hdr) ? ret_command(ctx) : STATUS_INVALID_PARAMETER;
-	};
+	return STATUS_SUCCESS;
+}
+
+_Function_class_(PFN_WSK_DISCONNECT_EVENT)
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS WSKAPI disconnect_event(_In_opt_ void *SocketContext, _In_ ULONG Flags)
+{
+	auto &ext = *static_cast<device_ctx_ext*>(SocketContext);
+	auto &dev = *ext.ctx;
+
+	TraceDbg("dev %04x, %s disconnect", ptr04x(&dev), Flags & WSK_FLAG_ABORTIVE ? "abortive" : "graceful");
 
-	receive(buf, received, ctx);
+	recv_event_failed(dev, *get_wsk_context(dev.recv_hdr), STATUS_CONNECTION_DISCONNECTED);
+	return STATUS_SUCCESS;
 }
 
 } // namespace
 
 
+const WSK_CLIENT_CONNECTION_DISPATCH usbip::receive_events_dispatch { receive_event, disconnect_event };
+
+
 /* 
  * UrbHeader.Status must be set before this call.
  */
@@ -735,8 +961,73 @@ PAGED NTSTATUS usbip::init_receive_usbip_header(_In_ device_ctx &ctx)
 
 	if (auto ptr = alloc_wsk_context(&ctx, WDF_NO_HANDLE)) {
 		get_wsk_context(ctx.recv_hdr) = ptr;
-		return STATUS_SUCCESS;
+	} else {
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	auto &r = ctx.recv_buf;
+
+	r.data = (UCHAR*)ExAllocatePoolUninitialized(NonPagedPoolNx, RECV_BUF_SIZE, pooltag);
+	if (!r.data) {
+		Trace(TRACE_LEVEL_ERROR, "Can't allocate %d bytes", RECV_BUF_SIZE);
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
-	return STATUS_INSUFFICIENT_RESOURCES;
+	r.mdl = IoAllocateMdl(r.data, RECV_BUF_SIZE, false, false, nullptr);
+	if (!r.mdl) {
+		Trace(TRACE_LEVEL_ERROR, "IoAllocateMdl error");
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	MmBuildMdlForNonPagedPool(r.mdl);
+	return STATUS_SUCCESS;
+}
+
+/*
+ * Default is the workitem that issues WskReceive into device_ctx::recv_buf.
+ * It is used if receive events can't be enabled.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::start_receive(_Inout_ device_ctx &dev)
+{
+	PAGED_CODE();
+	auto &ext = *dev.ext;
+
+	dev.recv_pdu.parser.reset();
+	dev.recv_pdu.failed = false;
+
+	if (ext.receive_events) {
+		if (auto err = wsk::event_callback_control(ext.sock, WSK_EVENT_RECEIVE | WSK_EVENT_DISCONNECT, false)) {
+			Trace(TRACE_LEVEL_ERROR, "dev %04x, event_callback_control %!STATUS!", ptr04x(&dev), err);
+			ext.receive_events = false;
+		} else {
+			TraceDbg("dev %04x, receive events enabled", ptr04x(&dev));
+			return;
+		}
+	}
+
+	sched_receive_usbip_header(dev);
+}
+
+/*
+ * Wait for the callbacks that are in progress.
+ * Only one event can be disabled per call.
+ */
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void usbip::stop_receive_events(_Inout_ device_ctx &dev)
+{
+	PAGED_CODE();
+	auto &ext = *dev.ext;
+
+	if (!(ext.receive_events && ext.sock)) {
+		return;
+	}
+
+	for (auto event: {WSK_EVENT_RECEIVE, WSK_EVENT_DISCONNECT}) {
+		if (auto err = wsk::event_callback_control(ext.sock, WSK_EVENT_DISABLE | event, true)) {
+			Trace(TRACE_LEVEL_ERROR, "dev %04x, disable event %#x, %!STATUS!", ptr04x(&dev), event, err);
+		}
+	}
 }
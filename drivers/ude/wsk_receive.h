@@ -7,6 +7,8 @@
 #include <libdrv\codeseg.h>
 #include <libdrv/wdf_cpp.h>
 
+#include <wsk.h>
+
 namespace usbip
 {
 
@@ -30,4 +32,17 @@ _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 PAGED NTSTATUS init_receive_usbip_header(_In_ device_ctx &ctx);
 
+/*
+ * Pass to WskSocket if device_ctx_ext::receive_events is set.
+ */
+extern const WSK_CLIENT_CONNECTION_DISPATCH receive_events_dispatch;
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void start_receive(_Inout_ device_ctx &dev);
+
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+PAGED void stop_receive_events(_Inout_ device_ctx &dev);
+
 } // namespace usbip
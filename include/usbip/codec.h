@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "proto.h"
+#include "proto_op.h"
+
+#include <stddef.h>
+
+/*
+ * Each wire structure is described once by the list of its fields,
+ * converters between host and network byte order and size checks are generated by the compiler.
+ *
+ * Does not depend on WDK/Windows headers and can be compiled in user mode on any OS.
+ */
+namespace usbip::wire
+{
+
+template<auto... Fields>
+struct field_list {};
+
+/*
+ * Specialize for each wire structure, all fields must be listed.
+ * using type = field_list<&T::first, ..., &T::last>;
+ */
+template<typename T>
+struct describe;
+
+constexpr UINT16 byteswap16(UINT16 v)
+{
+        return UINT16((v >> 8) | (v << 8));
+}
+
+constexpr UINT32 byteswap32(UINT32 v)
+{
+        return (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF'0000) | (v << 24); // compilers emit bswap
+}
+
+constexpr void swap_field(char&) {}
+constexpr void swap_field(UINT8&) {}
+constexpr void swap_field(UINT16 &v) { v = byteswap16(v); }
+constexpr void swap_field(UINT32 &v) { v = byteswap32(v); }
+constexpr void swap_field(INT32 &v) { v = INT32(byteswap32(UINT32(v))); }
+
+template<typename T, size_t N>
+constexpr void swap_field(T (&a)[N])
+{
+        for (auto &v: a) {
+                swap_field(v);
+        }
+}
+
+template<typename T>
+constexpr void swap_field(T &s); // nested wire structure
+
+template<typename T, auto... Fields>
+constexpr void swap_fields(T &s, field_list<Fields...>)
+{
+        (swap_field(s.*Fields), ...);
+}
+
+template<typename T>
+constexpr void swap_field(T &s)
+{
+        swap_fields(s, typename describe<T>::type{});
+}
+
+/*
+ * Host to network and network to host byte order, the conversion is symmetric.
+ */
+template<typename T>
+constexpr void byteswap(T &s)
+{
+        swap_fields(s, typename describe<T>::type{});
+}
+
+template<typename T, auto... Fields>
+constexpr auto wire_size(field_list<Fields...>)
+{
+        return (sizeof(static_cast<T*>(nullptr)->*Fields) + ... + 0);
+}
+
+/*
+ * All bytes of the structure are covered by the fields, none is forgotten.
+ */
+template<typename T>
+constexpr auto is_described()
+{
+        return wire_size<T>(typename describe<T>::type{}) == sizeof(T);
+}
+
+#define USBIP_WIRE_DESCRIBE(T, ...) \
+        template<> struct describe<T> { using type = field_list<__VA_ARGS__>; }; \
+        static_assert(is_described<T>(), #T " has undescribed fields")
+
+// proto.h
+
+USBIP_WIRE_DESCRIBE(usbip_header_basic,
+        &usbip_header_basic::command, &usbip_header_basic::seqnum, &usbip_header_basic::devid,
+        &usbip_header_basic::direction, &usbip_header_basic::ep);
+
+USBIP_WIRE_DESCRIBE(usbip_header_cmd_submit,
+        &usbip_header_cmd_submit::transfer_flags, &usbip_header_cmd_submit::transfer_buffer_length,
+        &usbip_header_cmd_submit::start_frame, &usbip_header_cmd_submit::number_of_packets,
+        &usbip_header_cmd_submit::interval, &usbip_header_cmd_submit::setup);
+
+USBIP_WIRE_DESCRIBE(usbip_header_ret_submit,
+        &usbip_header_ret_submit::status, &usbip_header_ret_submit::actual_length,
+        &usbip_header_ret_submit::start_frame, &usbip_header_ret_submit::number_of_packets,
+        &usbip_header_ret_submit::error_count);
+
+USBIP_WIRE_DESCRIBE(usbip_header_cmd_unlink, &usbip_header_cmd_unlink::seqnum);
+USBIP_WIRE_DESCRIBE(usbip_header_ret_unlink, &usbip_header_ret_unlink::status);
+
+USBIP_WIRE_DESCRIBE(usbip_iso_packet_descriptor,
+        &usbip_iso_packet_descriptor::offset, &usbip_iso_packet_descriptor::length,
+        &usbip_iso_packet_descriptor::actual_length, &usbip_iso_packet_descriptor::status);
+
+// proto_op.h
+
+USBIP_WIRE_DESCRIBE(usbip_usb_interface,
+        &usbip_usb_interface::bInterfaceClass, &usbip_usb_interface::bInterfaceSubClass,
+        &usbip_usb_interface::bInterfaceProtocol, &usbip_usb_interface::padding);
+
+USBIP_WIRE_DESCRIBE(usbip_usb_device,
+        &usbip_usb_device::path, &usbip_usb_device::busid,
+        &usbip_usb_device::busnum, &usbip_usb_device::devnum, &usbip_usb_device::speed,
+        &usbip_usb_device::idVendor, &usbip_usb_device::idProduct, &usbip_usb_device::bcdDevice,
+        &usbip_usb_device::bDeviceClass, &usbip_usb_device::bDeviceSubClass, &usbip_usb_device::bDeviceProtocol,
+        &usbip_usb_device::bConfigurationValue, &usbip_usb_device::bNumConfigurations,
+        &usbip_usb_device::bNumInterfaces);
+
+USBIP_WIRE_DESCRIBE(op_common, &op_common::version, &op_common::code, &op_common::status);
+
+USBIP_WIRE_DESCRIBE(op_import_request, &op_import_request::busid);
+USBIP_WIRE_DESCRIBE(op_import_reply, &op_import_reply::udev);
+
+USBIP_WIRE_DESCRIBE(op_export_request, &op_export_request::udev);
+USBIP_WIRE_DESCRIBE(op_export_reply, &op_export_reply::returncode);
+
+USBIP_WIRE_DESCRIBE(op_unexport_request, &op_unexport_request::udev);
+USBIP_WIRE_DESCRIBE(op_unexport_reply, &op_unexport_reply::returncode);
+
+USBIP_WIRE_DESCRIBE(op_crypkey_request, &op_crypkey_request::key);
+USBIP_WIRE_DESCRIBE(op_crypkey_reply, &op_crypkey_reply::_reserved);
+
+USBIP_WIRE_DESCRIBE(op_devlist_request, &op_devlist_request::_reserved);
+USBIP_WIRE_DESCRIBE(op_devlist_reply, &op_devlist_reply::ndev);
+USBIP_WIRE_DESCRIBE(op_devlist_reply_extra, &op_devlist_reply_extra::udev);
+
+#undef USBIP_WIRE_DESCRIBE
+
+} // namespace usbip::wire
@@ -6,6 +6,15 @@ namespace usbip
 constexpr auto &tcp_port = "3240";
 constexpr auto &driver_filename = L"usbip2_ude"; // used by filter driver
 constexpr auto &persistent_devices_value_name = L"PersistentDevices";
+constexpr auto &persistent_workers_value_name = L"PersistentWorkers"; // REG_DWORD, persistent devices that are attached concurrently
+constexpr auto &persistent_host_workers_value_name = L"PersistentHostWorkers"; // REG_DWORD, the same for one server
+constexpr auto &receive_events_value_name = L"ReceiveEvents"; // REG_DWORD, for devices that will be attached
+constexpr auto &inline_receive_value_name = L"InlineReceive"; // REG_DWORD, for devices that will be attached
+constexpr auto &send_coalescing_value_name = L"SendCoalescing"; // REG_DWORD, for devices that will be attached
+constexpr auto &inline_out_max_value_name = L"InlineOutMax"; // REG_DWORD, bytes, zero disables, for devices that will be attached
+constexpr auto &prefetch_descriptors_value_name = L"PrefetchDescriptors"; // REG_DWORD, for devices that will be attached
+constexpr auto &resume_timeout_value_name = L"ResumeTimeout"; // REG_DWORD, seconds, zero disables, for devices that will be attached
+constexpr auto &addrinfo_ttl_value_name = L"AddrInfoTtl"; // REG_DWORD, seconds, zero disables, is read when the driver loads
 
 enum op_status_t // op_common.status
 {
@@ -1,6 +1,17 @@
 #pragma once
 
-#include <basetsd.h>
+/*
+ * Can be compiled on any OS, @see ret_parser.h, codec.h
+ */
+#ifdef _WIN32
+  #include <basetsd.h>
+#else
+  #include <stdint.h>
+  typedef int32_t INT32;
+  typedef uint32_t UINT32;
+  typedef uint16_t UINT16;
+  typedef uint8_t UINT8;
+#endif
 
 /*
  * Declarations from <drivers/usb/usbip/usbip_common.h>
@@ -26,7 +37,7 @@ inline bool is_valid_number_of_packets(int number_of_packets)
 
 typedef UINT32 seqnum_t;
 
-#include <PSHPACK1.H>
+#pragma pack(push, 1)
 
 /*
  * USB/IP request headers.
@@ -139,4 +150,4 @@ struct usbip_iso_packet_descriptor {
 	UINT32	status;
 };
 
-#include <POPPACK.H>
+#pragma pack(pop)
@@ -1,9 +1,13 @@
 #pragma once
 
 #include "consts.h"
-#include <basetsd.h>
+#include "proto.h" // INT32, UINT32, UINT16, UINT8
 
-#include <PSHPACK1.H>
+/*
+ * Can be compiled on any OS, byte order converters are in codec.h
+ */
+
+#pragma pack(push, 1)
 
 struct usbip_usb_interface 
 {
@@ -49,12 +53,6 @@ struct op_common {
         UINT32 status; // op_status_t, for reply
 };
 
-#define PACK_OP_COMMON(pack, op_common)  do {\
-	usbip_net_pack_uint16_t(pack, &(op_common)->version);\
-	usbip_net_pack_uint16_t(pack, &(op_common)->code);\
-	usbip_net_pack_uint32_t(pack, &(op_common)->status);\
-} while (0)
-
 /* ---------------------------------------------------------------------- */
 /* Dummy Code */
 #define OP_UNSPEC	0x00
@@ -82,13 +80,6 @@ struct op_import_reply {
 //	struct usbip_usb_interface uinf[];
 };
 
-#define PACK_OP_IMPORT_REQUEST(pack, request)  do {\
-} while (0)
-
-#define PACK_OP_IMPORT_REPLY(pack, reply)  do {\
-	usbip_net_pack_usb_device(pack, &(reply)->udev);\
-} while (0)
-
 /* ---------------------------------------------------------------------- */
 /* Export a USB device to a remote host. */
 #define OP_EXPORT	0x06
@@ -104,13 +95,6 @@ struct op_export_reply {
 };
 
 
-#define PACK_OP_EXPORT_REQUEST(pack, request)  do {\
-	pack_usb_device(pack, &(request)->udev);\
-} while (0)
-
-#define PACK_OP_EXPORT_REPLY(pack, reply)  do {\
-} while (0)
-
 /* ---------------------------------------------------------------------- */
 /* un-Export a USB device from a remote host. */
 #define OP_UNEXPORT	0x07
@@ -125,13 +109,6 @@ struct op_unexport_reply {
         int returncode;
 };
 
-#define PACK_OP_UNEXPORT_REQUEST(pack, request)  do {\
-	pack_usb_device(pack, &(request)->udev);\
-} while (0)
-
-#define PACK_OP_UNEXPORT_REPLY(pack, reply)  do {\
-} while (0)
-
 /* ---------------------------------------------------------------------- */
 /* Negotiate IPSec encryption key. (still not used) */
 #define OP_CRYPKEY	0x04
@@ -169,16 +146,4 @@ struct op_devlist_reply_extra {
 //	usbip_usb_interface uinf[];
 };
 
-#define PACK_OP_DEVLIST_REQUEST(pack, request)  do {\
-} while (0)
-
-#define PACK_OP_DEVLIST_REPLY(pack, reply)  do {\
-	usbip_net_pack_uint32_t(pack, &(reply)->ndev);	\
-} while (0)
-
-#include <POPPACK.H>
-
-void usbip_net_pack_uint32_t(int pack, UINT32 *num);
-void usbip_net_pack_uint16_t(int pack, UINT16 *num);
-void usbip_net_pack_usb_device(int pack, struct usbip_usb_device *udev);
-void usbip_net_pack_usb_interface(int pack, struct usbip_usb_interface *uinf);
+#pragma pack(pop)
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include "codec.h"
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Does not depend on WDK/Windows headers and can be compiled in user mode on any OS.
+ */
+namespace usbip
+{
+
+enum class parse_result
+{
+        ok,
+        aborted, // by Handler::on_header
+        bad_command,
+        bad_seqnum,
+        bad_number_of_packets,
+        bad_actual_length
+};
+
+constexpr auto to_string(parse_result r)
+{
+        switch (r) {
+        case parse_result::ok:
+                return "ok";
+        case parse_result::aborted:
+                return "aborted";
+        case parse_result::bad_command:
+                return "USBIP_RET_* expected";
+        case parse_result::bad_seqnum:
+                return "invalid seqnum";
+        case parse_result::bad_number_of_packets:
+                return "number_of_packets is out of range";
+        case parse_result::bad_actual_length:
+                return "negative actual_length";
+        }
+
+        return "?";
+}
+
+/*
+ * Incremental (push) parser of the stream of server's responses: USBIP_RET_SUBMIT, USBIP_RET_UNLINK.
+ * Accepts chunks of any size, the state is kept between the calls. Does not allocate memory.
+ * A zero-initialized object is ready for use.
+ *
+ * PDU layout: usbip_header, data (transfer buffer), usbip_iso_packet_descriptor[].
+ *
+ * Handler must have these member functions:
+ * bool on_header(const usbip_header &hdr, size_t data_len, size_t payload_size)
+ *      hdr is in host byte order, validated, base.direction is set from seqnum;
+ *      return false to stop parsing, feed() will return parse_result::aborted.
+ * void on_data(size_t offset, const void *src, size_t len)
+ *      next span of the data, offset is in the data.
+ * void on_isoc(size_t offset, const void *src, size_t len)
+ *      next span of usbip_iso_packet_descriptor[] in network byte order, offset is in the array.
+ * void on_end()
+ *      the PDU is complete, the next byte starts the next PDU.
+ */
+class ret_parser
+{
+public:
+        static constexpr size_t hdr_size = sizeof(usbip_header);
+
+        void reset() { m_offset = 0; }
+
+        auto& header() const { return m_hdr; } // valid if has_header()
+        bool has_header() const { return m_offset >= hdr_size; } // of the current PDU
+
+        auto offset() const { return m_offset; } // in the current PDU
+        auto total() const { return has_header() ? m_total : hdr_size; } // size of the current PDU
+        auto remaining() const { return total() - m_offset; }
+
+        template<typename Handler>
+        parse_result feed(Handler &h, const void *buf, size_t len);
+
+private:
+        usbip_header m_hdr;
+        size_t m_offset;
+        size_t m_total; // valid if has_header()
+        size_t m_data_len;
+
+        static constexpr auto at_most(size_t a, size_t b) { return a < b ? a : b; } // min() can be a macro
+        parse_result parse_header();
+};
+
+/*
+ * Server's responses always have zeroes in usbip_header_basic's devid, direction, ep.
+ * Direction is restored from seqnum, its least significant bit is usbip_dir.
+ */
+inline parse_result ret_parser::parse_header()
+{
+        auto &h = m_hdr;
+        auto &base = h.base;
+
+        wire::byteswap(base);
+
+        m_data_len = 0;
+        size_t isoc_cnt = 0;
+
+        switch (base.command) {
+        case USBIP_RET_SUBMIT: {
+                auto &r = h.u.ret_submit;
+                wire::byteswap(r);
+
+                if (r.number_of_packets == number_of_packets_non_isoch) {
+                        r.number_of_packets = 0;
+                } else if (!is_valid_number_of_packets(r.number_of_packets)) {
+                        return parse_result::bad_number_of_packets;
+                }
+                isoc_cnt = r.number_of_packets;
+
+                if (base.seqnum & USBIP_DIR_IN) {
+                        if (r.actual_length < 0) {
+                                return parse_result::bad_actual_length;
+                        }
+                        m_data_len = r.actual_length;
+                }
+        }       break;
+        case USBIP_RET_UNLINK:
+                wire::byteswap(h.u.ret_unlink);
+                break;
+        default:
+                return parse_result::bad_command;
+        }
+
+        if (!(base.seqnum >> 1)) {
+                return parse_result::bad_seqnum;
+        }
+
+        base.direction = base.seqnum & 1;
+        m_total = hdr_size + m_data_len + isoc_cnt*sizeof(usbip_iso_packet_descriptor);
+
+        return parse_result::ok;
+}
+
+template<typename Handler>
+parse_result ret_parser::feed(Handler &h, const void *buf, size_t len)
+{
+        for (auto src = static_cast<const UINT8*>(buf); len; ) {
+
+                size_t cnt{};
+
+                if (m_offset < hdr_size) {
+                        cnt = at_most(len, hdr_size - m_offset);
+                        memcpy(reinterpret_cast<UINT8*>(&m_hdr) + m_offset, src, cnt);
+                } else if (auto off = m_offset - hdr_size; off < m_data_len) {
+                        cnt = at_most(len, m_data_len - off);
+                        h.on_data(off, src, cnt);
+                } else {
+                        cnt = at_most(len, m_total - m_offset);
+                        h.on_isoc(off - m_data_len, src, cnt);
+                }
+
+                src += cnt;
+                len -= cnt;
+                m_offset += cnt;
+
+                if (m_offset != hdr_size) {
+                        //
+                } else if (auto err = parse_header(); err != parse_result::ok) {
+                        m_offset = 0;
+                        return err;
+                } else if (!h.on_header(m_hdr, m_data_len, m_total - hdr_size)) {
+                        return parse_result::aborted;
+                }
+
+                if (has_header() && m_offset == m_total) {
+                        m_offset = 0;
+                        h.on_end();
+                }
+        }
+
+        return parse_result::ok;
+}
+
+} // namespace usbip
@@ -64,6 +64,14 @@ struct device_state : base, imported_device
         state state;
 };
 
+/*
+ * IRP_MJ_READ returns it if the buffer is large enough, device_state otherwise, base::size tells which one.
+ */
+struct device_state_ex : device_state
+{
+        UINT64 timestamp; // KeQueryInterruptTime when the state was changed, 100-nanosecond units
+};
+
 } // namespace usbip::vhci
 
 
@@ -75,6 +83,8 @@ enum class function { // 12 bit
         plugout_hardware, 
         get_imported_devices,
         driver_registry_path,
+        get_statistics,
+        plugin_hardware_batch,
 };
 
 constexpr auto make(function id)
@@ -88,10 +98,32 @@ enum {
         PLUGOUT_HARDWARE     = make(function::plugout_hardware),
         GET_IMPORTED_DEVICES = make(function::get_imported_devices),
         DRIVER_REGISTRY_PATH = make(function::driver_registry_path),
+        GET_STATISTICS       = make(function::get_statistics),
+        PLUGIN_HARDWARE_BATCH = make(function::plugin_hardware_batch),
 };
 
 struct plugin_hardware : base, imported_device_location {};
 
+struct plugin_hardware_entry : imported_device_location
+{
+        ULONG status; // OUT, USBIP_ERROR_*, zero if the device is attached
+};
+
+/*
+ * Devices are attached concurrently, the same buffer is returned.
+ * The count can exceed the number of ports, USBIP_ERROR_PORTFULL is set for the extra devices.
+ */
+struct plugin_hardware_batch : base
+{
+        ULONG count; // IN, number of devices
+        plugin_hardware_entry devices[ANYSIZE_ARRAY];
+};
+
+constexpr auto plugin_hardware_batch_size(_In_ ULONG n)
+{
+        return offsetof(plugin_hardware_batch, devices) + n*sizeof(*plugin_hardware_batch::devices);
+}
+
 struct plugout_hardware : base
 {
         int port; // all ports if <= 0
@@ -116,4 +148,33 @@ struct driver_registry_path : base
         WCHAR path[MAX_PATH]; // key name max size is 255
 };
 
+/*
+ * Counters of the driver since it was loaded, for diagnostics.
+ */
+struct get_statistics : base
+{
+        struct
+        {
+                ULONG isoc_packets; // capacity of isochronous descriptors of contexts in this pool
+                LONG64 hits; // taken from a per-CPU free list
+                LONG64 misses; // taken from the lookaside list
+                LONG64 isoc_grown; // descriptors were reallocated
+        } wsk_context[5];
+
+        struct
+        {
+                LONG64 hits;
+                LONG64 misses; // allocated from the pool
+                LONG64 trimmed; // freed because the free list was full
+        } mdl_cache;
+
+        struct
+        {
+                ULONG devices; // read from the registry when the driver was loaded
+                ULONG attached;
+                ULONG attempts;
+                ULONG time_ms; // restore took, zero if it is not finished
+        } persistent;
+};
+
 } // namespace usbip::vhci::ioctl
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Helpers for the benchmarks, @see CMakeLists.txt.
+ */
+namespace bench
+{
+
+inline bool full; // --full, more iterations
+
+inline void parse_args(int argc, char *argv[])
+{
+        for (int i = 1; i < argc; ++i) {
+                if (!strcmp(argv[i], "--full")) {
+                        full = true;
+                }
+        }
+}
+
+inline size_t iterations(size_t quick) { return full ? 20*quick : quick; }
+
+/*
+ * The results are accumulated here, so the compiler can't drop the code that is measured.
+ */
+inline volatile size_t sink;
+
+template<typename T>
+inline void consume(T v) { sink = sink + size_t(v); }
+
+/*
+ * f() performs ops operations, the best of several runs is taken.
+ * @return nanoseconds per operation
+ */
+template<typename F>
+double measure(size_t ops, const F &f)
+{
+        using clock = std::chrono::steady_clock;
+        double best = 0;
+
+        for (int i = 0; i < 3; ++i) {
+                auto start = clock::now();
+                f();
+                std::chrono::duration<double, std::nano> d = clock::now() - start;
+
+                if (!i || d.count() < best) {
+                        best = d.count();
+                }
+        }
+
+        return ops ? best/ops : best;
+}
+
+[[noreturn]] inline void fail(const char *expr, const char *file, int line)
+{
+        fprintf(stderr, "%s(%d): CHECK(%s) failed\n", file, line, expr);
+        exit(EXIT_FAILURE);
+}
+
+} // namespace bench
+
+/*
+ * assert() is disabled in Release.
+ */
+#define CHECK(expr) ((expr) ? (void)0 : bench::fail(#expr, __FILE__, __LINE__))
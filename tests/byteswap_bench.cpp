@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <usbip/codec.h>
+#include <immintrin.h>
+
+/*
+ * Only the kernels are compiled for SSSE3 and AVX2, the program runs on any x64 CPU.
+ */
+#if defined(__clang__)
+  #pragma clang attribute push (__attribute__((target("ssse3,avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+  #pragma GCC push_options
+  #pragma GCC target("ssse3,avx2")
+#endif
+
+#include <libdrv/pdu_simd.h>
+
+#if defined(__clang__)
+  #pragma clang attribute pop
+#elif defined(__GNUC__)
+  #pragma GCC pop_options
+#endif
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+#include <random>
+#include <vector>
+
+/*
+ * Scalar vs. vector kernels of byteswap for usbip_iso_packet_descriptor[] from 1 to USBIP_MAX_ISO_PACKETS,
+ * @see byteswap(usbip_iso_packet_descriptor*, size_t), byteswap_and_validate in pdu.cpp.
+ * The scalar kernels are not autovectorized, @see CMakeLists.txt, as MSVC does for the driver.
+ */
+namespace
+{
+
+using namespace usbip::simd;
+
+enum { SKIP = 77 }; // SKIP_RETURN_CODE
+
+struct cpu_features
+{
+        bool ssse3;
+        bool avx2;
+};
+
+auto get_cpu_features()
+{
+#ifdef _MSC_VER
+        int r[4]; // EAX, EBX, ECX, EDX
+        __cpuid(r, 0);
+        auto max_leaf = r[0];
+
+        __cpuid(r, 1);
+        cpu_features f{ .ssse3 = bool(r[2] & (1 << 9)), .avx2 = false };
+
+        if (max_leaf >= 7) {
+                __cpuidex(r, 7, 0);
+                f.avx2 = r[1] & (1 << 5);
+        }
+
+        return f;
+#else
+        __builtin_cpu_init();
+        return cpu_features{ .ssse3 = bool(__builtin_cpu_supports("ssse3")), .avx2 = bool(__builtin_cpu_supports("avx2")) };
+#endif
+}
+
+auto make_descriptors(std::mt19937 &rnd, size_t cnt)
+{
+        std::vector<usbip_iso_packet_descriptor> v(cnt);
+        UINT32 offset = 0;
+
+        for (auto &d: v) {
+                d.offset = offset;
+                d.length = 1 + rnd() % 3072;
+                d.actual_length = rnd() % (d.length + 1);
+                d.status = rnd() % 4 ? 0 : UINT32(-71); // -EPROTO
+
+                offset += d.length;
+                usbip::wire::byteswap(d); // to network byte order
+        }
+
+        return v;
+}
+
+auto equal(const std::vector<usbip_iso_packet_descriptor> &a, const std::vector<usbip_iso_packet_descriptor> &b)
+{
+        return a.size() == b.size() && !memcmp(a.data(), b.data(), a.size()*sizeof(a[0]));
+}
+
+/*
+ * byteswap_and_validate in pdu.cpp.
+ */
+auto byteswap_and_validate_vector(usbip_iso_packet_descriptor *d, size_t cnt)
+{
+        return byteswap_and_validate_ssse3(d, cnt) ? cnt : find_invalid(d, cnt);
+}
+
+void check(std::mt19937 &rnd, const cpu_features &cpu)
+{
+        for (size_t cnt = 0; cnt <= USBIP_MAX_ISO_PACKETS; cnt += 1 + cnt/8) {
+                auto src = make_descriptors(rnd, cnt);
+
+                auto expected = src;
+                byteswap_scalar(expected.data(), cnt);
+
+                auto v = src;
+                byteswap_ssse3(v.data(), cnt);
+                CHECK(equal(v, expected));
+
+                if (cpu.avx2) {
+                        v = src;
+                        byteswap_avx2(v.data(), cnt);
+                        CHECK(equal(v, expected));
+                }
+
+                for (int i = 0; i < 8; ++i) { // corrupt one descriptor, maybe
+                        auto bad = src;
+
+                        if (cnt && i) {
+                                auto &d = bad[rnd() % cnt];
+                                auto &field = i % 2 ? d.actual_length : d.offset;
+                                field = usbip::wire::byteswap32(~0U - rnd() % 4);
+                        }
+
+                        auto a = bad;
+                        auto b = bad;
+
+                        auto invalid = byteswap_and_validate_scalar(a.data(), cnt);
+                        CHECK(invalid == find_invalid(a.data(), cnt));
+
+                        CHECK(byteswap_and_validate_vector(b.data(), cnt) == invalid);
+                        CHECK(equal(a, b));
+                }
+        }
+}
+
+void run_bench(std::mt19937 &rnd, const cpu_features &cpu)
+{
+        printf("%8s %12s %12s %12s %16s %16s\n", "packets", "scalar,ns", "ssse3,ns", "avx2,ns",
+                "validate scalar", "validate ssse3");
+
+        for (size_t cnt = 1; cnt <= USBIP_MAX_ISO_PACKETS; cnt *= 2) {
+                auto v = make_descriptors(rnd, cnt);
+                auto d = v.data();
+
+                auto calls = bench::iterations((1 << 22)/cnt);
+
+                auto measure = [calls, &v] (auto f)
+                {
+                        auto ns = bench::measure(calls, [calls, &f] {
+                                for (size_t i = 0; i < calls; ++i) {
+                                        f();
+                                }
+                        });
+
+                        bench::consume(v.back().status);
+                        return ns;
+                };
+
+                auto scalar = measure([d, cnt] { byteswap_scalar(d, cnt); });
+                auto ssse3 = measure([d, cnt] { byteswap_ssse3(d, cnt); });
+                auto avx2 = cpu.avx2 ? measure([d, cnt] { byteswap_avx2(d, cnt); }) : 0;
+
+                /*
+                 * The descriptors are swapped back to remain valid, the time of that is subtracted.
+                 */
+                auto validate_scalar = measure([d, cnt] {
+                        bench::consume(byteswap_and_validate_scalar(d, cnt));
+                        byteswap_scalar(d, cnt);
+                }) - scalar;
+
+                auto validate_ssse3 = measure([d, cnt] {
+                        bench::consume(byteswap_and_validate_vector(d, cnt));
+                        byteswap_ssse3(d, cnt);
+                }) - ssse3;
+
+                printf("%8zu %12.1f %12.1f %12.1f %16.1f %16.1f\n", cnt, scalar, ssse3, avx2, validate_scalar, validate_ssse3);
+        }
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+
+        auto cpu = get_cpu_features();
+        if (!cpu.ssse3) {
+                printf("SSSE3 is not supported\n");
+                return SKIP;
+        }
+
+        std::mt19937 rnd(42);
+
+        check(rnd, cpu);
+        run_bench(rnd, cpu);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <usbip/codec.h>
+
+#include <random>
+#include <vector>
+
+/*
+ * Byte order converters that are generated by codec.h vs. hand-written ones they replaced,
+ * the results must be the same.
+ */
+namespace
+{
+
+using namespace usbip;
+using wire::byteswap16;
+using wire::byteswap32;
+
+/*
+ * As they were in pdu.cpp and proto_op.cpp.
+ */
+namespace manual
+{
+
+inline void swap(UINT32 &v) { v = byteswap32(v); }
+inline void swap(INT32 &v) { v = INT32(byteswap32(UINT32(v))); }
+inline void swap(UINT16 &v) { v = byteswap16(v); }
+
+void byteswap(usbip_header_basic &r)
+{
+        UINT32* v[]{ &r.command, &r.seqnum, &r.devid, &r.direction, &r.ep };
+        for (auto val: v) {
+                swap(*val);
+        }
+}
+
+void byteswap(usbip_header_cmd_submit &r)
+{
+        swap(r.transfer_flags);
+
+        INT32 *v[] {&r.transfer_buffer_length, &r.start_frame, &r.number_of_packets, &r.interval};
+        for (auto val: v) {
+                swap(*val);
+        }
+}
+
+void byteswap(usbip_header_ret_submit &r)
+{
+        INT32 *v[] {&r.status, &r.actual_length, &r.start_frame, &r.number_of_packets, &r.error_count};
+        for (auto val: v) {
+                swap(*val);
+        }
+}
+
+void byteswap(usbip_iso_packet_descriptor &d)
+{
+        UINT32 *v[] {&d.offset, &d.length, &d.actual_length, &d.status};
+        for (auto val: v) {
+                swap(*val);
+        }
+}
+
+void byteswap(usbip_usb_device &d)
+{
+        swap(d.busnum);
+        swap(d.devnum);
+        swap(d.speed);
+
+        swap(d.idVendor);
+        swap(d.idProduct);
+        swap(d.bcdDevice);
+}
+
+void byteswap(op_common &r)
+{
+        swap(r.version);
+        swap(r.code);
+        swap(r.status);
+}
+
+} // namespace manual
+
+template<typename T>
+void randomize(std::mt19937 &rnd, T &s)
+{
+        auto p = reinterpret_cast<UINT8*>(&s);
+        for (size_t i = 0; i < sizeof(s); ++i) {
+                p[i] = UINT8(rnd());
+        }
+}
+
+template<typename T>
+void check(std::mt19937 &rnd)
+{
+        static_assert(wire::is_described<T>());
+
+        for (int i = 0; i < 1000; ++i) {
+                T src;
+                randomize(rnd, src);
+
+                auto a = src;
+                wire::byteswap(a);
+
+                auto b = src;
+                manual::byteswap(b);
+                CHECK(!memcmp(&a, &b, sizeof(a)));
+
+                wire::byteswap(a);
+                CHECK(!memcmp(&a, &src, sizeof(a))); // symmetric
+        }
+}
+
+template<typename T>
+void check_nested(std::mt19937 &rnd) // byteswap of nested wire structures
+{
+        for (int i = 0; i < 1000; ++i) {
+                T src;
+                randomize(rnd, src);
+
+                auto a = src;
+                wire::byteswap(a);
+
+                auto b = src;
+                manual::byteswap(b.udev);
+
+                CHECK(!memcmp(&a, &b, sizeof(a)));
+        }
+}
+
+template<typename T, typename F>
+auto measure(std::vector<T> &v, const F &f)
+{
+        auto rounds = bench::iterations(256);
+        auto ops = rounds*v.size();
+
+        auto ns = bench::measure(ops, [&] {
+                for (size_t r = 0; r < rounds; ++r) {
+                        for (auto &s: v) {
+                                f(s);
+                        }
+                }
+        });
+
+        bench::consume(*reinterpret_cast<const UINT8*>(&v.back()));
+        return ns;
+}
+
+template<typename T, typename G, typename M>
+void bench_one(std::mt19937 &rnd, const char *name, const G &generated_swap, const M &manual_swap)
+{
+        std::vector<T> v(4096);
+        for (auto &s: v) {
+                randomize(rnd, s);
+        }
+
+        auto generated = measure(v, generated_swap);
+        auto manual = measure(v, manual_swap);
+
+        printf("%-28s %12.2f %12.2f\n", name, generated, manual);
+}
+
+void run_bench(std::mt19937 &rnd)
+{
+        printf("%-28s %12s %12s\n", "ns", "generated", "manual");
+
+        auto generated_swap = [] (auto &s) { wire::byteswap(s); };
+        auto manual_swap = [] (auto &s) { manual::byteswap(s); };
+
+        bench_one<usbip_header>(rnd, "usbip_header CMD_SUBMIT",
+                [] (auto &h) { // usbip_header is not described because of the union
+                        wire::byteswap(h.base);
+                        wire::byteswap(h.u.cmd_submit);
+                },
+                [] (auto &h) {
+                        manual::byteswap(h.base);
+                        manual::byteswap(h.u.cmd_submit);
+                });
+
+        bench_one<usbip_iso_packet_descriptor>(rnd, "usbip_iso_packet_descriptor", generated_swap, manual_swap);
+        bench_one<usbip_usb_device>(rnd, "usbip_usb_device", generated_swap, manual_swap);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+        std::mt19937 rnd(42);
+
+        check<usbip_header_basic>(rnd);
+        check<usbip_header_cmd_submit>(rnd);
+        check<usbip_header_ret_submit>(rnd);
+        check<usbip_iso_packet_descriptor>(rnd);
+        check<usbip_usb_device>(rnd);
+        check<op_common>(rnd);
+
+        check_nested<op_import_reply>(rnd);
+        check_nested<op_devlist_reply_extra>(rnd);
+
+        run_bench(rnd);
+}
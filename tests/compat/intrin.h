@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+/*
+ * MSVC intrinsics that are used by the headers under test, for GCC and Clang.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+#else
+  inline void _mm_pause() {}
+#endif
+
+inline void* _InterlockedCompareExchangePointer(void* volatile *destination, void *exchange, void *comparand)
+{
+        __atomic_compare_exchange_n(destination, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        return comparand; // the initial value of *destination
+}
+
+inline void* _InterlockedExchangePointer(void* volatile *target, void *value)
+{
+        return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+inline char _InterlockedExchange8(volatile char *target, char value)
+{
+        return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
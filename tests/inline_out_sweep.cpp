@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Per-URB cost of OUT payload in prepare_wsk_buf for payload sizes from 8 bytes to 8 KiB,
+ * @see InlineOutMax, SEND_INLINE_DEFAULT.
+ *
+ * MDL routines are not available in user mode, the paths are reproduced step by step
+ * on the same layouts the driver uses:
+ * - mdl: make_transfer_buffer_mdl builds a partial MDL of TransferBufferMDL (an MDL is taken from the cache
+ *   of Mdl, IoBuildPartialMdl copies PFNs of the source), it is tied after wsk_context::mdl_hdr
+ *   and returned to the cache after WskSend completion;
+ * - copy: TransferBuffer is copied into wsk_context::hdr_payload, ByteCount of mdl_hdr is adjusted;
+ * - clone: copy_transfer_buffer of TransferBufferMDL, the same partial MDL is built, the data is copied
+ *   through it and it is freed at once. Mapping of the pages is not counted.
+ *
+ * Not counted because they need the kernel: IoAllocateMdl and MmProbeAndLockPages of TransferBuffer
+ * for the mdl path (TransferBufferMDL is locked by the caller), mapping of TransferBufferMDL for the clone path
+ * if it is not mapped yet, the cost of one more MDL in WSK_BUF for the TCP/IP stack.
+ * So mdl,ns is a lower bound for TransferBuffer and clone,ns is a lower bound for TransferBufferMDL.
+ *
+ * The default of InlineOutMax, SEND_INLINE_DEFAULT, is 256 bytes. It is the crossover of copy and mdl
+ * that was measured with the previous version of this program which allocated an MDL with malloc,
+ * at 512 bytes the copy was slower (25 vs 22 ns). Above 512 bytes the copy always loses.
+ */
+namespace
+{
+
+enum { PAGE_SIZE = 4096, PAGE_SHIFT = 12 };
+enum { MIN_SIZE = 8, MAX_SIZE = 8192, INLINE_MAX = 8192 };
+
+/*
+ * The layout of MDL, PFN_NUMBER[] follows it.
+ */
+struct mdl
+{
+        mdl *next;
+        short size;
+        short flags;
+        void *process;
+        void *mapped_va;
+        void *start_va;
+        unsigned long byte_count;
+        unsigned long byte_offset;
+
+        auto pfn() { return reinterpret_cast<uintptr_t*>(this + 1); }
+        auto va() const { return static_cast<char*>(start_va) + byte_offset; }
+};
+
+enum { MDL_PARTIAL = 0x10 };
+
+/*
+ * The fields of usbip_header and wsk_context that the paths touch.
+ */
+struct wsk_context
+{
+        void *request;
+        mdl *mdl_buf;
+        wsk_context *next;
+        unsigned long send_len;
+
+        mdl *mdl_hdr;
+        unsigned char hdr[48];
+        unsigned char hdr_payload[INLINE_MAX];
+};
+
+auto spans_pages(const void *va, size_t len) // ADDRESS_AND_SIZE_TO_SPAN_PAGES
+{
+        auto offset = reinterpret_cast<uintptr_t>(va) & (PAGE_SIZE - 1);
+        return (offset + len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+}
+
+auto alloc(size_t pages)
+{
+        auto m = static_cast<mdl*>(malloc(sizeof(mdl) + pages*sizeof(uintptr_t)));
+        CHECK(m);
+        *m = mdl{};
+        m->size = short(sizeof(mdl) + pages*sizeof(uintptr_t));
+        return m;
+}
+
+/*
+ * Free list of one size class of the cache of Mdl, @see mdl_cpp.cpp.
+ */
+class mdl_cache
+{
+public:
+        mdl_cache()
+        {
+                for (auto &m: m_free) {
+                        m = alloc(PAGES);
+                }
+                m_cnt = DEPTH;
+        }
+
+        ~mdl_cache()
+        {
+                while (m_cnt) {
+                        ::free(m_free[--m_cnt]);
+                }
+        }
+
+        mdl_cache(const mdl_cache&) = delete;
+        mdl_cache& operator=(const mdl_cache&) = delete;
+
+        mdl* get(size_t pages)
+        {
+                CHECK(pages <= PAGES);
+                CHECK(m_cnt);
+                return m_free[--m_cnt];
+        }
+
+        void put(mdl *m) { m_free[m_cnt++] = m; }
+
+private:
+        enum { PAGES = 4, DEPTH = 128 };
+        mdl *m_free[DEPTH];
+        size_t m_cnt;
+};
+
+/*
+ * MmInitializeMdl + IoBuildPartialMdl.
+ */
+void build_partial_mdl(mdl &src, mdl &m, char *va, size_t len)
+{
+        auto addr = reinterpret_cast<uintptr_t>(va);
+
+        m.next = nullptr;
+        m.flags = MDL_PARTIAL;
+        m.start_va = reinterpret_cast<void*>(addr & ~uintptr_t(PAGE_SIZE - 1));
+        m.byte_offset = static_cast<unsigned long>(addr & (PAGE_SIZE - 1));
+        m.byte_count = static_cast<unsigned long>(len);
+
+        auto first = (addr >> PAGE_SHIFT) - (reinterpret_cast<uintptr_t>(src.start_va) >> PAGE_SHIFT);
+        auto pages = spans_pages(va, len);
+
+        memcpy(m.pfn(), src.pfn() + first, pages*sizeof(uintptr_t));
+}
+
+/*
+ * A locked-down buffer with its TransferBufferMDL.
+ */
+struct transfer_buffer
+{
+        std::vector<char> buf;
+        mdl *m;
+
+        explicit transfer_buffer(size_t len) : buf(len, 'x')
+        {
+                auto va = buf.data();
+                auto pages = spans_pages(va, len);
+                auto addr = reinterpret_cast<uintptr_t>(va);
+
+                m = alloc(pages);
+                m->start_va = reinterpret_cast<void*>(addr & ~uintptr_t(PAGE_SIZE - 1));
+                m->byte_offset = static_cast<unsigned long>(addr & (PAGE_SIZE - 1));
+                m->byte_count = static_cast<unsigned long>(len);
+
+                for (size_t i = 0; i < pages; ++i) {
+                        m->pfn()[i] = (addr >> PAGE_SHIFT) + i;
+                }
+        }
+
+        ~transfer_buffer() { ::free(m); }
+
+        transfer_buffer(const transfer_buffer&) = delete;
+        transfer_buffer& operator=(const transfer_buffer&) = delete;
+};
+
+struct result
+{
+        size_t len;
+        double copy_ns;
+        double clone_ns;
+        double mdl_ns;
+};
+
+auto measure(size_t len)
+{
+        enum { URBS = 64 }; // in flight, their buffers are hot in cache as the client has just filled them
+
+        std::vector<std::unique_ptr<transfer_buffer>> urbs;
+        for (int i = 0; i < URBS; ++i) {
+                urbs.push_back(std::make_unique<transfer_buffer>(len));
+        }
+
+        auto ctx = std::make_unique<wsk_context>();
+        ctx->mdl_hdr = alloc(1);
+
+        mdl_cache cache;
+        auto cnt = bench::iterations(1 << 18);
+
+        auto copy_ns = bench::measure(cnt, [&] {
+                for (size_t i = 0; i < cnt; ++i) {
+                        auto &tb = *urbs[i % URBS];
+                        memcpy(ctx->hdr_payload, tb.buf.data(), len);
+                        ctx->mdl_hdr->byte_count = static_cast<unsigned long>(sizeof(ctx->hdr) + len);
+                        bench::consume(ctx->hdr_payload[len - 1]);
+                }
+        });
+
+        auto clone_ns = bench::measure(cnt, [&] {
+                for (size_t i = 0; i < cnt; ++i) {
+                        auto &tb = *urbs[i % URBS];
+                        auto va = tb.m->va();
+
+                        auto m = cache.get(spans_pages(va, len));
+                        build_partial_mdl(*tb.m, *m, va, len);
+
+                        memcpy(ctx->hdr_payload, m->va(), len); // through the mapping of the partial MDL
+                        ctx->mdl_hdr->byte_count = static_cast<unsigned long>(sizeof(ctx->hdr) + len);
+
+                        cache.put(m);
+                        bench::consume(ctx->hdr_payload[len - 1]);
+                }
+        });
+
+        auto mdl_ns = bench::measure(cnt, [&] {
+                for (size_t i = 0; i < cnt; ++i) {
+                        auto &tb = *urbs[i % URBS];
+                        auto va = tb.m->va();
+
+                        auto m = cache.get(spans_pages(va, len));
+                        build_partial_mdl(*tb.m, *m, va, len);
+
+                        ctx->mdl_buf = m;
+                        ctx->mdl_hdr->byte_count = sizeof(ctx->hdr);
+                        ctx->mdl_hdr->next = m;
+                        bench::consume(ctx->mdl_hdr->next->byte_count);
+
+                        ctx->mdl_hdr->next = nullptr; // WskSend completion
+                        cache.put(ctx->mdl_buf);
+                        ctx->mdl_buf = nullptr;
+                }
+        });
+
+        ::free(ctx->mdl_hdr);
+        return result{ len, copy_ns, clone_ns, mdl_ns };
+}
+
+/*
+ * The largest size for which inline is not slower, the sizes below it too.
+ */
+struct crossover
+{
+        size_t len;
+        bool slower;
+
+        void update(size_t sz, double inline_ns, double mdl_ns)
+        {
+                if (inline_ns > mdl_ns) {
+                        slower = true;
+                } else if (!slower) {
+                        len = sz;
+                }
+        }
+
+        void print(const char *name) const
+        {
+                if (len) {
+                        printf("%s is not slower than mdl up to %zu bytes\n", name, len);
+                } else {
+                        printf("%s is slower than mdl for %d bytes\n", name, MIN_SIZE);
+                }
+        }
+};
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+        printf("%8s %12s %12s %12s\n", "bytes", "copy,ns", "clone,ns", "mdl,ns");
+
+        crossover copy{};
+        crossover clone{};
+
+        for (size_t len = MIN_SIZE; len <= MAX_SIZE; len *= 2) {
+                auto r = measure(len);
+                printf("%8zu %12.1f %12.1f %12.1f\n", r.len, r.copy_ns, r.clone_ns, r.mdl_ns);
+
+                CHECK(r.copy_ns > 0 && r.clone_ns > 0 && r.mdl_ns > 0);
+
+                copy.update(len, r.copy_ns, r.mdl_ns);
+                clone.update(len, r.clone_ns, r.mdl_ns);
+        }
+
+        copy.print("copy of TransferBuffer");
+        clone.print("copy through partial MDL of TransferBufferMDL");
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <ude/mpsc_queue.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * mpsc_queue with 1 to 16 producers, as it is used by send_queued in device_ioctl.cpp:
+ * each producer pushes a node and calls consume, the owner "sends" nodes in the order of push.
+ *
+ * Checks that each node is sent exactly once, nodes of a producer are not reordered,
+ * the owner is one thread at a time and nothing is left in the queue when producers are done.
+ * With the in-flight limit can() becomes false and the rest is sent by the completions.
+ */
+namespace
+{
+
+using namespace usbip;
+using namespace std::chrono_literals;
+
+struct node
+{
+        node *next;
+        unsigned int producer;
+        unsigned int seq; // of the producer
+};
+
+using queue = mpsc_queue<node, &node::next>;
+
+enum { MAX_PRODUCERS = 16, IN_FLIGHT_MAX = 4 };
+
+struct sender
+{
+        queue q{}; // must be zero-initialized
+        bool limited; // by IN_FLIGHT_MAX
+
+        std::atomic<int> owners;
+        std::atomic<int> in_flight; // batches, are completed by completer thread
+        std::atomic<size_t> sent;
+
+        unsigned int next_seq[MAX_PRODUCERS]; // expected, are accessed by the owner only
+
+        auto can() const { return !q.empty() && !(limited && in_flight >= IN_FLIGHT_MAX); }
+
+        void send_queued()
+        {
+                q.consume([this] { return can(); }, [this] (auto head) { dispatch(head); });
+        }
+
+        void dispatch(node *head)
+        {
+                CHECK(++owners == 1);
+                CHECK(head);
+
+                size_t cnt = 0;
+
+                for (auto n = head; n; n = n->next, ++cnt) {
+                        CHECK(n->seq == next_seq[n->producer]++);
+                }
+
+                sent += cnt;
+
+                if (limited) {
+                        ++in_flight;
+                }
+
+                --owners;
+        }
+
+        /*
+         * on_wsk_send_complete
+         */
+        void complete()
+        {
+                --in_flight;
+                send_queued();
+        }
+};
+
+void produce(sender &s, unsigned int producer, std::vector<node> &nodes)
+{
+        for (unsigned int i = 0; i < nodes.size(); ++i) {
+                auto &n = nodes[i];
+                n.producer = producer;
+                n.seq = i;
+
+                s.q.push(&n);
+                s.send_queued();
+        }
+}
+
+/*
+ * @return nanoseconds per node
+ */
+auto run(unsigned int producers, size_t per_producer, bool limited)
+{
+        auto s = std::make_unique<sender>();
+        s->limited = limited;
+
+        std::vector<std::vector<node>> nodes(producers, std::vector<node>(per_producer));
+        std::atomic<bool> done{};
+
+        std::thread completer([&s, &done] {
+                while (!done || s->in_flight) {
+                        if (s->in_flight) {
+                                s->complete();
+                        } else {
+                                std::this_thread::yield();
+                        }
+                }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        {
+                std::vector<std::thread> v;
+                for (unsigned int i = 0; i < producers; ++i) {
+                        v.emplace_back(produce, std::ref(*s), i, std::ref(nodes[i]));
+                }
+
+                for (auto &t: v) {
+                        t.join();
+                }
+        }
+
+        auto total = producers*per_producer;
+
+        for (auto deadline = start + 60s; s->sent != total; std::this_thread::yield()) { // the rest is sent by completions
+                CHECK(limited);
+                CHECK(std::chrono::steady_clock::now() < deadline);
+        }
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+        done = true;
+        completer.join();
+
+        CHECK(s->q.empty());
+        CHECK(!s->owners);
+
+        for (unsigned int i = 0; i < producers; ++i) {
+                CHECK(s->next_seq[i] == per_producer);
+        }
+
+        return elapsed.count()/total;
+}
+
+/*
+ * The baseline, device_ctx::send_lock was held by producers while WskSend was called.
+ */
+auto run_locked(unsigned int producers, size_t per_producer)
+{
+        std::mutex lock;
+        unsigned int next_seq[MAX_PRODUCERS]{};
+
+        auto produce = [&lock, &next_seq, per_producer] (unsigned int producer)
+        {
+                for (unsigned int seq = 0; seq < per_producer; ++seq) {
+                        std::lock_guard lck(lock);
+                        CHECK(next_seq[producer]++ == seq);
+                }
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        {
+                std::vector<std::thread> v;
+                for (unsigned int i = 0; i < producers; ++i) {
+                        v.emplace_back(produce, i);
+                }
+
+                for (auto &t: v) {
+                        t.join();
+                }
+        }
+
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count()/(producers*per_producer);
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+
+        auto total = bench::iterations(400'000);
+        printf("%9s %14s %14s %14s\n", "producers", "lock-free,ns", "limited,ns", "lock,ns");
+
+        for (unsigned int producers = 1; producers <= MAX_PRODUCERS; producers *= 2) {
+                auto per_producer = total/producers;
+
+                auto lock_free = run(producers, per_producer, false);
+                auto limited = run(producers, per_producer, true);
+                auto locked = run_locked(producers, per_producer);
+
+                printf("%9u %14.1f %14.1f %14.1f\n", producers, lock_free, limited, locked);
+        }
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#pragma once
+
+#include <usbip/codec.h>
+
+#include <cstring>
+#include <vector>
+
+/*
+ * Builds a stream of server's responses in network byte order, as they are received by the driver.
+ */
+namespace bench
+{
+
+class pdu_gen
+{
+public:
+        auto& data() const { return m_buf; }
+        auto size() const { return m_buf.size(); }
+        auto count() const { return m_cnt; }
+
+        void clear()
+        {
+                m_buf.clear();
+                m_cnt = 0;
+        }
+
+        /*
+         * @param seqnum its least significant bit is the direction, the data follows the header for IN only
+         * @param isoc_cnt number_of_packets, non-isoch if negative
+         */
+        void ret_submit(seqnum_t seqnum, INT32 actual_length, INT32 isoc_cnt = number_of_packets_non_isoch)
+        {
+                usbip_header h{};
+                h.base.command = USBIP_RET_SUBMIT;
+                h.base.seqnum = seqnum;
+
+                auto &r = h.u.ret_submit;
+                r.actual_length = actual_length;
+                r.number_of_packets = isoc_cnt;
+
+                usbip::wire::byteswap(h.base);
+                usbip::wire::byteswap(r);
+                append(&h, sizeof(h));
+
+                if (seqnum & USBIP_DIR_IN) {
+                        for (INT32 i = 0; i < actual_length; ++i) {
+                                m_buf.push_back(UINT8(seqnum + i));
+                        }
+                }
+
+                for (INT32 i = 0; i < isoc_cnt; ++i) {
+                        auto len = UINT32(isoc_cnt ? actual_length/isoc_cnt : 0);
+                        usbip_iso_packet_descriptor d{ .offset = i*len, .length = len, .actual_length = len, .status = 0 };
+
+                        usbip::wire::byteswap(d);
+                        append(&d, sizeof(d));
+                }
+
+                ++m_cnt;
+        }
+
+        void ret_unlink(seqnum_t seqnum, INT32 status)
+        {
+                usbip_header h{};
+                h.base.command = USBIP_RET_UNLINK;
+                h.base.seqnum = seqnum;
+                h.u.ret_unlink.status = status;
+
+                usbip::wire::byteswap(h.base);
+                usbip::wire::byteswap(h.u.ret_unlink);
+                append(&h, sizeof(h));
+
+                ++m_cnt;
+        }
+
+private:
+        std::vector<UINT8> m_buf;
+        size_t m_cnt{};
+
+        void append(const void *p, size_t len)
+        {
+                auto src = static_cast<const UINT8*>(p);
+                m_buf.insert(m_buf.end(), src, src + len);
+        }
+};
+
+} // namespace bench
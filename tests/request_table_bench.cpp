@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <usbip/proto.h>
+#include <ude/request_table.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Lookup of in-flight requests by seqnum: request_table vs. linear search in a list,
+ * the way the requests were found before, for 1 to 2048 requests in flight.
+ */
+namespace
+{
+
+using namespace usbip;
+
+struct request // stands for request_ctx
+{
+        seqnum_t seqnum;
+        request *next;
+};
+
+using table = request_table<seqnum_t, request, 4096>; // as device_ctx::requests
+enum { MAX_IN_FLIGHT = table::max_size() }; // more URBs are throttled, @see device::requests_exhausted
+
+/*
+ * @see next_seqnum
+ */
+class seqnum_gen
+{
+public:
+        seqnum_t operator()(bool dir_in)
+        {
+                while (true) {
+                        if (seqnum_t num = ++m_counter << 1) {
+                                return num | seqnum_t(dir_in);
+                        }
+                }
+        }
+
+        void skip(seqnum_t cnt) { m_counter += cnt; }
+
+private:
+        seqnum_t m_counter{};
+};
+
+auto make_table() { return std::make_unique<table>(); } // value-initialized, i.e. zeroed
+
+/*
+ * Random inserts and removals are checked against std::unordered_map. Some requests live long
+ * enough for the counter to wrap around the capacity, so their slots are taken by the new ones.
+ */
+void check_model(std::mt19937 &rnd)
+{
+        auto t = make_table();
+        std::unordered_map<seqnum_t, request*> model;
+
+        std::vector<request> pool(table::max_size());
+        std::vector<request*> free_list;
+        for (auto &r: pool) {
+                free_list.push_back(&r);
+        }
+
+        seqnum_gen gen;
+        auto ops = bench::iterations(200'000);
+
+        for (size_t i = 0; i < ops; ++i) {
+                if (!(i % 1000)) {
+                        gen.skip(rnd() % table::capacity()); // other devices do not share the counter, it is a jump
+                }
+
+                if (auto op = rnd() % 8; op < 4 && !free_list.empty()) {
+                        auto r = free_list.back();
+                        r->seqnum = gen(rnd() & 1);
+
+                        auto ok = t->insert(r->seqnum, r);
+                        CHECK(ok == model.emplace(r->seqnum, r).second);
+                        if (ok) {
+                                free_list.pop_back();
+                        }
+                } else if (op < 7 && !model.empty()) {
+                        auto it = std::next(model.begin(), rnd() % std::min(model.size(), size_t(16)));
+                        CHECK(t->remove(it->first) == it->second);
+                        free_list.push_back(it->second);
+                        model.erase(it);
+                } else {
+                        CHECK(!t->find(gen(false))); // not issued yet
+                }
+
+                CHECK(t->size() == model.size());
+        }
+
+        for (auto [seqnum, r]: model) {
+                CHECK(t->find(seqnum) == r);
+        }
+
+        auto odd = [] (auto r) { return r->seqnum & 1; };
+        auto expected = std::count_if(model.begin(), model.end(), [&odd] (auto &p) { return odd(p.second); });
+
+        CHECK(t->remove_all_if(odd, [] (auto) {}) == size_t(expected));
+        CHECK(t->size() == model.size() - expected);
+
+        for (auto [seqnum, r]: model) {
+                CHECK(t->find(seqnum) == (odd(r) ? nullptr : r));
+        }
+}
+
+/*
+ * Keys of several generations of the counter that share a few home slots around the end of the table,
+ * the clusters wrap around and most elements are displaced.
+ */
+void check_collisions(std::mt19937 &rnd)
+{
+        std::vector<seqnum_t> keys;
+
+        for (seqnum_t gen = 1; gen <= 4; ++gen) {
+                for (seqnum_t num = table::capacity() - 4; num < table::capacity() + 4; ++num) {
+                        keys.push_back((gen*table::capacity() + num) << 1 | (num & 1));
+                }
+        }
+
+        std::vector<request> v(keys.size());
+
+        for (auto i = bench::iterations(2000); i; --i) {
+                auto t = make_table();
+                std::unordered_map<seqnum_t, request*> model;
+
+                std::shuffle(keys.begin(), keys.end(), rnd);
+                auto cnt = 1 + rnd() % keys.size();
+
+                for (size_t j = 0; j < cnt; ++j) {
+                        auto &r = v[j];
+                        r.seqnum = keys[j];
+                        CHECK(t->insert(r.seqnum, &r));
+                        model.emplace(r.seqnum, &r);
+                }
+
+                std::shuffle(keys.begin(), keys.begin() + cnt, rnd);
+
+                for (size_t j = 0; j < cnt; ++j) {
+                        CHECK(t->remove(keys[j]) == model[keys[j]]);
+                        model.erase(keys[j]);
+
+                        for (auto [seqnum, r]: model) {
+                                CHECK(t->find(seqnum) == r);
+                        }
+                }
+
+                CHECK(t->empty());
+                CHECK(!t->displaced()); // the counter is balanced, erase relies on it
+        }
+}
+
+/*
+ * Up to MAX_IN_FLIGHT requests fit, the next one is rejected.
+ */
+void check_capacity()
+{
+        auto t = make_table();
+        std::vector<request> v(MAX_IN_FLIGHT);
+
+        seqnum_gen gen;
+        for (auto &r: v) {
+                CHECK(t->insert(r.seqnum = gen(true), &r));
+        }
+
+        for (auto &r: v) {
+                CHECK(t->find(r.seqnum) == &r);
+        }
+
+        request extra{};
+        CHECK(!t->insert(extra.seqnum = gen(false), &extra));
+        CHECK(t->size() == MAX_IN_FLIGHT);
+        CHECK(!t->displaced());
+}
+
+auto list_find(request *head, seqnum_t seqnum)
+{
+        for ( ; head; head = head->next) {
+                if (head->seqnum == seqnum) {
+                        return head;
+                }
+        }
+        return static_cast<request*>(nullptr);
+}
+
+void run_bench(std::mt19937 &rnd)
+{
+        printf("%8s %14s %14s %14s\n", "requests", "table find,ns", "list find,ns", "churn,ns");
+
+        for (size_t n = 1; n <= MAX_IN_FLIGHT; n *= 2) {
+
+                auto t = make_table();
+                std::vector<request> v(n);
+
+                seqnum_gen gen;
+                request *head{};
+
+                for (auto &r: v) {
+                        r.seqnum = gen(rnd() & 1);
+                        CHECK(t->insert(r.seqnum, &r));
+
+                        r.next = head;
+                        head = &r;
+                }
+
+                std::vector<seqnum_t> keys;
+                for (auto &r: v) {
+                        keys.push_back(r.seqnum);
+                }
+                std::shuffle(keys.begin(), keys.end(), rnd);
+
+                auto ops = bench::iterations(1 << 20);
+
+                auto table_ns = bench::measure(ops, [&] {
+                        for (size_t i = 0; i < ops; ++i) {
+                                bench::consume(t->find(keys[i % n])->seqnum);
+                        }
+                });
+
+                auto list_ops = std::max(ops/std::max(n/16, size_t(1)), size_t(1024));
+
+                auto list_ns = bench::measure(list_ops, [&] {
+                        for (size_t i = 0; i < list_ops; ++i) {
+                                bench::consume(list_find(head, keys[i % n])->seqnum);
+                        }
+                });
+
+                /*
+                 * Steady state: the oldest request is completed, a new one is submitted.
+                 */
+                size_t oldest = 0;
+
+                auto churn_ns = bench::measure(ops, [&] {
+                        for (size_t i = 0; i < ops; ++i) {
+                                auto &r = v[oldest];
+                                oldest = (oldest + 1) % n;
+
+                                bench::consume(t->remove(r.seqnum) == &r);
+                                r.seqnum = gen(i & 1);
+                                t->insert(r.seqnum, &r);
+                        }
+                });
+
+                CHECK(t->size() == n);
+                printf("%8zu %14.2f %14.2f %14.2f\n", n, table_ns, list_ns, churn_ns);
+        }
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+        std::mt19937 rnd(42);
+
+        check_capacity();
+        check_model(rnd);
+        check_collisions(rnd);
+        run_bench(rnd);
+}
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include "pdu_gen.h"
+
+#include <usbip/ret_parser.h>
+
+#include <algorithm>
+#include <random>
+
+/*
+ * Throughput of ret_parser for typical streams of USBIP_RET_* fed in chunks of different sizes,
+ * like the driver receives them into device_ctx::recv_buf.
+ */
+namespace
+{
+
+using namespace usbip;
+
+/*
+ * Copies the data and descriptors to their destination, as recv_pdu_handler does.
+ */
+struct copy_handler
+{
+        UINT8 *data;
+        UINT8 *isoc;
+
+        size_t pdus;
+        size_t data_bytes;
+        size_t last_data_len;
+
+        bool on_header(const usbip_header&, size_t data_len, size_t)
+        {
+                last_data_len = data_len;
+                return true;
+        }
+
+        void on_data(size_t offset, const void *src, size_t len)
+        {
+                memcpy(data + offset, src, len);
+                data_bytes += len;
+        }
+
+        void on_isoc(size_t offset, const void *src, size_t len) { memcpy(isoc + offset, src, len); }
+        void on_end() { ++pdus; }
+};
+
+struct workload
+{
+        const char *name;
+        INT32 actual_length;
+        INT32 isoc_cnt;
+        bool unlink;
+};
+
+void make_stream(bench::pdu_gen &g, const workload &w, size_t min_size)
+{
+        g.clear();
+
+        for (seqnum_t num = 1; g.size() < min_size; ++num) {
+                if (w.unlink) {
+                        g.ret_unlink(num << 1, 0);
+                } else {
+                        g.ret_submit(num << 1 | USBIP_DIR_IN, w.actual_length, w.isoc_cnt);
+                }
+        }
+}
+
+/*
+ * @return false if the parser failed
+ */
+auto parse(const bench::pdu_gen &g, size_t chunk, copy_handler &h)
+{
+        ret_parser p{};
+        h.pdus = 0;
+        h.data_bytes = 0;
+
+        auto &v = g.data();
+
+        for (size_t off = 0; off < v.size(); off += chunk) {
+                auto len = std::min(chunk, v.size() - off);
+                if (p.feed(h, v.data() + off, len) != parse_result::ok) {
+                        return false;
+                }
+        }
+
+        return !p.offset();
+}
+
+/*
+ * Records the events, the offsets must be contiguous.
+ */
+struct record_handler
+{
+        std::vector<UINT8> out; // headers, data and descriptors in the order of arrival
+        size_t pdus;
+
+        size_t data_offset;
+        size_t isoc_offset;
+
+        bool on_header(const usbip_header &hdr, size_t, size_t)
+        {
+                append(&hdr, sizeof(hdr));
+                data_offset = isoc_offset = 0;
+                return true;
+        }
+
+        void on_data(size_t offset, const void *src, size_t len)
+        {
+                CHECK(offset == data_offset);
+                data_offset += len;
+                append(src, len);
+        }
+
+        void on_isoc(size_t offset, const void *src, size_t len)
+        {
+                CHECK(offset == isoc_offset);
+                isoc_offset += len;
+                append(src, len);
+        }
+
+        void on_end() { ++pdus; }
+
+        void append(const void *p, size_t len)
+        {
+                auto src = static_cast<const UINT8*>(p);
+                out.insert(out.end(), src, src + len);
+        }
+};
+
+/*
+ * The same events for any chunking.
+ */
+void check_chunking(std::mt19937 &rnd)
+{
+        bench::pdu_gen g;
+
+        for (seqnum_t num = 1; num < 200; ++num) {
+                switch (rnd() % 4) {
+                case 0:
+                        g.ret_unlink(num << 1, -104); // -ECONNRESET
+                        break;
+                case 1:
+                        g.ret_submit(num << 1 | USBIP_DIR_IN, rnd() % 5000, 1 + rnd() % 8);
+                        break;
+                default:
+                        g.ret_submit(num << 1 | (rnd() & 1), rnd() % 5000);
+                }
+        }
+
+        auto parse_all = [&g] (auto next_chunk)
+        {
+                record_handler h{};
+                ret_parser p{};
+
+                auto &v = g.data();
+
+                for (size_t off = 0; off < v.size(); ) {
+                        auto len = std::min(next_chunk(), v.size() - off);
+                        CHECK(p.feed(h, v.data() + off, len) == parse_result::ok);
+                        off += len;
+                }
+
+                CHECK(!p.offset());
+                CHECK(h.pdus == g.count());
+
+                return h.out;
+        };
+
+        auto whole = parse_all([] { return ~size_t(0); });
+        auto chunked = parse_all([&rnd] { return size_t(1 + rnd() % 100); });
+
+        CHECK(whole == chunked);
+}
+
+void run_bench()
+{
+        const workload workloads[] {
+                { "RET_UNLINK", 0, number_of_packets_non_isoch, true },
+                { "interrupt IN 8", 8, number_of_packets_non_isoch, false },
+                { "bulk IN 512", 512, number_of_packets_non_isoch, false },
+                { "bulk IN 64K", 64*1024, number_of_packets_non_isoch, false },
+                { "isoch IN 32x1024", 32*1024, 32, false },
+        };
+
+        const size_t chunks[] { 1460, 16*1024, 64*1024 }; // MSS, RECV_BUF_SIZE-like, large
+
+        printf("%-18s", "GB/s");
+        for (auto c: chunks) {
+                printf("%12zu", c);
+        }
+        printf("%12s\n", "whole");
+
+        bench::pdu_gen g;
+
+        std::vector<UINT8> data(64*1024);
+        std::vector<UINT8> isoc(USBIP_MAX_ISO_PACKETS*sizeof(usbip_iso_packet_descriptor));
+
+        for (auto &w: workloads) {
+                make_stream(g, w, bench::iterations(8 << 20));
+                printf("%-18s", w.name);
+
+                for (size_t i = 0; i <= std::size(chunks); ++i) {
+                        auto chunk = i < std::size(chunks) ? chunks[i] : g.size();
+                        copy_handler h{};
+                        h.data = data.data();
+                        h.isoc = isoc.data();
+
+                        auto ns = bench::measure(0, [&] { CHECK(parse(g, chunk, h)); });
+
+                        CHECK(h.pdus == g.count());
+                        CHECK(h.data_bytes == (w.unlink ? 0 : g.count()*w.actual_length));
+                        bench::consume(data[h.last_data_len/2]);
+
+                        printf("%12.2f", g.size()/ns);
+                }
+
+                printf("\n");
+        }
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+        std::mt19937 rnd(42);
+
+        check_chunking(rnd);
+        run_bench();
+}
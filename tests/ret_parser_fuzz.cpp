@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+#include "pdu_gen.h"
+
+#include <usbip/ret_parser.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <random>
+
+/*
+ * Fuzz target for ret_parser, the input is an arbitrary stream from the server.
+ *
+ * With -DUSBIP_LIBFUZZER=ON and clang it is built for libFuzzer, otherwise the program feeds
+ * mutated valid streams and the files that are passed in the command line.
+ *
+ * The first byte of the input selects the sizes of the chunks. The stream is parsed until an error
+ * like the driver does, it closes the connection then. Sometimes the rest of a payload is skipped
+ * and the parser is reset, as for a payload that is received directly into its destination.
+ */
+namespace
+{
+
+using namespace usbip;
+
+struct check_handler
+{
+        const ret_parser *parser;
+
+        size_t data_len;
+        size_t isoc_len;
+
+        size_t data_offset; // expected
+        size_t isoc_offset;
+
+        bool in_pdu;
+
+        bool on_header(const usbip_header &hdr, size_t data_len, size_t payload_size)
+        {
+                CHECK(!in_pdu);
+                in_pdu = true;
+
+                auto &base = hdr.base;
+                CHECK(base.command == USBIP_RET_SUBMIT || base.command == USBIP_RET_UNLINK);
+                CHECK(base.seqnum >> 1);
+                CHECK(base.direction == (base.seqnum & 1));
+
+                if (base.command == USBIP_RET_SUBMIT) {
+                        auto &r = hdr.u.ret_submit;
+                        CHECK(is_valid_number_of_packets(r.number_of_packets));
+                        CHECK(base.direction == USBIP_DIR_OUT || r.actual_length >= 0);
+                        CHECK(data_len == (base.direction == USBIP_DIR_IN ? size_t(r.actual_length) : 0));
+                        CHECK(payload_size == data_len + r.number_of_packets*sizeof(usbip_iso_packet_descriptor));
+                } else {
+                        CHECK(!payload_size);
+                }
+
+                CHECK(parser->has_header());
+                CHECK(parser->total() == parser->hdr_size + payload_size);
+
+                this->data_len = data_len;
+                isoc_len = payload_size - data_len;
+                data_offset = isoc_offset = 0;
+
+                return true;
+        }
+
+        void on_data(size_t offset, const void*, size_t len)
+        {
+                CHECK(in_pdu);
+                CHECK(len && offset == data_offset && offset + len <= data_len);
+                data_offset += len;
+        }
+
+        void on_isoc(size_t offset, const void*, size_t len)
+        {
+                CHECK(in_pdu && data_offset == data_len);
+                CHECK(len && offset == isoc_offset && offset + len <= isoc_len);
+                isoc_offset += len;
+        }
+
+        void on_end()
+        {
+                CHECK(in_pdu && data_offset == data_len && isoc_offset == isoc_len);
+                in_pdu = false;
+        }
+};
+
+void fuzz(const UINT8 *data, size_t size)
+{
+        if (!size) {
+                return;
+        }
+
+        std::minstd_rand rnd(*data++);
+        --size;
+
+        ret_parser p{};
+        check_handler h{};
+        h.parser = &p;
+
+        while (size) {
+                auto len = std::min(size, size_t(1 + rnd() % 128));
+
+                auto res = p.feed(h, data, len);
+                data += len;
+                size -= len;
+
+                if (res != parse_result::ok) {
+                        CHECK(res != parse_result::aborted); // on_header always returns true
+                        CHECK(!p.offset());
+                        return;
+                }
+
+                CHECK(!p.offset() || p.offset() < p.total());
+                CHECK(p.offset() + p.remaining() == p.total());
+                CHECK(h.in_pdu == p.has_header());
+
+                if (p.has_header() && p.remaining() && !(rnd() % 4)) { // @see recv_buf_received
+                        auto skip = std::min(size, p.remaining());
+                        data += skip;
+                        size -= skip;
+
+                        p.reset();
+                        h.in_pdu = false;
+                }
+        }
+}
+
+/*
+ * Valid streams with a few bytes changed.
+ */
+void fuzz_mutations(std::mt19937 &rnd)
+{
+        for (auto i = bench::iterations(20'000); i; --i) {
+                bench::pdu_gen g;
+
+                for (auto cnt = 1 + rnd() % 8; cnt; --cnt) {
+                        auto seqnum = seqnum_t(rnd() % 8 ? rnd() : rnd() % 4); // zero counter is invalid
+
+                        switch (rnd() % 3) {
+                        case 0:
+                                g.ret_unlink(seqnum, 0);
+                                break;
+                        case 1:
+                                g.ret_submit(seqnum, rnd() % 2000, rnd() % 16);
+                                break;
+                        default:
+                                g.ret_submit(seqnum, rnd() % 2000);
+                        }
+                }
+
+                std::vector<UINT8> v(1, UINT8(rnd()));
+                v.insert(v.end(), g.data().begin(), g.data().end());
+
+                for (auto n = rnd() % 4; n; --n) {
+                        auto max_off = rnd() % 2 ? sizeof(usbip_header) : v.size() - 1; // the first header is preferred
+                        v[1 + rnd() % max_off] = UINT8(rnd());
+                }
+
+                if (rnd() % 2) {
+                        v.resize(1 + rnd() % v.size()); // truncated
+                }
+
+                fuzz(v.data(), v.size());
+        }
+}
+
+} // namespace
+
+
+extern "C" int LLVMFuzzerTestOneInput(const UINT8 *data, size_t size)
+{
+        fuzz(data, size);
+        return 0;
+}
+
+#ifndef USBIP_LIBFUZZER
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+
+        for (int i = 1; i < argc; ++i) {
+                if (*argv[i] != '-') {
+                        std::ifstream f(argv[i], std::ios::binary);
+                        std::vector<UINT8> v(std::istreambuf_iterator<char>(f), {});
+                        fuzz(v.data(), v.size());
+                }
+        }
+
+        std::mt19937 rnd(42);
+        fuzz_mutations(rnd);
+}
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2023 Vadym Hrynchyshyn <vadimgrn@gmail.com>
+ */
+
+#include "bench.h"
+
+#include <ude/mpsc_queue.h>
+#include <ude/send_sched.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Cancellation of URBs whose CMD_SUBMIT-s wait in device_ctx::sendq, as device::remove_unsent does it:
+ * the owner flag is taken with mpsc_queue::drain, the PDUs of an endpoint are taken back
+ * from the queue and send_scheduler, only then their requests are completed.
+ *
+ * Producers (endpoints) push PDUs while the number of WskSend-s in flight is limited, so most of them wait
+ * in the scheduler. A canceller takes PDUs of a random endpoint. Checks that a PDU is either sent or cancelled,
+ * never both, a cancelled one is not sent afterwards, the PDUs of an endpoint are sent in order
+ * and nothing is left behind.
+ */
+namespace
+{
+
+using namespace usbip;
+using namespace std::chrono_literals;
+
+enum { ENDPOINTS = 8, IN_FLIGHT_MAX = 2 };
+enum state { QUEUED, SENT, CANCELLED };
+
+struct node // wsk_context
+{
+        node *next;
+        unsigned long send_len;
+        unsigned long send_quantum;
+        unsigned char send_slot; // endpoint
+        unsigned char send_class;
+
+        unsigned int seq; // of the endpoint
+        std::atomic<int> state; // of the request
+};
+
+using queue = mpsc_queue<node, &node::next>;
+using scheduler = send_scheduler<node, ENDPOINTS, 2>;
+
+struct sender
+{
+        queue q{}; // must be zero-initialized
+        scheduler sched{}; // of the owner
+        std::atomic<unsigned int> backlog;
+
+        std::atomic<int> in_flight;
+        std::mutex lock; // for sent
+        std::vector<node*> sent; // are completed by completer thread
+
+        unsigned int next_seq[ENDPOINTS]; // at least, cancelled PDUs make gaps; of the owner
+
+        std::atomic<size_t> completed;
+        std::atomic<size_t> cancelled;
+
+        auto can() const { return (!q.empty() || backlog) && in_flight < IN_FLIGHT_MAX; }
+
+        void send_queued()
+        {
+                q.consume([this] { return can(); }, [this] (auto head) { dispatch(head); });
+        }
+
+        void schedule(node *head)
+        {
+                for (auto n = head; n; ) {
+                        auto next = n->next;
+                        sched.push(n);
+                        n = next;
+                }
+        }
+
+        void dispatch(node *head)
+        {
+                schedule(head);
+
+                while (in_flight < IN_FLIGHT_MAX) {
+                        auto n = sched.pop();
+                        if (!n) {
+                                break;
+                        }
+
+                        CHECK(n->seq >= next_seq[n->send_slot]);
+                        next_seq[n->send_slot] = n->seq + 1;
+
+                        int expected = QUEUED;
+                        CHECK(n->state.compare_exchange_strong(expected, SENT)); // was not cancelled
+
+                        ++in_flight;
+                        std::lock_guard lck(lock);
+                        sent.push_back(n);
+                }
+
+                backlog = sched.size();
+        }
+
+        /*
+         * on_wsk_send_complete
+         */
+        bool complete()
+        {
+                node *n{};
+                {
+                        std::lock_guard lck(lock);
+                        if (sent.empty()) {
+                                return false;
+                        }
+                        n = sent.back();
+                        sent.pop_back();
+                }
+
+                CHECK(n->state == SENT);
+                ++completed;
+
+                --in_flight;
+                send_queued();
+                return true;
+        }
+
+        /*
+         * device::remove_unsent
+         */
+        void cancel(unsigned char slot)
+        {
+                node *removed{};
+
+                q.drain([this, slot, &removed] (auto head)
+                {
+                        schedule(head);
+                        removed = sched.remove_if([slot] (auto n) { return n->send_slot == slot; });
+                        backlog = sched.size();
+                });
+
+                unsigned int prev = 0;
+
+                for (auto n = removed; n; n = n->next) {
+                        CHECK(n->send_slot == slot);
+                        CHECK(n == removed || n->seq > prev); // FIFO order is kept
+                        prev = n->seq;
+
+                        int expected = QUEUED;
+                        CHECK(n->state.compare_exchange_strong(expected, CANCELLED)); // will not be sent
+                        ++cancelled;
+                }
+
+                send_queued();
+        }
+};
+
+void produce(sender &s, unsigned char slot, std::vector<node> &nodes)
+{
+        for (unsigned int i = 0; i < nodes.size(); ++i) {
+                auto &n = nodes[i];
+
+                n.send_len = 512 + 512*(i % 8);
+                n.send_quantum = 4096;
+                n.send_slot = slot;
+                n.send_class = slot % 2;
+                n.seq = i;
+
+                s.q.push(&n);
+                s.send_queued();
+        }
+}
+
+void check_remove_if()
+{
+        scheduler sched{};
+        node nodes[30]{};
+
+        auto push = [&sched, &nodes] (unsigned int first, unsigned int last)
+        {
+                for (auto i = first; i < last; ++i) {
+                        auto &n = nodes[i];
+                        n.send_len = 1;
+                        n.send_slot = (unsigned char)(i % 3);
+                        n.seq = i;
+                        sched.push(&n);
+                }
+        };
+
+        push(0, 24);
+
+        auto removed = sched.remove_if([] (auto n) { return n->send_slot == 1 || n->seq % 4 == 0; });
+        CHECK(sched.size() == 12);
+
+        push(24, 30); // FIFO of slot 1 is empty, the others are not
+        CHECK(sched.size() == 18);
+
+        unsigned int cnt = 0;
+        for (auto n = removed; n; n = n->next, ++cnt) {
+                CHECK(n->send_slot == 1 || n->seq % 4 == 0);
+                CHECK(!n->next || n->next->send_slot > n->send_slot || n->next->seq > n->seq);
+        }
+        CHECK(cnt == 12);
+
+        unsigned int last[3]{};
+        bool seen[3]{};
+        cnt = 0;
+
+        while (auto n = sched.pop()) {
+                CHECK(n->seq >= 24 || (n->send_slot != 1 && n->seq % 4));
+                CHECK(!seen[n->send_slot] || n->seq > last[n->send_slot]);
+                last[n->send_slot] = n->seq;
+                seen[n->send_slot] = true;
+                ++cnt;
+        }
+        CHECK(cnt == 18);
+        CHECK(sched.empty());
+
+        CHECK(!sched.remove_if([] (auto) { return true; }));
+}
+
+/*
+ * @return cancelled PDUs
+ */
+auto run(size_t per_endpoint)
+{
+        auto s = std::make_unique<sender>();
+        std::vector<std::vector<node>> nodes(ENDPOINTS);
+        for (auto &v: nodes) {
+                v = std::vector<node>(per_endpoint);
+        }
+
+        std::atomic<bool> done{};
+
+        std::thread completer([&s, &done] {
+                while (!done || s->in_flight) {
+                        if (!s->complete()) {
+                                std::this_thread::yield();
+                        }
+                }
+        });
+
+        std::thread canceller([&s, &done] {
+                for (unsigned int i = 0; !done; ++i) {
+                        s->cancel((unsigned char)(i % ENDPOINTS));
+                        std::this_thread::sleep_for(50us);
+                }
+        });
+
+        {
+                std::vector<std::thread> v;
+                for (unsigned int i = 0; i < ENDPOINTS; ++i) {
+                        v.emplace_back(produce, std::ref(*s), (unsigned char)i, std::ref(nodes[i]));
+                }
+
+                for (auto &t: v) {
+                        t.join();
+                }
+        }
+
+        auto total = ENDPOINTS*per_endpoint;
+
+        for (auto deadline = std::chrono::steady_clock::now() + 60s; s->completed + s->cancelled != total; ) {
+                CHECK(std::chrono::steady_clock::now() < deadline);
+                s->send_queued();
+                std::this_thread::yield();
+        }
+
+        done = true;
+        canceller.join();
+        completer.join();
+
+        CHECK(s->q.empty());
+        CHECK(s->sched.empty());
+        CHECK(s->completed + s->cancelled == total);
+
+        for (auto &v: nodes) {
+                for (auto &n: v) {
+                        CHECK(n.state != QUEUED);
+                }
+        }
+
+        return s->cancelled.load();
+}
+
+} // namespace
+
+
+int main(int argc, char *argv[])
+{
+        bench::parse_args(argc, argv);
+        check_remove_if();
+
+        auto per_endpoint = bench::iterations(20'000);
+        auto start = std::chrono::steady_clock::now();
+
+        auto cancelled = run(per_endpoint);
+
+        std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+        printf("%zu PDUs, %zu cancelled while queued, %.1f ms\n", ENDPOINTS*per_endpoint, cancelled, ms.count());
+}
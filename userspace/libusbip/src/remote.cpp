@@ -10,7 +10,7 @@
 #include "strconv.h"
 #include "output.h"
 
-#include <usbip\proto_op.h>
+#include <usbip\codec.h>
 
 #include <chrono>
 
@@ -132,7 +132,7 @@ auto send_op_common(_In_ SOCKET s, _In_ uint16_t code)
 		.status = ST_OK
 	};
 
-	PACK_OP_COMMON(true, &r);
+	wire::byteswap(r);
 	return send(s, &r, sizeof(r));
 }
 
@@ -142,7 +142,7 @@ auto recv_op_common(_In_ SOCKET s, _In_ uint16_t expected_code)
 
 	op_common r{};
 	if (recv(s, &r, sizeof(r))) {
-		PACK_OP_COMMON(false, &r);
+		wire::byteswap(r);
 	} else {
 		return GetLastError();
 	}
@@ -259,7 +259,7 @@ bool usbip::enum_exportable_devices(
 	op_devlist_reply reply{};
 	
 	if (recv(s, &reply, sizeof(reply))) {
-		PACK_OP_DEVLIST_REPLY(false, &reply);
+		wire::byteswap(reply);
 	} else {
 		return false;
 	}
@@ -278,7 +278,7 @@ bool usbip::enum_exportable_devices(
 		usbip_usb_device dev{};
 
 		if (recv(s, &dev, sizeof(dev))) {
-			usbip_net_pack_usb_device(false, &dev);
+			wire::byteswap(dev);
 			lib_dev = as_usb_device(dev);
 			on_dev(i, lib_dev);
 		} else {
@@ -290,7 +290,7 @@ bool usbip::enum_exportable_devices(
 			usbip_usb_interface intf{};
 
 			if (recv(s, &intf, sizeof(intf))) {
-				usbip_net_pack_usb_interface(false, &intf);
+				wire::byteswap(intf);
 				static_assert(sizeof(intf) == sizeof(usb_interface));
 				on_intf(i, lib_dev, j, reinterpret_cast<usb_interface&>(intf));
 			} else {
@@ -248,6 +248,51 @@ int usbip::vhci::attach(_In_ HANDLE dev, _In_ const device_location &location)
         return 0;
 }
 
+std::vector<usbip::vhci::attach_result> usbip::vhci::attach(
+        _In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success)
+{
+        success = false;
+        std::vector<attach_result> result;
+
+        auto cnt = static_cast<ULONG>(locations.size());
+        if (!cnt) {
+                success = true;
+                return result;
+        }
+
+        std::vector<char> buf(ioctl::plugin_hardware_batch_size(cnt));
+
+        auto r = reinterpret_cast<ioctl::plugin_hardware_batch*>(buf.data());
+        r->size = sizeof(*r);
+        r->count = cnt;
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                if (!assign(r->devices[i], locations[i])) {
+                        SetLastError(ERROR_INVALID_PARAMETER);
+                        return result;
+                }
+        }
+
+        if (DWORD BytesReturned; // must be set if the last arg is NULL
+            !DeviceIoControl(dev, ioctl::PLUGIN_HARDWARE_BATCH, buf.data(), DWORD(buf.size()), 
+                             buf.data(), DWORD(buf.size()), &BytesReturned, nullptr)) {
+                return result;
+        } else if (BytesReturned != buf.size()) [[unlikely]] {
+                SetLastError(USBIP_ERROR_DRIVER_RESPONSE);
+                return result;
+        }
+
+        result.reserve(cnt);
+
+        for (ULONG i = 0; i < cnt; ++i) {
+                auto &d = r->devices[i];
+                result.push_back({ .port = d.port, .error = d.status });
+        }
+
+        success = true;
+        return result;
+}
+
 bool usbip::vhci::detach(_In_ HANDLE dev, _In_ int port)
 {
         ioctl::plugout_hardware r { .port = port };
@@ -280,6 +325,31 @@ USBIP_API bool usbip::vhci::get_device_state(
         return true;
 }
 
+USBIP_API DWORD usbip::vhci::get_device_state_ex_size() noexcept
+{
+        return sizeof(vhci::device_state_ex);
+}
+
+USBIP_API bool usbip::vhci::get_device_state(
+        _Out_ usbip::device_state_ex &result, _In_ const void *data, _In_ DWORD length)
+{
+        auto r = reinterpret_cast<const vhci::device_state_ex*>(data);
+        assert(get_device_state_ex_size() == sizeof(*r));
+
+        if (!(r && (length == sizeof(*r) || length == sizeof(vhci::device_state)))) {
+                SetLastError(ERROR_INVALID_PARAMETER);
+                return false;
+        } else if (r->size != length) {
+                SetLastError(USBIP_ERROR_ABI);
+                return false;
+        }
+
+        static_cast<usbip::device_state&>(result) = make_device_state(*r);
+        result.timestamp = length == sizeof(*r) ? r->timestamp : 0;
+
+        return true;
+}
+
 /*
  * ReadFile returns TRUE for STATUS_END_OF_FILE.
  * @see UDE driver, EVT_WDF_IO_QUEUE_IO_READ
@@ -297,3 +367,17 @@ bool usbip::vhci::read_device_state(_In_ HANDLE dev, _Out_ usbip::device_state &
                 return get_device_state(result, &r, actual);
         }
 }
+
+bool usbip::vhci::read_device_state(_In_ HANDLE dev, _Out_ usbip::device_state_ex &result)
+{
+        vhci::device_state_ex r;
+
+        if (DWORD actual; !ReadFile(dev, &r, sizeof(r), &actual, nullptr)) {
+                return false;
+        } else if (!actual) {
+                SetLastError(ERROR_HANDLE_EOF);
+                return false;
+        } else {
+                return get_device_state(result, &r, actual);
+        }
+}
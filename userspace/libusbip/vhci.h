@@ -45,6 +45,11 @@ struct device_state
         state state;
 };
 
+struct device_state_ex : device_state
+{
+        UINT64 timestamp; // interrupt time in 100-nanosecond units, @see QueryInterruptTime
+};
+
 } // namespace usbip
 
 
@@ -72,6 +77,22 @@ USBIP_API std::vector<imported_device> get_imported_devices(_In_ HANDLE dev, _Ou
  */
 USBIP_API int attach(_In_ HANDLE dev, _In_ const device_location &location);
 
+struct attach_result
+{
+        int port; // hub port number, >= 1 or zero if error is set
+        DWORD error; // pass to GetLastError() formatting functions
+};
+
+/**
+ * Remote devices are attached concurrently by the driver.
+ * @param dev handle of the driver device
+ * @param locations remote devices to attach to, USBIP_ERROR_PORTFULL is returned for ones beyond the number of hub ports
+ * @param success call GetLastError() if false is returned
+ * @return result for each location in the same order
+ */
+USBIP_API std::vector<attach_result> attach(
+        _In_ HANDLE dev, _In_ const std::vector<device_location> &locations, _Out_ bool &success);
+
 /**
  * @param dev handle of the driver device
  * @param port hub port number, <= 0 means detach all ports
@@ -98,6 +119,20 @@ USBIP_API DWORD get_device_state_size() noexcept;
  */
 USBIP_API bool get_device_state(_Out_ device_state &result, _In_ const void *data, _In_ DWORD length);
 
+/**
+ * Read this number of bytes and pass them to get_device_state() that fills device_state_ex
+ * @return bytes to read from the device handle, constant
+ */
+USBIP_API DWORD get_device_state_ex_size() noexcept;
+
+/**
+ * @param result constructed from passed data, timestamp is zero if data is device_state
+ * @param data that was read from the device handle
+ * @param length data length, must be equal to get_device_state_ex_size() or get_device_state_size()
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool get_device_state(_Out_ device_state_ex &result, _In_ const void *data, _In_ DWORD length);
+
 /**
  * @param dev handle of the driver device that must be opened for serialized I/O
  * @param result data that was obtained by read operation on the given handle
@@ -105,4 +140,11 @@ USBIP_API bool get_device_state(_Out_ device_state &result, _In_ const void *dat
  */
 USBIP_API bool read_device_state(_In_ HANDLE dev, _Out_ device_state &result);
 
+/**
+ * @param dev handle of the driver device that must be opened for serialized I/O
+ * @param result data that was obtained by read operation on the given handle, with the time of the change
+ * @return call GetLastError() if false is returned
+ */
+USBIP_API bool read_device_state(_In_ HANDLE dev, _Out_ device_state_ex &result);
+
 } // namespace usbip::vhci
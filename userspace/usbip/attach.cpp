@@ -13,20 +13,35 @@ namespace
 
 using namespace usbip;
 
+/*
+ * The devices are attached concurrently by one call.
+ */
 auto attach_stashed_devices(HANDLE dev)
 {
         bool success;
         
-        if (auto v = vhci::get_persistent(dev, success); !success) {
+        auto v = vhci::get_persistent(dev, success);
+        if (!success) {
+                spdlog::error(GetLastErrorMsg());
+                return false;
+        }
+
+        auto result = vhci::attach(dev, v, success);
+        if (!success) {
                 spdlog::error(GetLastErrorMsg());
-        } else for (auto &i: v) {
-                printf("%s:%s/%s\n", i.hostname.c_str(), i.service.c_str(), i.busid.c_str());
-                if (!vhci::attach(dev, i)) {
-                        spdlog::error(GetLastErrorMsg());
+                return false;
+        }
+
+        for (size_t i = 0; i < v.size(); ++i) {
+                auto &loc = v[i];
+                printf("%s:%s/%s\n", loc.hostname.c_str(), loc.service.c_str(), loc.busid.c_str());
+
+                if (auto &r = result[i]; !r.port) {
+                        spdlog::error(GetLastErrorMsg(r.error));
                 }
         }
 
-        return success;
+        return true;
 }
 
 } // namespace